@@ -1,10 +1,33 @@
-
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <util/atomic.h>
 
-// Current time -- DO NOT ACCESS DIRECTLY
-volatile uint16_t current_time = 0u;
+#include "clock.h"
+
+// Microseconds in `ticks` timer ticks
+#define TICKS_TO_US(ticks) ((uint32_t)(ticks) * CLOCK_PRESCALER / (F_CPU / 1000000))
+
+static_assert((uint32_t)CLOCK_PERIOD_TICKS * CLOCK_PRESCALER % (F_CPU / 1000000) == 0,
+              "The clock period must be a whole number of microseconds");
+
+// Clock periods since the clock started, wrapping at 16 bits.
+// This is the only thing the interrupt changes -- read with read_timer().
+volatile uint16_t clock_periods = 0u;
+
+// The time at the start of clock period `base_period`: milliseconds, and microseconds past that.
+// Only changed from the program loop, by clock_run() and clock_sync().
+uint32_t base_ms = 0u;
+uint16_t base_us = 0u;
+uint16_t base_period = 0u;
+
+// The timer at the last clock_stamp()
+volatile uint16_t stamp_periods = 0u;
+volatile uint8_t stamp_tick = 0u;
+
+// The stamp at the end of the last sync message (see clock_latch)
+uint16_t latch_periods = 0u;
+uint8_t latch_tick = 0u;
+uint32_t latch_before_us = 0u;
 
 /**
  * Initialize the timer interrupt.
@@ -13,26 +36,167 @@ volatile uint16_t current_time = 0u;
 void start_clock() {
   TIMSK2 |= (1 << OCIE2A);  // Enabled timer
   TCCR2A |= ( 1 << WGM21);  // Timer waveform mode: CTC
-  TCCR2B |= (1 << CS22) | (1 << CS21); // Prescaler: 256
+  TCCR2B |= (1 << CS22) | (1 << CS20); // Prescaler: 128
 
-  // Fire interrupt every 1ms: (CLK_FREQ * seconds) / TIMER_PRESCALER
-  OCR2A = (F_CPU * 1/1000) / 256;
+  // Roll over every CLOCK_PERIOD_TICKS
+  // (the timer counts from 0 to OCR2A, inclusive)
+  OCR2A = CLOCK_PERIOD_TICKS - 1;
 
   sei();
 }
 
+/**
+ * Add microseconds to a millisecond time.
+ */
+static uint32_t add_us(uint32_t ms, uint32_t us, uint16_t *us_out) {
+  // Usually only a clock period or two, so skip the (slow) division
+  if (us >= 10000) {
+    ms += us / 1000;
+    us %= 1000;
+  }
+  while (us >= 1000) {
+    us -= 1000;
+    ms++;
+  }
+  *us_out = us;
+  return ms;
+}
+
+/**
+ * The timer has rolled over, but the interrupt hasn't run yet
+ * (only possible when interrupts are disabled).
+ */
+static inline uint8_t timer_rolled(uint8_t tick) {
+  return (TIFR2 & (1 << OCF2A)) && tick < CLOCK_PERIOD_TICKS / 2;
+}
+
+/**
+ * Read the clock period count and the timer.
+ * If the interrupt changes the count while we're reading, read it again.
+ */
+static uint16_t read_timer(uint8_t *tick) {
+  uint16_t periods;
+  uint8_t t;
+
+  do {
+    periods = clock_periods;
+    t = TCNT2;
+  } while (periods != clock_periods);
+
+  if (timer_rolled(t)) {
+    periods++;
+  }
+  *tick = t;
+  return periods;
+}
+
+/**
+ * Read the current time, in milliseconds and microseconds past that.
+ */
+static uint32_t read_time(uint16_t *us) {
+  uint8_t tick;
+  uint16_t periods = read_timer(&tick);
+
+  return add_us(base_ms,
+                base_us + (uint32_t)(uint16_t)(periods - base_period) * CLOCK_PERIOD_US + TICKS_TO_US(tick),
+                us);
+}
+
 /**
  * Returns the current time in milliseconds.
  */
-volatile uint16_t millis() {
-  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
-    return current_time;
+uint32_t millis() {
+  uint16_t us;
+  return read_time(&us);
+}
+
+/**
+ * Returns the current time in microseconds.
+ */
+uint32_t micros() {
+  uint16_t us;
+  uint32_t ms = read_time(&us);
+  return ms * 1000 + us;
+}
+
+/**
+ * Returns the number of timer ticks.
+ * Unlike the time, this keeps counting evenly through clock_sync().
+ */
+uint16_t clock_ticks() {
+  uint8_t tick;
+  uint16_t periods = read_timer(&tick);
+  return periods * CLOCK_PERIOD_TICKS + tick;
+}
+
+/**
+ * Returns the number of clock periods.
+ */
+uint16_t clock_period_count() {
+  uint8_t tick;
+  return read_timer(&tick);
+}
+
+/**
+ * Move the time at the start of the period forward, so the
+ * period count doesn't get too far from it.
+ */
+void clock_run() {
+  uint8_t tick;
+  uint16_t periods = read_timer(&tick),
+           elapsed = periods - base_period;
+
+  if (elapsed == 0) return;
+
+  base_ms = add_us(base_ms, base_us + (uint32_t)elapsed * CLOCK_PERIOD_US, &base_us);
+  base_period = periods;
+}
+
+/**
+ * Note when a byte was received.
+ * This is called from an interrupt, so it only saves the timer.
+ */
+void clock_stamp() {
+  uint8_t tick = TCNT2;
+  uint16_t periods = clock_periods;
+
+  if (timer_rolled(tick)) {
+    periods++;
   }
+  stamp_periods = periods;
+  stamp_tick = tick;
+}
+
+/**
+ * Save the last stamp for clock_sync(), before the next byte replaces it.
+ */
+void clock_latch(uint32_t before_us) {
+  latch_periods = stamp_periods;
+  latch_tick = stamp_tick;
+  latch_before_us = before_us;
+}
+
+/**
+ * Sync the clock, so the latched stamp was at `time`.
+ * The timer keeps running; the time at the start of this period is set to match.
+ */
+void clock_sync(uint32_t time) {
+  uint8_t tick;
+  uint16_t periods = read_timer(&tick);
+
+  // Microseconds since the end of the message
+  uint32_t ticks = (uint32_t)(uint16_t)(periods - latch_periods) * CLOCK_PERIOD_TICKS + tick - latch_tick;
+  uint32_t elapsed = TICKS_TO_US(ticks) + latch_before_us;
+
+  // Back to the start of this period (starting from 2ms early, so it can't go negative)
+  base_ms = add_us(time - 2, elapsed + 2000 - TICKS_TO_US(tick), &base_us);
+  base_period = periods;
 }
 
 /**
- * Interrupt to keep the current time in milliseconds.
+ * Interrupt at the end of every clock period.
+ * It only counts them: everything else is worked out when the time is read.
  */
 ISR(TIMER2_COMPA_vect) {
-  current_time += 1;
+  clock_periods++;
 }
@@ -1,15 +1,61 @@
 /**
- * Keeps the currrent time in milliseconds.
- * This uses Timer 2 to keep track of time.
+ * Keeps the currrent time in milliseconds and microseconds.
+ *
+ * Timer 2 counts in 6.4us steps (at 20MHz), so that's the resolution of the time.
+ * It rolls over every CLOCK_PERIOD_US (1.6ms, 625 times a second), which is the only
+ * time its interrupt runs, and all the interrupt does is count the periods (16 bits).
+ * The time is worked out from the count and the timer when it's read, and
+ * clock_run() moves it along from the program loop.
+ *
+ * The time can be synced to master's clock (see clock_sync), so all nodes
+ * on the floor share the same timebase.
  */
 
 #ifndef CLOCK_H
 #define CLOCK_H
 
+// Timer 2 prescaler, and how many timer ticks are in a clock period
+#define CLOCK_PRESCALER    128
+#define CLOCK_PERIOD_TICKS 250
+
+// Clock period: how often the timer interrupt runs (1600us at 20MHz)
+#define CLOCK_PERIOD_US ((uint32_t)CLOCK_PERIOD_TICKS * CLOCK_PRESCALER / (F_CPU / 1000000))
+
+// Timer ticks per second (see clock_ticks)
+#define CLOCK_TICK_RATE (F_CPU / CLOCK_PRESCALER)
+
 // Start the clock
 void start_clock();
 
-// Return the current millisecond count
-volatile uint16_t millis();
+// Keep the time up to date with the clock periods counted by the interrupt.
+// Call this from the program loop, at least every 100 seconds (the period count wraps).
+void clock_run();
+
+// Return the current millisecond count (wraps every 49 days)
+uint32_t millis();
+
+// Return the current microsecond count (wraps every 71 minutes)
+uint32_t micros();
+
+// Return a free running count of timer ticks, which wraps at 16 bits (every 419ms at 20MHz).
+// This is quick enough to call from an interrupt, for timing short gaps.
+uint16_t clock_ticks();
+
+// Return the number of clock periods, which wraps at 16 bits.
+uint16_t clock_period_count();
+
+// Note the time a byte was received on the bus.
+// Call this from the RX interrupt (see MultidropDataUart::setRxHandler).
+void clock_stamp();
+
+// Latch the last clock_stamp(), less `before_us` microseconds, as the time a sync
+// message ended. Call it, with interrupts disabled, as soon as the message has been
+// parsed. `before_us` is how long it took to receive the bytes that came in after it.
+void clock_latch(uint32_t before_us);
+
+// Set the clock so that the latched stamp (see clock_latch) was at `time` (milliseconds).
+// The message's last byte sets the time, no matter how long it took to get around
+// to handling it.
+void clock_sync(uint32_t time);
 
 #endif
@@ -0,0 +1,150 @@
+
+#include <avr/io.h>
+
+#include "pwm.h"
+#include "effect.h"
+
+// The running effect
+uint8_t effect_type = EFFECT_NONE;
+uint8_t effect_a[3];
+uint8_t effect_b[3];
+uint8_t effect_param;
+uint16_t effect_period;
+
+// This node's offset in the period (milliseconds), and when the LED was last updated
+uint16_t effect_offset;
+uint32_t effect_time;
+
+// For EFFECT_FLASH: the last touch sensor value, and when the flash started
+uint8_t effect_touched;
+uint32_t effect_flash_time;
+
+/**
+ * Start an effect.
+ */
+void effect_start(uint8_t *data, uint8_t address, uint32_t current_time) {
+  uint16_t period = (data[7] << 8) | data[8];
+
+  if (data[0] == EFFECT_NONE || period == 0) {
+    effect_stop();
+    return;
+  }
+
+  effect_type = data[0];
+  effect_a[0] = data[1];
+  effect_a[1] = data[2];
+  effect_a[2] = data[3];
+  effect_b[0] = data[4];
+  effect_b[1] = data[5];
+  effect_b[2] = data[6];
+  effect_period = period;
+  effect_param = data[10];
+  effect_time = current_time - 1; // Update on the next run
+  effect_touched = 0;
+  effect_flash_time = current_time - period; // The flash starts out done
+
+  // Offset this node in the period: (address * phase / 256) periods
+  uint8_t phase = address * data[9];
+  effect_offset = ((uint32_t)phase * period) >> 8;
+}
+
+/**
+ * Stop the effect where it is.
+ */
+void effect_stop() {
+  effect_type = EFFECT_NONE;
+}
+
+/**
+ * Is an effect running.
+ */
+uint8_t effect_running() {
+  return effect_type != EFFECT_NONE;
+}
+
+/**
+ * Mix color A and B: level 255 is all A, and 0 is all B.
+ */
+static void effect_mix(uint8_t level, uint8_t *rgb) {
+  for (uint8_t i = 0; i < 3; i++) {
+    rgb[i] = effect_b[i] + (((int32_t)effect_a[i] - effect_b[i]) * level) / 255;
+  }
+}
+
+/**
+ * The color wheel: red to green to blue, and back to red.
+ */
+static void effect_wheel(uint8_t pos, uint8_t brightness, uint8_t *rgb) {
+  uint8_t up, down;
+
+  if (pos < 85) {
+    up = pos * 3;
+    down = 255 - up;
+    rgb[0] = down; rgb[1] = up; rgb[2] = 0;
+  } else if (pos < 170) {
+    up = (pos - 85) * 3;
+    down = 255 - up;
+    rgb[0] = 0; rgb[1] = down; rgb[2] = up;
+  } else {
+    up = (pos - 170) * 3;
+    down = 255 - up;
+    rgb[0] = up; rgb[1] = 0; rgb[2] = down;
+  }
+
+  for (uint8_t i = 0; i < 3; i++) {
+    rgb[i] = ((uint16_t)rgb[i] * (brightness + 1)) >> 8;
+  }
+}
+
+/**
+ * Update the LED for the current time.
+ */
+void effect_run(uint32_t current_time, uint8_t touched) {
+  if (effect_type == EFFECT_NONE || current_time == effect_time) return;
+  effect_time = current_time;
+
+  // Where we are in the period (milliseconds)
+  uint16_t ms;
+  if (effect_type == EFFECT_FLASH) {
+    // A new touch restarts the flash
+    if (touched && !effect_touched) {
+      effect_flash_time = current_time;
+    }
+    effect_touched = touched;
+
+    uint32_t elapsed = current_time - effect_flash_time;
+    ms = (elapsed < effect_period) ? elapsed : effect_period - 1;
+  }
+  else {
+    ms = (current_time + effect_offset) % effect_period;
+  }
+
+  // How far we are through the period (0 - 255)
+  uint8_t pos = ((uint32_t)ms << 8) / effect_period;
+  uint8_t rgb[3];
+
+  switch (effect_type) {
+    case EFFECT_PULSE:
+    case EFFECT_FLASH:
+      effect_mix(255 - pos, rgb);
+    break;
+    case EFFECT_STROBE:
+      effect_mix((pos < effect_param) ? 255 : 0, rgb);
+    break;
+    case EFFECT_BREATHE: {
+      // Triangle wave, squared so it eases in and out at the dim end
+      uint8_t level = (pos < 128) ? pos * 2 : (255 - pos) * 2;
+      effect_mix(((uint16_t)level * level) / 255, rgb);
+    }
+    break;
+    case EFFECT_CYCLE:
+      effect_wheel(pos, effect_param, rgb);
+    break;
+    default:
+      return;
+  }
+
+  red_pwm(rgb[0]);
+  green_pwm(rgb[1]);
+  blue_pwm(rgb[2]);
+}
@@ -0,0 +1,45 @@
+/**
+ * Runs repeating light effects on the node, so the LED keeps animating
+ * without master sending every frame.
+ *
+ * Effects are started with the CMD_SET_EFFECT data (EFFECT_DATA_LEN bytes):
+ *   0:   Effect type (see below)
+ *   1-3: Color A (RGB)
+ *   4-6: Color B (RGB)
+ *   7-8: Period, in milliseconds (MSB first)
+ *   9:   Phase offset per node address, in 1/256ths of the period.
+ *        (i.e. with 16, each node runs 1/16 of a period behind the one before it)
+ *   10:  Effect parameter (see below)
+ */
+
+#ifndef EFFECT_H
+#define EFFECT_H
+
+// Effect types
+#define EFFECT_NONE    0 // Stop the effect
+#define EFFECT_PULSE   1 // Jump to color A, then fade to color B over the period
+#define EFFECT_STROBE  2 // Color A for parameter/256 of the period, then color B
+#define EFFECT_BREATHE 3 // Ease from color B to color A and back, over the period
+#define EFFECT_CYCLE   4 // Go around the color wheel over the period, at parameter brightness
+#define EFFECT_FLASH   5 // Show color B, and when touched, flash color A and fade back to B over the period
+
+// Length of the CMD_SET_EFFECT data
+#define EFFECT_DATA_LEN 11
+
+// Start an effect from the CMD_SET_EFFECT data.
+// Effects follow the clock, rather than when they were started, so nodes running the
+// same effect stay in step once their clocks are synced. The node address sets how far
+// this node is offset from that.
+void effect_start(uint8_t *data, uint8_t address, uint32_t current_time);
+
+// Stop the effect, leaving the LED at its current color
+void effect_stop();
+
+// Returns true while an effect is running
+uint8_t effect_running();
+
+// Update the LED for the current time. Call this from the program loop.
+//   * touched: The current touch sensor value (for EFFECT_FLASH)
+void effect_run(uint32_t current_time, uint8_t touched);
+
+#endif
@@ -0,0 +1,87 @@
+
+#include <avr/io.h>
+
+#include "pwm.h"
+#include "clock.h"
+#include "fade.h"
+
+// Fade state. The colors are 8.16 fixed point, so slow fades still move a little every clock period.
+uint16_t fade_remaining = 0u;
+uint16_t fade_period = 0u; // The clock period the fade was last moved forward at
+int32_t fade_value[3];
+int32_t fade_step[3];
+uint8_t fade_target[3];
+
+/**
+ * Start fading to a color, from whatever the LED is showing now
+ * (which might be the middle of another fade).
+ */
+void fade_to(uint8_t *rgb, uint16_t duration) {
+  uint16_t steps;
+  uint8_t current[3];
+
+  fade_remaining = 0;
+  current[0] = OCR0A;
+  current[1] = OCR0B;
+  current[2] = OCR1A;
+
+  if (duration == 0) {
+    red_pwm(rgb[0]);
+    green_pwm(rgb[1]);
+    blue_pwm(rgb[2]);
+    return;
+  }
+
+  // One step per clock period, from the next one
+  steps = ((uint32_t)duration * 1000 + CLOCK_PERIOD_US - 1) / CLOCK_PERIOD_US;
+  for (uint8_t i = 0; i < 3; i++) {
+    fade_value[i] = (int32_t)current[i] << 16;
+    fade_step[i] = (((int32_t)rgb[i] << 16) - fade_value[i]) / steps;
+    fade_target[i] = rgb[i];
+  }
+  fade_period = clock_period_count();
+  fade_remaining = steps;
+}
+
+/**
+ * Stop the fade where it is.
+ */
+void fade_stop() {
+  fade_remaining = 0;
+}
+
+/**
+ * Is a fade running.
+ */
+uint8_t fade_running() {
+  return fade_remaining > 0;
+}
+
+/**
+ * Move the fade forward a step for each clock period since it last ran.
+ * The last step lands exactly on the target color.
+ */
+void fade_run() {
+  if (fade_remaining == 0) return;
+
+  uint16_t period = clock_period_count(),
+           steps = period - fade_period;
+  if (steps == 0) return;
+  fade_period = period;
+
+  if (steps >= fade_remaining) {
+    fade_remaining = 0;
+    red_pwm(fade_target[0]);
+    green_pwm(fade_target[1]);
+    blue_pwm(fade_target[2]);
+    return;
+  }
+
+  fade_remaining -= steps;
+  fade_value[0] += fade_step[0] * steps;
+  fade_value[1] += fade_step[1] * steps;
+  fade_value[2] += fade_step[2] * steps;
+  red_pwm(fade_value[0] >> 16);
+  green_pwm(fade_value[1] >> 16);
+  blue_pwm(fade_value[2] >> 16);
+}
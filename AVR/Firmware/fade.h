@@ -0,0 +1,23 @@
+/**
+ * Fades the RGB LED from its current color to a new one, over time.
+ * The fade moves forward a step every clock period (CLOCK_PERIOD_US). It's run from
+ * the program loop, which catches up on any periods it missed.
+ */
+
+#ifndef FADE_H
+#define FADE_H
+
+// Start fading from the current LED color to `rgb`, over `duration` milliseconds.
+// A duration of 0 sets the color right away.
+void fade_to(uint8_t *rgb, uint16_t duration);
+
+// Stop the fade, leaving the LED at its current color
+void fade_stop();
+
+// Returns true while a fade is running
+uint8_t fade_running();
+
+// Move the fade forward by the clock periods since it last ran (call from the program loop)
+void fade_run();
+
+#endif
@@ -1,8 +1,11 @@
 #include "Multidrop.h"
-#include "MultidropData.h"
 
-
-Multidrop::Multidrop(MultidropData *_serial) : serial(_serial) {
+Multidrop::Multidrop() {
+  daisy_prev = 0;
+  daisy_next = 0;
+  daisyHandler = 0;
+  framing = MD_FRAMING_SOM;
+  rxEscaped = 0;
 }
 
 void Multidrop::addDaisyChain(volatile uint8_t d1_pin_number,
@@ -87,6 +90,11 @@ void Multidrop::setDaisyChainPolarity(uint8_t prev, uint8_t next) {
 uint8_t Multidrop::setNextDaisyValue(uint8_t val) {
   if (!daisy_next) return 0;
 
+  if (daisyHandler) {
+    daisyHandler(val);
+    return 1;
+  }
+
   uint8_t mask = (daisy_next == 2) ? (1 << d2_num) : (1 << d1_num);
   volatile uint8_t* ddr = (daisy_next == 2) ? d2_ddr : d1_ddr;
   volatile uint8_t* port = (daisy_next == 2) ? d2_port : d1_port;
@@ -112,3 +120,98 @@ uint8_t Multidrop::isPrevDaisyEnabled() {
   return !(*pin & mask);
 }
 
+uint8_t Multidrop::getFraming() {
+  return framing;
+}
+
+uint8_t Multidrop::unescape(uint8_t *buf, uint8_t len) {
+  if (framing != MD_FRAMING_STUFFED) return len;
+
+  uint8_t i, out = 0, b;
+  for (i = 0; i < len; i++) {
+    b = buf[i];
+
+    if (b == MD_FRAME_ESC) {
+      rxEscaped = 1;
+      continue;
+    }
+    // Not expected here, so there's no data in it
+    if (b == MD_FRAME_DELIM) {
+      rxEscaped = 0;
+      continue;
+    }
+
+    if (rxEscaped) {
+      b ^= MD_FRAME_ESC_XOR;
+      rxEscaped = 0;
+    }
+    buf[out++] = b;
+  }
+  return out;
+}
+
+// 1 if an odd number of bits are set
+static uint8_t parity(uint8_t b) {
+  b ^= b >> 4;
+  b ^= b >> 2;
+  b ^= b >> 1;
+  return b & 1;
+}
+
+void Multidrop::fecStart() {
+  fecCode = 0;
+  fecParity = 0;
+  fecColumn = 3;
+}
+
+void Multidrop::fecUpdate(uint8_t b) {
+  fecParity ^= b;
+
+  for (uint8_t i = 0; i < 8; i++) {
+    if (b & (1 << i)) {
+      fecCode ^= fecColumn;
+    }
+
+    // Powers of two are the columns of the correction byte bits
+    fecColumn++;
+    if ((fecColumn & (fecColumn - 1)) == 0) {
+      fecColumn++;
+    }
+  }
+}
+
+uint8_t Multidrop::fecByte() {
+  uint8_t code = fecCode & 0x7F;
+  if (parity(fecParity ^ code)) {
+    code |= 0x80;
+  }
+  return code;
+}
+
+uint8_t Multidrop::fecCorrect(uint8_t code, uint8_t *buf, uint8_t len) {
+  uint8_t syndrome = (fecCode ^ code) & 0x7F,
+          log = 0,
+          bit;
+
+  // An even number of bits are wrong: none, or too many to correct
+  if (!parity(fecParity ^ code)) {
+    return (syndrome) ? MD_FEC_FAILED : MD_FEC_OK;
+  }
+
+  // The wrong bit is in the correction byte
+  if ((syndrome & (syndrome - 1)) == 0) {
+    return MD_FEC_CORRECTED;
+  }
+
+  // The data bit with this column (there are `log + 1` powers of two below it)
+  for (bit = syndrome; bit > 1; bit >>= 1) {
+    log++;
+  }
+  bit = syndrome - 2 - log;
+  if (bit >= (uint16_t)len * 8) {
+    return MD_FEC_FAILED;
+  }
+
+  buf[bit >> 3] ^= (1 << (bit & 7));
+  return MD_FEC_CORRECTED;
+}
@@ -6,22 +6,98 @@
 // Maximum size of the message buffer
 #define MSG_BUFFER_LEN  150
 
-#include <avr/io.h>
-#include <stdint.h>
+#include "MultidropPlatform.h"
 #include "MultidropData.h"
 
-#define CMD_RESET   0xFA
-#define CMD_ADDRESS 0xFB
-#define CMD_NULL    0xFF
+#define CMD_GET_STATS 0xF7
+#define CMD_CENSUS    0xF8
+#define CMD_SET_BAUD  0xF9
+#define CMD_RESET     0xFA
+#define CMD_ADDRESS   0xFB
+#define CMD_NULL      0xFF
+
+// Census response for a node that did not respond
+#define MD_CENSUS_MISSING 0xFF
+
+// Length of a node's CMD_GET_STATS response. Six 16-bit counters (MSB first):
+// framing errors, overrun errors, dropped bytes, CRC errors, messages received,
+// bit errors corrected (see Multidrop::FEC_FLAG)
+#define MD_STATS_LEN 12
+
+// The most data per node in an error corrected segment message (see Multidrop::FEC_FLAG).
+// The data and check byte can be up to 120 bits, for a 7 bit Hamming code.
+#define MD_FEC_MAX_LEN 14
+
+// Result of Multidrop::fecCorrect
+#define MD_FEC_OK        0
+#define MD_FEC_CORRECTED 1 // One bit was wrong, and has been flipped back
+#define MD_FEC_FAILED    2 // More than one bit was wrong
+
+// Length of the CMD_SET_BAUD data: baud rate (4 bytes) + switch delay (2 bytes)
+// + confirm timeout (2 bytes). All in milliseconds, MSB first.
+// If the confirm timeout isn't 0, a node goes back to its previous rate that long after
+// switching, unless it gets a CMD_SET_BAUD for the new rate (the confirm) before then.
+#define MD_SET_BAUD_LEN 8
+
+// How the start of a message is found (see Multidrop::setFraming). Master and
+// all nodes need to use the same one.
+//
+//   MD_FRAMING_SOM:     Messages start with two 0xFF bytes, which can also appear in the
+//                       message itself (i.e. full brightness colors). After a corrupt byte,
+//                       a node can mistake data for the start of a message.
+//   MD_FRAMING_STUFFED: Messages start with MD_FRAME_DELIM, which never appears anywhere
+//                       else: MD_FRAME_DELIM and MD_FRAME_ESC bytes are sent as MD_FRAME_ESC
+//                       followed by the byte XOR MD_FRAME_ESC_XOR (by master and nodes).
+//                       Every delimiter starts a new message, wherever the last one was.
+#define MD_FRAMING_SOM     0
+#define MD_FRAMING_STUFFED 1
+
+#define MD_FRAME_DELIM   0x7E
+#define MD_FRAME_ESC     0x7D
+#define MD_FRAME_ESC_XOR 0x20
+
+// Drives the next daisy chain line, for hosts where it isn't a simple port pin
+// (i.e. a modem control line of a serial port).
+typedef void (*multidropDaisyFunction)(uint8_t enabled);
 
 class Multidrop {
 
 public:
+  Multidrop();
+
   static const uint8_t BROADCAST_ADDRESS = 0;
   static const uint8_t BATCH_FLAG = 0b00000001;
   static const uint8_t RESPONSE_MESSAGE_FLAG = 0b00000010;
 
-  Multidrop(MultidropData*);
+  // Batch message that starts with a bitmap of the nodes it has data for (1 bit per node,
+  // node 1 is the least significant bit of the first byte), followed by the data for only
+  // those nodes. Nodes that aren't in the bitmap receive the message without data.
+  // Not used with response messages.
+  static const uint8_t DELTA_FLAG = 0b00000100;
+
+  // Batch message where the data length is per node in nibbles (4 bits), instead of bytes.
+  // Node data is packed back to back, high nibble first. Not used with response messages.
+  static const uint8_t NIBBLE_FLAG = 0b00001000;
+
+  // Batch response message where master first sends data for every node, then each node
+  // responds in address order, all in one message. The header has a third length byte:
+  // number of nodes, data length and response length (per node). Set with BATCH_FLAG and
+  // RESPONSE_MESSAGE_FLAG, and not with the delta or nibble flags.
+  static const uint8_t EXCHANGE_FLAG = 0b00010000;
+
+  // Batch message where each node's data is followed by its own check byte: the CRC-8
+  // (CCITT, polynomial 0x07, from 0) of the header (without the start bytes), the node's
+  // address and its data. A node can use its data as soon as its check byte matches, even
+  // if something else in the message was corrupted and the message CRC fails.
+  // Set with BATCH_FLAG, and not with the response, delta or nibble flags.
+  static const uint8_t SEGMENT_FLAG = 0b00100000;
+
+  // Segment message where each node's check byte is followed by an error correction byte:
+  // an extended Hamming code (SECDED) of the node's data and check byte, so the node can
+  // correct one flipped bit in them, and still tell when there's more than one.
+  // The check byte is then checked as usual, after the correction.
+  // Set with BATCH_FLAG and SEGMENT_FLAG. The data length can be up to MD_FEC_MAX_LEN.
+  static const uint8_t FEC_FLAG = 0b01000000;
 
   // Add the pin and registers for the daisy chain lines.
   // To automatically define the polarity as d1=prev and d2=next, pass `set_polarity` as `true`.
@@ -53,6 +129,9 @@ public:
   // the pins for d1_* and d2_* defined in addDaisyChain()
   void setDaisyChainPolarity(uint8_t prev, uint8_t next);
 
+  // Get the message framing (MD_FRAMING_SOM or MD_FRAMING_STUFFED)
+  uint8_t getFraming();
+
 
 protected:
 
@@ -61,10 +140,12 @@ protected:
     response_msg = 0x40
   };
 
-  MultidropData *serial;
-
   uint16_t messageCRC;
 
+  // Message framing, and if the last byte received was MD_FRAME_ESC
+  uint8_t framing,
+          rxEscaped;
+
   // Daisy chain pin registers
   volatile uint8_t d1_num,
                    d2_num;
@@ -78,6 +159,9 @@ protected:
   uint8_t daisy_prev,
           daisy_next;
 
+  // When set, this is used to set the next daisy line, instead of the pin registers
+  multidropDaisyFunction daisyHandler;
+
   // Try to determine the next/prev daisy chain pins
   void checkDaisyChainPolarity();
 
@@ -87,6 +171,34 @@ protected:
   // Get the value (1 or 0) from the prev daisy chain pin
   uint8_t isPrevDaisyEnabled();
 
+  // Does a byte need to be escaped before it's sent (MD_FRAMING_STUFFED)
+  uint8_t needsEscape(uint8_t b) {
+    return framing == MD_FRAMING_STUFFED && (b == MD_FRAME_DELIM || b == MD_FRAME_ESC);
+  }
+
+  // Remove the escapes from received bytes (MD_FRAMING_STUFFED), in place.
+  // Returns the number of bytes left.
+  uint8_t unescape(uint8_t *buf, uint8_t len);
+
+  // Error correction code (see FEC_FLAG). Call `fecStart()`, then `fecUpdate()` with each
+  // byte, and then get the error correction byte from `fecByte()`.
+  //
+  // Each data bit gets a 7 bit Hamming code column (the numbers from 3 up, skipping the
+  // powers of two), and the low 7 bits of the correction byte are all the columns of the
+  // bits that are set, XORed together. The high bit makes the parity of everything even.
+  void fecStart();
+  void fecUpdate(uint8_t b);
+  uint8_t fecByte();
+
+  // Correct the `len` bytes passed to `fecUpdate()` (in `buf`) with the error correction
+  // byte that was received. Returns MD_FEC_OK, MD_FEC_CORRECTED or MD_FEC_FAILED.
+  uint8_t fecCorrect(uint8_t code, uint8_t *buf, uint8_t len);
+
+private:
+  uint8_t fecCode,   // The Hamming code so far
+          fecParity, // All bytes XORed together
+          fecColumn; // The column of the next bit
+
 };
 
 #endif
@@ -13,34 +13,138 @@
  *
  ************************************************************************************/
 
-#include <avr/io.h>
+#include "MultidropPlatform.h"
+
+// Receive filter modes (see MultidropData::setAddressFilter)
+#define MD_FILTER_OFF         0x00
+#define MD_FILTER_ADDRESSED   0x01 // Drop messages addressed to other nodes
+#define MD_FILTER_BATCH_SLICE 0x02 // Only pass this node's slice of batch messages (and not the CRC)
+#define MD_FILTER_STUFFED     0x04 // Added by the slave when the bus uses MD_FRAMING_STUFFED (see Multidrop.h)
+
+// No idle gap waiting in the RX buffer (see MultidropData::bytesBeforeIdle)
+#define MD_NO_IDLE_GAP 0xFF
+
+// No byte with a framing error waiting in the RX buffer (see MultidropData::bytesBeforeError)
+#define MD_NO_ERROR_BYTE 0xFF
+
+// Receive error counters kept by a transport
+struct MultidropDataErrors {
+  uint16_t framing;  // Bytes received with a framing error (bad stop bit)
+  uint16_t overrun;  // Bytes lost because the RX register was not read in time
+  uint16_t dropped;  // Bytes dropped because the RX buffer was full
+};
 
 class MultidropData {
 public:
 
   // Hook up to the data line
-  virtual void begin(uint32_t baud);
+  virtual void begin(uint32_t baud) = 0;
 
   // How many bytes are available in the RX buffer
-  virtual uint8_t available();
+  virtual uint8_t available() = 0;
 
   // Read a byte from the RX buffer
-  virtual uint8_t read();
+  virtual uint8_t read() = 0;
+
+  // Return the next byte in the RX buffer, without removing it
+  virtual uint8_t peek() = 0;
 
   // Write a byte to the TX line
-  virtual void write(uint8_t);
+  virtual void write(uint8_t) = 0;
 
   // Send everything in the TX buffer with blocking
-  virtual void flush();
+  virtual void flush() = 0;
 
   // Clears the RX buffer
-  virtual void clear();
+  virtual void clear() = 0;
 
   // Enables writing from the data stream (only required for 485 and similar protocols)
-  virtual void enable_write();
+  virtual void enable_write() = 0;
 
   // Enables reading from the data stream (only required for 485 and similar protocols)
-  virtual void enable_read();
+  virtual void enable_read() = 0;
+
+  // Read up to `max` bytes from the RX buffer into `buf`.
+  // Returns the number of bytes read.
+  virtual uint8_t readBytes(uint8_t *buf, uint8_t max) {
+    uint8_t i;
+    for (i = 0; i < max && available(); i++) {
+      buf[i] = read();
+    }
+    return i;
+  }
+
+  // Write several bytes to the TX line
+  virtual void write(const uint8_t *buf, uint16_t len) {
+    for (uint16_t i = 0; i < len; i++) {
+      write(buf[i]);
+    }
+  }
+
+  // Point `span` at the received bytes waiting at the front of the RX buffer, without
+  // removing them, and return how many there are. The bytes stay valid until they're
+  // removed with `consume()`.
+  //
+  // Only bytes that are contiguous in memory are included, so there can be more
+  // available after they've been consumed.
+  virtual uint8_t peekSpan(const uint8_t **span) {
+    if (!available()) return 0;
+    spanByte = peek();
+    *span = &spanByte;
+    return 1;
+  }
+
+  // Remove `len` bytes from the front of the RX buffer
+  virtual void consume(uint8_t len) {
+    while (len-- && available()) {
+      read();
+    }
+  }
+
+  // Filter received messages before they reach the RX buffer, so the slave doesn't
+  // have to parse messages meant for other nodes.
+  //   * address: The node's address (0 turns the filter off)
+  //   * mode: A combination of the MD_FILTER_* flags.
+  // Returns the mode that the transport will use (MD_FILTER_OFF if filtering is not supported,
+  // or if it can't follow MD_FILTER_STUFFED messages).
+  virtual uint8_t setAddressFilter(uint8_t address, uint8_t mode) {
+    return MD_FILTER_OFF;
+  }
+
+  // Reset the filter to look for the start of the next message.
+  // Called at the end of messages that the filter can't measure (addressing, response and delta messages).
+  virtual void resetAddressFilter() { }
+
+  // Idle line detection: when the line went silent (for longer than the transport's idle gap)
+  // before one of the bytes in the RX buffer, this is the number of bytes in front of it.
+  // Otherwise MD_NO_IDLE_GAP. Only the most recent gap is kept.
+  //
+  // The master sends each message without stopping, so the slave takes a gap to mean that
+  // whatever was being received before it has ended (like the 3.5 character gap in Modbus RTU).
+  virtual uint8_t bytesBeforeIdle() {
+    return MD_NO_IDLE_GAP;
+  }
+
+  // Framing error detection: when one of the bytes in the RX buffer was received with a
+  // framing error, this is the number of bytes in front of it. Otherwise MD_NO_ERROR_BYTE.
+  // Only the most recent one is kept.
+  //
+  // That byte is noise, or traffic at another baud rate, so the slave drops it and whatever
+  // it was parsing, even a response message (which it keeps through an idle gap). Otherwise
+  // junk can pass for the header of a long message, which swallows the real ones after it.
+  virtual uint8_t bytesBeforeError() {
+    return MD_NO_ERROR_BYTE;
+  }
+
+  // Get the receive error counters (counters wrap at 0xFFFF)
+  virtual void getErrors(MultidropDataErrors *errors) {
+    errors->framing = 0;
+    errors->overrun = 0;
+    errors->dropped = 0;
+  }
+
+private:
+  uint8_t spanByte;
 };
 
 #endif
\ No newline at end of file
@@ -4,6 +4,7 @@
 MultidropData485::MultidropData485(volatile uint8_t de_pin_num,
                                    volatile uint8_t* de_ddr_register,
                                    volatile uint8_t* de_port_register):
+                                   asyncRelease(false),
                                    de_pin(de_pin_num),
                                    de_ddr(de_ddr_register),
                                    de_port(de_port_register) {
@@ -12,11 +13,22 @@ MultidropData485::MultidropData485(volatile uint8_t de_pin_num,
   *de_port &= ~(1 << de_pin_num);
 }
 
+void MultidropData485::setAsyncRelease(uint8_t enabled) {
+  asyncRelease = enabled;
+}
+
 void MultidropData485::enable_write() {
+  if (asyncRelease) {
+    cancelTxCompleteRelease();
+  }
   *de_port |= (1 << de_pin);
 }
 
 void MultidropData485::enable_read() {
+  if (asyncRelease) {
+    releaseOnTxComplete(de_port, (1 << de_pin));
+    return;
+  }
   flush();
   *de_port &= ~(1 << de_pin);
 }
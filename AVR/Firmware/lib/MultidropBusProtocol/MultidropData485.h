@@ -5,17 +5,24 @@
 #include "MultidropDataUart.h"
 #include <avr/io.h>
 
-class MultidropData485 : public MultidropDataUart {
+class MultidropData485 final : public MultidropDataUart {
 public:
   MultidropData485(volatile uint8_t de_pin_num,
                    volatile uint8_t* de_ddr_register,
                    volatile uint8_t* de_port_register);
 
+  using MultidropDataUart::write;
   void write(uint8_t byte);
   void enable_write();
   void enable_read();
 
+  // When enabled, `enable_read()` returns immediately and the DE pin is
+  // released from the TX complete interrupt, after the last byte has been sent.
+  // Otherwise, `enable_read()` blocks until all data has been sent.
+  void setAsyncRelease(uint8_t enabled);
+
 private:
+  uint8_t asyncRelease;
   volatile uint8_t de_pin;
   volatile uint8_t* de_ddr;
   volatile uint8_t* de_port;
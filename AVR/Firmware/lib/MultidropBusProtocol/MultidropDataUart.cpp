@@ -1,13 +1,19 @@
 
 #include "MultidropDataUart.h"
+#include "Multidrop.h"
 #include <avr/interrupt.h>
+#include <util/atomic.h>
 
 ////////////////////////////////////////////
 /// Prototypes
 ////////////////////////////////////////////
 void uartReceive();
 void uartSendNextByte();
+void uartTransmitComplete();
 void writeByteToRegister(uint8_t);
+uint8_t filterByte(uint8_t);
+void filterIdle();
+static void updateIdleGap();
 
 ////////////////////////////////////////////
 /// Macros
@@ -20,38 +26,85 @@ void writeByteToRegister(uint8_t);
 #define UART0_UDR   UDR0
 #define UART0_UDRE  UDRE0
 #define UART0_TXC   TXC0
+#define UART0_RXC   RXC0
+#define UART0_FE    FE0
+#define UART0_DOR   DOR0
 
-#ifndef UART0_RX_BUFFER_SIZE
-#define UART0_RX_BUFFER_SIZE 150
-#endif
 
-#ifndef UART0_TX_BUFFER_SIZE
-#define UART0_TX_BUFFER_SIZE 60
-#endif
+#define TX_BUFFER_EMPTY() (tx_buffer.isEmpty())
+#define TX_BUFFER_FULL() (tx_buffer.isFull())
 
-
-#define UART_BAUD_SELECT(baudRate)  (((F_CPU) + 8UL * (baudRate)) / (16UL * (baudRate)) -1UL)
-
-#define TX_BUFFER_EMPTY() (tx_buffer_head == tx_buffer_tail)
-#define TX_NEXT_HEAD_IDX() ((tx_buffer_head + 1) % UART0_TX_BUFFER_SIZE)
-#define TX_BUFFER_FULL() (TX_NEXT_HEAD_IDX() == tx_buffer_tail)
-
-#define RX_BUFFER_EMPTY() (rx_buffer_head == rx_buffer_tail)
-#define RX_BUFFER_FULL() (((rx_buffer_head + 1) % UART0_RX_BUFFER_SIZE) == rx_buffer_tail)
+#define RX_BUFFER_EMPTY() (MultidropDataUart::rxBuffer.isEmpty())
+#define RX_BUFFER_FULL() (MultidropDataUart::rxBuffer.isFull())
 
 #define DISABLE_TX_INT() UART0_UCSRB &= ~(1 << UDRIE0);
 #define ENABLE_TX_INT() UART0_UCSRB |= (1 << UDRIE0)
 
+#define DISABLE_TXC_INT() UART0_UCSRB &= ~(1 << TXCIE0);
+#define ENABLE_TXC_INT() UART0_UCSRB |= (1 << TXCIE0)
+
 ////////////////////////////////////////////
 /// Static Globals
 ////////////////////////////////////////////
-static volatile uint8_t rx_buffer[UART0_RX_BUFFER_SIZE];
-static volatile uint8_t tx_buffer[UART0_TX_BUFFER_SIZE];
-
-static volatile uint8_t tx_buffer_head;
-static volatile uint8_t tx_buffer_tail;
-static volatile uint8_t rx_buffer_head;
-static volatile uint8_t rx_buffer_tail;
+MultidropRingBuffer<UART0_RX_BUFFER_SIZE> MultidropDataUart::rxBuffer;
+static MultidropRingBuffer<UART0_TX_BUFFER_SIZE> tx_buffer;
+
+// A byte has been written to the TX register since the last transmit completed
+static volatile uint8_t tx_started = 0;
+
+// Receive error counters
+static volatile uint16_t rx_framing_errors = 0;
+static volatile uint16_t rx_overrun_errors = 0;
+static volatile uint16_t rx_dropped = 0;
+
+// RX address filter (see setAddressFilter)
+enum filter_state_t {
+  FILTER_IDLE,        // Looking for the start of a message
+  FILTER_SOM,         // Received first start byte
+  FILTER_FLAGS,
+  FILTER_ADDR,
+  FILTER_CMD,
+  FILTER_LEN1,
+  FILTER_LEN2,
+  FILTER_PASS,        // Passing `filter_count` bytes to the RX buffer
+  FILTER_SKIP,        // Dropping `filter_count` bytes
+  FILTER_SKIP_SLICE,  // Dropping `filter_count` bytes before this node's batch slice
+  FILTER_SLICE,       // Passing this node's batch slice
+  FILTER_PASS_ALL     // Passing everything until resetAddressFilter()
+};
+static uint8_t filter_mode = MD_FILTER_OFF;
+static uint8_t filter_address = 0;
+static volatile uint8_t filter_state = FILTER_IDLE;
+static uint8_t filter_escaped = 0;
+static uint8_t filter_flags,
+               filter_dest,
+               filter_cmd,
+               filter_nodes;
+static uint16_t filter_len, // Batch messages: length of each node's slice
+                filter_count,
+                filter_after;
+
+// Called for every byte received (see setRxHandler)
+static volatile multidropRxFunction rx_handler = 0;
+
+// Idle line detection (see setIdleGap)
+static volatile multidropTimeFunction idle_time = 0;
+static uint32_t idle_time_rate,
+                idle_baud = 0;
+static uint8_t idle_bytes;
+static uint16_t idle_gap,                 // Time counts of silence that make a gap
+                idle_last;                // When the last byte was received
+static volatile uint8_t idle_seen = 0,    // There was a gap, mark the next byte added to the RX buffer
+                        idle_marked = 0,  // `idle_mark` is the first byte after a gap
+                        idle_mark;        // RX buffer position (see MultidropRingBuffer::headPosition)
+
+// The last byte received with a framing error (see bytesBeforeError)
+static volatile uint8_t error_marked = 0,
+                        error_mark;       // RX buffer position
+
+// Pin to pull low when the TX complete interrupt fires (see releaseOnTxComplete)
+static volatile uint8_t* txc_release_port = 0;
+static volatile uint8_t txc_release_mask;
 
 ////////////////////////////////////////////
 /// Class members
@@ -70,8 +123,18 @@ void MultidropDataUart::begin(uint32_t baud) {
   UART0_UCSRC = 1<<UCSZ01 | 1<<UCSZ00;
 
   // Set baud
-  UART0_UBRRL =  (unsigned char)UART_BAUD_SELECT(baud);
-  UART0_UBRRH =  (unsigned char)(UART_BAUD_SELECT(baud) << 8);
+  uint8_t divider = 16;
+  if (uartUseU2X(F_CPU, baud)) {
+    divider = 8;
+    UART0_UCSRA = (1 << U2X0);
+  }
+  uint16_t ubrr = uartUbrr(F_CPU, baud, divider);
+  UART0_UBRRH = (unsigned char)(ubrr >> 8);
+  UART0_UBRRL = (unsigned char)ubrr;
+
+  // The idle gap is in byte times
+  idle_baud = baud;
+  updateIdleGap();
 
   // Enable interrupts
   sei();
@@ -93,42 +156,180 @@ void MultidropDataUart::write(uint8_t c) {
   }
 
   // Add to buffer and enable interrupt
-  tx_buffer[tx_buffer_head] = c;
-  tx_buffer_head = TX_NEXT_HEAD_IDX();
+  tx_buffer.push(c);
   ENABLE_TX_INT();
 }
 
-// Read a byte from the RX buffer
-uint8_t MultidropDataUart::read() {
-  // if the head isn't ahead of the tail, we don't have any characters
-  if (RX_BUFFER_EMPTY()) {
-    return -1;
-  } else {
-    uint8_t c = rx_buffer[rx_buffer_tail];
-    rx_buffer_tail = (uint8_t)(rx_buffer_tail + 1) % UART0_RX_BUFFER_SIZE;
-    return c;
+// Write several bytes to the TX line
+void MultidropDataUart::write(const uint8_t *buf, uint16_t len) {
+  for (uint16_t i = 0; i < len; i++) {
+    MultidropDataUart::write(buf[i]);
   }
 }
 
-// How many bytes are available in the RX buffer
-uint8_t MultidropDataUart::available() {
-  return ((uint8_t)(UART0_RX_BUFFER_SIZE + rx_buffer_head - rx_buffer_tail)) % UART0_RX_BUFFER_SIZE;
+// Read up to `max` bytes from the RX buffer
+uint8_t MultidropDataUart::readBytes(uint8_t *buf, uint8_t max) {
+  uint8_t i, len = rxBuffer.count();
+  if (len > max) {
+    len = max;
+  }
+  for (i = 0; i < len; i++) {
+    buf[i] = rxBuffer.shift();
+  }
+  return len;
 }
 
 // Clears the RX buffer
 void MultidropDataUart::clear() {
-  rx_buffer_head = 0;
-  rx_buffer_tail = 0;
+  rxBuffer.clear();
+}
+
+// Call a function from the RX interrupt for every byte
+void MultidropDataUart::setRxHandler(multidropRxFunction handler) {
+  rx_handler = handler;
+}
+
+// Time the gaps between received bytes
+void MultidropDataUart::setIdleGap(multidropTimeFunction time, uint32_t timeRate, uint8_t byteTimes) {
+  idle_time_rate = timeRate;
+  idle_bytes = byteTimes;
+  updateIdleGap();
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    idle_time = time;
+    idle_seen = 0;
+    idle_marked = 0;
+  }
+}
+
+// The number of bytes in the RX buffer before the last gap
+uint8_t MultidropDataUart::bytesBeforeIdle() {
+  uint8_t offset = MD_NO_IDLE_GAP;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (idle_marked) {
+      offset = idle_mark - rxBuffer.tailPosition();
+
+      // Already read
+      if (offset >= rxBuffer.count()) {
+        offset = MD_NO_IDLE_GAP;
+      }
+    }
+  }
+  return offset;
+}
+
+// The number of bytes in the RX buffer before the last one with a framing error
+uint8_t MultidropDataUart::bytesBeforeError() {
+  uint8_t offset = MD_NO_ERROR_BYTE;
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (error_marked) {
+      offset = error_mark - rxBuffer.tailPosition();
+
+      // Already read
+      if (offset >= rxBuffer.count()) {
+        offset = MD_NO_ERROR_BYTE;
+      }
+    }
+  }
+  return offset;
+}
+
+// Convert the idle gap from byte times to time counts, at the current baud rate
+static void updateIdleGap() {
+  if (!idle_baud) return;
+
+  uint32_t gap = ((uint32_t)idle_bytes * 10 * idle_time_rate + idle_baud - 1) / idle_baud; // 8N1 = 10 bits
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    idle_gap = (gap > 0xFFFF) ? 0xFFFF : gap;
+  }
 }
 
 // Send everything in the TX buffer with blocking
 void MultidropDataUart::flush() {
   DISABLE_TX_INT();
+  DISABLE_TXC_INT();
   while (!TX_BUFFER_EMPTY()) {
     uartSendNextByte();
   }
+
   // Wait for the transmit to complete
-  while (!(UART0_UCSRA & (1 << UART0_TXC)));
+  if (tx_started) {
+    while (!(UART0_UCSRA & (1 << UART0_TXC)));
+    tx_started = 0;
+  }
+
+  // Finish any pending release
+  if (txc_release_port) {
+    *txc_release_port &= ~txc_release_mask;
+    txc_release_port = 0;
+  }
+}
+
+// Pull a pin low after the last byte has been transmitted
+void MultidropDataUart::releaseOnTxComplete(volatile uint8_t* port, uint8_t mask) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+
+    // Nothing being sent, release now
+    if (!tx_started && TX_BUFFER_EMPTY()) {
+      *port &= ~mask;
+      txc_release_port = 0;
+      DISABLE_TXC_INT();
+      return;
+    }
+
+    txc_release_port = port;
+    txc_release_mask = mask;
+    ENABLE_TXC_INT();
+  }
+}
+
+// Cancel the pin release set with releaseOnTxComplete
+void MultidropDataUart::cancelTxCompleteRelease() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    DISABLE_TXC_INT();
+    txc_release_port = 0;
+  }
+}
+
+// Filter messages for other nodes in the RX interrupt
+uint8_t MultidropDataUart::setAddressFilter(uint8_t address, uint8_t mode) {
+  // Without an address, everything is for us
+  if (address == 0) {
+    mode = MD_FILTER_OFF;
+  }
+
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    filter_address = address;
+    filter_mode = mode;
+    filter_state = FILTER_IDLE;
+    filter_escaped = 0;
+  }
+  return mode;
+}
+
+// Look for the start of the next message
+void MultidropDataUart::resetAddressFilter() {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    if (filter_state == FILTER_PASS_ALL) {
+      filter_state = FILTER_IDLE;
+    }
+  }
+}
+
+// Is there data still waiting to be, or being, transmitted
+uint8_t MultidropDataUart::isSending() {
+  return !TX_BUFFER_EMPTY() || (tx_started && !(UART0_UCSRA & (1 << UART0_TXC)));
+}
+
+// Get the receive error counters
+void MultidropDataUart::getErrors(MultidropDataErrors *errors) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    errors->framing = rx_framing_errors;
+    errors->overrun = rx_overrun_errors;
+    errors->dropped = rx_dropped;
+  }
 }
 
 // Not implemented
@@ -141,13 +342,219 @@ void MultidropDataUart::enable_read() { }
 
 // Receive the byte out of the RX register
 void uartReceive() {
+  // Status flags need to be read before the data register
+  uint8_t status = UART0_UCSRA;
+  uint8_t b = UART0_UDR;
+
+  // Time the gap since the last byte. If the next byte is already waiting,
+  // this interrupt ran late and the time is off, so it's not counted.
+  multidropTimeFunction time = idle_time;
+  if (time) {
+    uint16_t now = time();
+    if ((uint16_t)(now - idle_last) > idle_gap && !(UART0_UCSRA & (1 << UART0_RXC))) {
+      idle_seen = 1;
+      if (filter_mode) {
+        filterIdle();
+      }
+    }
+    idle_last = now;
+  }
+
+  uint8_t framing = status & (1 << UART0_FE);
+  if (status & ((1 << UART0_FE) | (1 << UART0_DOR))) {
+    if (framing) {
+      rx_framing_errors++;
+    }
+    if (status & (1 << UART0_DOR)) {
+      rx_overrun_errors++;
+    }
+  }
+
+  // Junk: keep it, so the slave drops what it was parsing, and look for the next message
+  if (framing) {
+    filter_state = FILTER_IDLE;
+    filter_escaped = 0;
+  }
+  // Not for us
+  else if (filter_mode && !filterByte(b)) {
+    return;
+  }
+
   // RX buffer full, not taking on new bytes
   if (RX_BUFFER_FULL()) {
+    rx_dropped++;
     return;
   }
 
-  rx_buffer[rx_buffer_head] = UART0_UDR;
-  rx_buffer_head = (rx_buffer_head + 1) % UART0_RX_BUFFER_SIZE;
+  // Mark the first byte after a gap, and forget a mark that's been read
+  uint8_t head = MultidropDataUart::rxBuffer.headPosition();
+  if (idle_seen) {
+    idle_mark = head;
+    idle_marked = 1;
+    idle_seen = 0;
+  }
+  else if (idle_marked && (uint8_t)(head - idle_mark) >= UART0_RX_BUFFER_SIZE) {
+    idle_marked = 0;
+  }
+
+  // Same for the last byte with a framing error
+  if (framing) {
+    error_mark = head;
+    error_marked = 1;
+  }
+  else if (error_marked && (uint8_t)(head - error_mark) >= UART0_RX_BUFFER_SIZE) {
+    error_marked = 0;
+  }
+
+  if (rx_handler) {
+    rx_handler();
+  }
+
+  MultidropDataUart::rxBuffer.push(b);
+}
+
+// Start passing this node's slice of a batch message
+static inline void filterStartSlice() {
+  if (filter_len) {
+    filter_count = filter_len;
+    filter_state = FILTER_SLICE;
+  } else {
+    filter_count = filter_after;
+    filter_state = FILTER_SKIP;
+  }
+}
+
+// Track just enough of the message header to decide if the following bytes
+// should reach the RX buffer. Returns 1 if the byte should be kept.
+uint8_t filterByte(uint8_t b) {
+
+  // Byte stuffed messages: follow the decoded bytes, and start over at every delimiter
+  if (filter_mode & MD_FILTER_STUFFED) {
+    if (b == MD_FRAME_DELIM) {
+      filter_escaped = 0;
+      filter_state = FILTER_FLAGS;
+      return 1;
+    }
+    if (b == MD_FRAME_ESC) {
+      filter_escaped = 1;
+      return filter_state != FILTER_SKIP && filter_state != FILTER_SKIP_SLICE;
+    }
+    if (filter_escaped) {
+      b ^= MD_FRAME_ESC_XOR;
+      filter_escaped = 0;
+    }
+    if (filter_state == FILTER_IDLE || filter_state == FILTER_SOM) {
+      return 1;
+    }
+  }
+
+  switch (filter_state) {
+    case FILTER_IDLE:
+      if (b == 0xFF) {
+        filter_state = FILTER_SOM;
+      }
+    break;
+    case FILTER_SOM:
+      filter_state = (b == 0xFF) ? FILTER_FLAGS : FILTER_IDLE;
+    break;
+    case FILTER_FLAGS:
+      filter_flags = b;
+      filter_state = FILTER_ADDR;
+    break;
+    case FILTER_ADDR:
+      filter_dest = b;
+      filter_state = FILTER_CMD;
+    break;
+    case FILTER_CMD:
+      filter_cmd = b;
+      filter_state = FILTER_LEN1;
+    break;
+
+    case FILTER_LEN1:
+      // Other nodes will be talking (or the length depends on the delta
+      // bitmap), so the length cannot be counted
+      if (filter_cmd == CMD_ADDRESS ||
+          (filter_flags & (Multidrop::RESPONSE_MESSAGE_FLAG | Multidrop::DELTA_FLAG))) {
+        filter_state = FILTER_PASS_ALL;
+      }
+      else if (filter_flags & Multidrop::BATCH_FLAG) {
+        filter_nodes = b;
+        filter_state = FILTER_LEN2;
+      }
+      // Data + CRC
+      else {
+        filter_count = b + 2;
+        filter_state = (filter_dest == filter_address || filter_dest == Multidrop::BROADCAST_ADDRESS)
+                      ? FILTER_PASS
+                      : FILTER_SKIP;
+      }
+    break;
+
+    case FILTER_LEN2:
+      // Nibble messages are passed whole
+      if (filter_flags & Multidrop::NIBBLE_FLAG) {
+        filter_count = ((uint16_t)filter_nodes * b + 1) / 2 + 2;
+        filter_state = FILTER_PASS;
+        break;
+      }
+
+      // Segment messages: each node's data is followed by a check byte
+      // (and an error correction byte)
+      filter_len = b;
+      if (filter_flags & Multidrop::SEGMENT_FLAG) {
+        filter_len += (filter_flags & Multidrop::FEC_FLAG) ? 2 : 1;
+      }
+
+      if ((filter_mode & MD_FILTER_BATCH_SLICE) && filter_address <= filter_nodes) {
+        filter_count = (filter_address - 1) * filter_len;
+        filter_after = (filter_nodes - filter_address) * filter_len + 2;
+
+        if (filter_count) {
+          filter_state = FILTER_SKIP_SLICE;
+        } else {
+          filterStartSlice();
+        }
+      }
+      else {
+        filter_count = filter_nodes * filter_len + 2;
+        filter_state = FILTER_PASS;
+      }
+    break;
+
+    case FILTER_PASS:
+      if (--filter_count == 0) {
+        filter_state = FILTER_IDLE;
+      }
+    break;
+    case FILTER_SKIP:
+      if (--filter_count == 0) {
+        filter_state = FILTER_IDLE;
+      }
+    return 0;
+    case FILTER_SKIP_SLICE:
+      if (--filter_count == 0) {
+        filterStartSlice();
+      }
+    return 0;
+    case FILTER_SLICE:
+      if (--filter_count == 0) {
+        filter_count = filter_after;
+        filter_state = FILTER_SKIP;
+      }
+    break;
+  }
+  return 1;
+}
+
+// The line went idle, so start looking for the next message.
+// Unless it's a message where nodes are responding, which can leave gaps.
+void filterIdle() {
+  if (filter_state == FILTER_PASS_ALL &&
+      (filter_cmd == CMD_ADDRESS || (filter_flags & Multidrop::RESPONSE_MESSAGE_FLAG))) {
+    return;
+  }
+  filter_state = FILTER_IDLE;
+  filter_escaped = 0;
 }
 
 // Send the next byte off the TX buffer
@@ -159,8 +566,7 @@ void uartSendNextByte() {
   while(!(UART0_UCSRA & (1<<UART0_UDRE)));
 
   // Send from tail and move tail forward
-  writeByteToRegister(tx_buffer[tx_buffer_tail]);
-  tx_buffer_tail = (tx_buffer_tail + 1) % UART0_TX_BUFFER_SIZE;
+  writeByteToRegister(tx_buffer.shift());
 
   // If buffer isn't empty, enable interrupt
   if (!TX_BUFFER_EMPTY()) {
@@ -173,6 +579,21 @@ void uartSendNextByte() {
 void writeByteToRegister(uint8_t b) {
   UART0_UDR = b;
   UART0_UCSRA |= (1 << UART0_TXC); // Reset transmit byte
+  tx_started = 1;
+}
+
+// The final byte has been shifted out of the TX register
+void uartTransmitComplete() {
+  // More is on the way, wait for it to be sent
+  if (!TX_BUFFER_EMPTY()) return;
+
+  DISABLE_TXC_INT();
+  tx_started = 0;
+
+  if (txc_release_port) {
+    *txc_release_port &= ~txc_release_mask;
+    txc_release_port = 0;
+  }
 }
 
 // Received a byte from the RX line
@@ -184,3 +605,8 @@ ISR(USART_RX_vect){
 ISR(USART_UDRE_vect) {
   uartSendNextByte();
 }
+
+// The final byte has left the TX shift register
+ISR(USART_TX_vect) {
+  uartTransmitComplete();
+}
@@ -3,24 +3,128 @@
 #define MultidropDataUart_H
 
 #include "MultidropData.h"
+#include "MultidropRingBuffer.h"
 #include <avr/io.h>
 
+// Buffer sizes must be a power of two (see MultidropRingBuffer)
+#ifndef UART0_RX_BUFFER_SIZE
+#define UART0_RX_BUFFER_SIZE 128
+#endif
+
+#ifndef UART0_TX_BUFFER_SIZE
+#define UART0_TX_BUFFER_SIZE 64
+#endif
+
+// The largest baud rate error allowed, in tenths of a percent
+#ifndef UART_MAX_BAUD_ERROR
+#define UART_MAX_BAUD_ERROR 20
+#endif
+
+/************************************************************************************
+ *  Baud rate calculations.
+ *
+ *  The UART can divide the clock by 16 (normal) or 8 (double speed, U2X), so
+ *  only some baud rates can be generated accurately. `begin()` picks whichever mode
+ *  is closest. At 20MHz, the exact rates include:
+ *
+ *    Normal: 1.25M, 625k, 312.5k, 250k, ...
+ *    U2X:    2.5M, 1.25M, 833.3k, 625k, 500k, ...
+ *
+ *  (1M is 25% off at 20MHz and will be rejected.)
+ *
+ *  These are constexpr, so a fixed bus speed can be checked at compile time:
+ *  ```
+ *    static_assert(uartBaudValid(F_CPU, 500000), "Invalid baud rate");
+ *  ```
+ ************************************************************************************/
+
+// The UBRR register value for a baud rate, with a clock divider of 16 or 8 (U2X)
+constexpr uint32_t uartUbrr(uint32_t fcpu, uint32_t baud, uint8_t divider) {
+  return ((fcpu + (divider / 2) * baud) / (divider * baud)) - 1;
+}
+
+// The baud rate that is actually generated for a requested baud rate
+constexpr uint32_t uartActualBaud(uint32_t fcpu, uint32_t baud, uint8_t divider) {
+  return fcpu / (divider * (uartUbrr(fcpu, baud, divider) + 1));
+}
+
+// The baud rate error, in tenths of a percent
+constexpr uint32_t uartBaudError(uint32_t fcpu, uint32_t baud, uint8_t divider) {
+  return (fcpu < divider * baud / 2 || uartUbrr(fcpu, baud, divider) > 0xFFF)
+    ? 1000
+    : ((uartActualBaud(fcpu, baud, divider) > baud)
+        ? uartActualBaud(fcpu, baud, divider) - baud
+        : baud - uartActualBaud(fcpu, baud, divider)) * 1000 / baud;
+}
+
+// Is double speed mode (U2X) more accurate for this baud rate
+constexpr uint8_t uartUseU2X(uint32_t fcpu, uint32_t baud) {
+  return uartBaudError(fcpu, baud, 8) < uartBaudError(fcpu, baud, 16);
+}
+
+// Can this baud rate be generated within UART_MAX_BAUD_ERROR
+constexpr uint8_t uartBaudValid(uint32_t fcpu, uint32_t baud) {
+  return uartBaudError(fcpu, baud, uartUseU2X(fcpu, baud) ? 8 : 16) <= UART_MAX_BAUD_ERROR;
+}
+
+// Called from the RX interrupt for every byte received (see MultidropDataUart::setRxHandler)
+typedef void (*multidropRxFunction)();
+
+// Returns a free running time count, which wraps at 16 bits (see MultidropDataUart::setIdleGap)
+typedef uint16_t (*multidropTimeFunction)();
+
+// The RX side is defined inline, so that it can be compiled down to direct buffer
+// access when the class is used as a template parameter (i.e. MultidropSlaveT).
 class MultidropDataUart : public MultidropData {
 public:
   MultidropDataUart();
 
-  // Hook into the UART at `baud` and start receiving data
+  // Hook into the UART at `baud` and start receiving data.
+  // Double speed mode (U2X) is used when it's closer to the requested baud rate.
   void begin(uint32_t baud);
 
   // How many bytes are available in the RX buffer
-  uint8_t available();
+  uint8_t available() {
+    return rxBuffer.count();
+  }
 
   // Read a byte from the RX buffer
-  uint8_t read();
+  uint8_t read() {
+    if (rxBuffer.isEmpty()) {
+      return -1;
+    }
+    return rxBuffer.shift();
+  }
+
+  // Return the next byte in the RX buffer, without removing it
+  uint8_t peek() {
+    if (rxBuffer.isEmpty()) {
+      return -1;
+    }
+    return rxBuffer.peek();
+  }
+
+  // Read up to `max` bytes from the RX buffer
+  uint8_t readBytes(uint8_t *buf, uint8_t max);
+
+  // Point `span` at the contiguous bytes at the front of the RX buffer
+  uint8_t peekSpan(const uint8_t **span) {
+    *span = rxBuffer.front();
+    return rxBuffer.contiguous();
+  }
+
+  // Remove bytes from the front of the RX buffer
+  void consume(uint8_t len) {
+    uint8_t count = rxBuffer.count();
+    rxBuffer.skip((len < count) ? len : count);
+  }
 
   // Write something to the TX line
   void write(uint8_t);
 
+  // Write several bytes to the TX line
+  void write(const uint8_t *buf, uint16_t len);
+
   // Send everything in the TX buffer and return when the
   // final frame has been transmitted out
   void flush();
@@ -31,6 +135,54 @@ public:
   // Not implemented
   void enable_write();
   void enable_read();
+
+  // Returns true while there is still data waiting to be, or being, sent
+  uint8_t isSending();
+
+  // Get the receive error counters
+  void getErrors(MultidropDataErrors *errors);
+
+  // Filter messages for other nodes from within the RX interrupt
+  uint8_t setAddressFilter(uint8_t address, uint8_t mode);
+  void resetAddressFilter();
+
+  // Call a function from the RX interrupt, as each byte is added to the RX buffer
+  // (filtered and dropped bytes are skipped). This lets the program timestamp the end
+  // of a message more accurately than when it gets around to handling it: the last
+  // call was for the message's last byte, if nothing is `available()` after it.
+  // Keep it short. Pass 0 to remove it.
+  void setRxHandler(multidropRxFunction handler);
+
+  // Watch for the line going idle between bytes (see MultidropData::bytesBeforeIdle).
+  // Each byte is timed from the RX interrupt, with the program's timer.
+  //   * time: Returns the timer count. It's called from the RX interrupt, so keep it short.
+  //           Pass 0 to stop watching.
+  //   * timeRate: How many times per second the count goes up.
+  //   * byteTimes: How long the line has to be silent for, in byte times at the current baud
+  //                rate (at least 3, so a late RX interrupt is not mistaken for a gap).
+  //
+  // When there's a gap, the address filter also starts looking for the next message,
+  // unless it's passing a response or addressing message (nodes can take a while to respond).
+  void setIdleGap(multidropTimeFunction time, uint32_t timeRate, uint8_t byteTimes);
+
+  uint8_t bytesBeforeIdle();
+
+  // Bytes with a framing error always reach the RX buffer (the address filter starts
+  // looking for the next message after them), so the slave can drop what it was parsing.
+  uint8_t bytesBeforeError();
+
+protected:
+
+  // Filled by the RX interrupt
+  static MultidropRingBuffer<UART0_RX_BUFFER_SIZE> rxBuffer;
+  friend void uartReceive();
+
+  // Set a pin low (`*port &= ~mask`) from the TX complete interrupt, once the final
+  // byte in the TX buffer has been transmitted. This returns immediately.
+  void releaseOnTxComplete(volatile uint8_t* port, uint8_t mask);
+
+  // Cancel a pin release started with `releaseOnTxComplete`
+  void cancelTxCompleteRelease();
 };
 
 #endif
\ No newline at end of file
@@ -1,21 +1,34 @@
 
-#include <util/crc16.h>
-
 #include "MultidropMaster.h"
-
-#define BATCH_FLAG            0b00000001
-#define RESPONSE_MESSAGE_FLAG 0b00000010
-
-MultidropMaster::MultidropMaster(MultidropData *serial) : Multidrop(serial) {
+#ifdef __AVR__
+#include "MultidropData485.h"
+#elif defined(__linux__)
+#include "linux/MultidropDataSerial.h"
+#endif
+
+template <class Transport>
+MultidropMasterT<Transport>::MultidropMasterT(Transport *_serial) : serial(_serial) {
   state = EOM;
   nodeNum = 0;
+  baudRate = 0;
+  baudStep = BAUD_IDLE;
+  censusDefault = MD_CENSUS_MISSING;
+  nodeStatus = 0;
+  segmentMode = 0;
 }
 
-void MultidropMaster::setNodeLength(uint8_t num) {
+template <class Transport>
+void MultidropMasterT<Transport>::setNodeLength(uint8_t num) {
   nodeNum = num;
 }
 
-void MultidropMaster::addNextDaisyChain(volatile uint8_t next_pin_num,
+template <class Transport>
+void MultidropMasterT<Transport>::setFraming(uint8_t mode) {
+  framing = mode;
+}
+
+template <class Transport>
+void MultidropMasterT<Transport>::addNextDaisyChain(volatile uint8_t next_pin_num,
                                         volatile uint8_t* next_ddr_register,
                                         volatile uint8_t* next_port_register,
                                         volatile uint8_t* next_pin_register) {
@@ -32,17 +45,20 @@ void MultidropMaster::addNextDaisyChain(volatile uint8_t next_pin_num,
   daisy_next = 1;
 }
 
-uint8_t MultidropMaster::startMessage(uint8_t command,
+template <class Transport>
+void MultidropMasterT<Transport>::addNextDaisyChain(multidropDaisyFunction handler) {
+  daisyHandler = handler;
+  daisy_prev = 0;
+  daisy_next = 1;
+}
+
+template <class Transport>
+uint8_t MultidropMasterT<Transport>::startMessage(uint8_t command,
                                       uint8_t destinationAddr,
                                       uint8_t dataLen,
                                       uint8_t batchMode,
                                       uint8_t responseMessage) {
 
-  state = 0;
-  messageCRC = ~0;
-  dataLength = dataLen;
-  destAddress = destinationAddr;
-
   uint8_t flags = 0;
   if (batchMode) {
     flags |= BATCH_FLAG;
@@ -54,36 +70,116 @@ uint8_t MultidropMaster::startMessage(uint8_t command,
     dontTimeout = true;
   }
 
+  sendHeader(command, destinationAddr, dataLen, flags);
+  return 1;
+}
+
+template <class Transport>
+uint8_t MultidropMasterT<Transport>::startDeltaMessage(uint8_t command,
+                                                       uint8_t dataLen,
+                                                       const uint8_t *changed,
+                                                       uint8_t nibbleMode) {
+  uint8_t flags = BATCH_FLAG | DELTA_FLAG;
+  if (nibbleMode) {
+    flags |= NIBBLE_FLAG;
+  }
+
+  sendHeader(command, BROADCAST_ADDRESS, dataLen, flags);
+  sendData((uint8_t*)changed, (nodeNum + 7) / 8);
+  return 1;
+}
+
+template <class Transport>
+uint8_t MultidropMasterT<Transport>::startNibbleMessage(uint8_t command, uint8_t nibbles) {
+  sendHeader(command, BROADCAST_ADDRESS, nibbles, BATCH_FLAG | NIBBLE_FLAG);
+  return 1;
+}
+
+template <class Transport>
+uint8_t MultidropMasterT<Transport>::startExchangeMessage(uint8_t command, uint8_t dataLen, uint8_t responseLen) {
+  sendHeader(command, BROADCAST_ADDRESS, dataLen, BATCH_FLAG | RESPONSE_MESSAGE_FLAG | EXCHANGE_FLAG, responseLen);
+
+  // From here on, lengths are for the responses
+  dataLength = responseLen;
+  dontTimeout = true;
+  return 1;
+}
+
+template <class Transport>
+uint8_t MultidropMasterT<Transport>::startSegmentMessage(uint8_t command, uint8_t dataLen, uint8_t errorCorrection) {
+  if (dataLen == 0 || (errorCorrection && dataLen > MD_FEC_MAX_LEN)) return 0;
+
+  uint8_t flags = BATCH_FLAG | SEGMENT_FLAG | ((errorCorrection) ? FEC_FLAG : 0);
+  sendHeader(command, BROADCAST_ADDRESS, dataLen, flags);
+
+  // Every check byte starts from the header
+  segmentHeader = _crc8_ccitt_update(0, flags);
+  segmentHeader = _crc8_ccitt_update(segmentHeader, BROADCAST_ADDRESS);
+  segmentHeader = _crc8_ccitt_update(segmentHeader, command);
+  segmentHeader = _crc8_ccitt_update(segmentHeader, nodeNum);
+  segmentHeader = _crc8_ccitt_update(segmentHeader, dataLen);
+  segmentNode = 1;
+  segmentPos = 0;
+  segmentMode = 1;
+  segmentFec = errorCorrection;
+  return 1;
+}
+
+template <class Transport>
+void MultidropMasterT<Transport>::sendHeader(uint8_t command,
+                                             uint8_t destinationAddr,
+                                             uint8_t dataLen,
+                                             uint8_t flags,
+                                             uint8_t responseLen) {
+  state = 0;
+  messageCRC = ~0;
+  segmentMode = 0;
+  dataLength = dataLen;
+  destAddress = destinationAddr;
+
+  // Drop anything nodes sent since the last message (i.e. a node that answered a message
+  // corrupted into a response message), so it isn't read as part of this one's responses
+  serial->clear();
+
   // Start sending header
   serial->enable_write();
-  sendByte(0xFF);
-  sendByte(0xFF);
+  if (framing == MD_FRAMING_STUFFED) {
+    serial->write(MD_FRAME_DELIM); // Not escaped, or part of the CRC
+  } else {
+    sendByte(0xFF, false, false); // The start bytes are not part of the CRC
+    sendByte(0xFF, false, false);
+  }
   sendByte(flags);
   sendByte(destAddress);
   sendByte(command);
 
   // Length
-  if (batchMode) {
+  if (flags & BATCH_FLAG) {
     sendByte(nodeNum);
   }
   sendByte(dataLength);
+  if (flags & EXCHANGE_FLAG) {
+    sendByte(responseLen);
+  }
   serial->enable_read();
 
   state = HEADER_SENT;
-  return 1;
 }
 
-void MultidropMaster::resetAllNodes() {
+template <class Transport>
+void MultidropMasterT<Transport>::resetAllNodes() {
   startMessage(CMD_RESET, BROADCAST_ADDRESS);
   finishMessage();
 }
 
-void MultidropMaster::startAddressing(uint32_t time, uint32_t timeout) {
+template <class Transport>
+void MultidropMasterT<Transport>::startAddressing(uint32_t time, uint32_t timeout) {
   nodeNum = 0;
   lastAddressReceived = 0;
   nodeAddressTries = 0;
   addrTimeoutDuration = timeout;
   timeoutTime = time + addrTimeoutDuration;
+  rxEscaped = 0;
 
   // Start address message
   startMessage(CMD_ADDRESS, BROADCAST_ADDRESS, 2, true, true);
@@ -97,25 +193,281 @@ void MultidropMaster::startAddressing(uint32_t time, uint32_t timeout) {
   dontTimeout = true;
 }
 
-void MultidropMaster::setResponseSettings(uint8_t *buff, uint32_t time, uint32_t timeout, uint8_t *defaultResponse) {
+template <class Transport>
+void MultidropMasterT<Transport>::startBaudNegotiation(const uint32_t *rates,
+                                                       uint8_t numRates,
+                                                       uint32_t currentBaud,
+                                                       uint8_t *buff,
+                                                       uint32_t time,
+                                                       uint16_t switchDelay,
+                                                       uint32_t timeout) {
+  baudRates = rates;
+  numBaudRates = numRates;
+  baseBaudRate = currentBaud;
+  baudRate = currentBaud;
+  censusBuff = buff;
+  baudSwitchDelay = switchDelay;
+  censusTimeout = timeout;
+  baudRateIdx = 0;
+
+  // Nodes need to wait for every census round, even if each node takes the whole timeout
+  uint32_t confirm = (uint32_t)switchDelay * 2 + (uint32_t)MD_BAUD_CENSUS_ROUNDS * nodeNum * timeout;
+  baudConfirmTimeout = (confirm < 0xFFFF) ? confirm : 0xFFFF;
+
+  // Response times change with the baud rate, so start tracking nodes over
+  resetNodeTracking();
+
+  tryNextBaudRate(time);
+}
+
+template <class Transport>
+typename MultidropMasterT<Transport>::baud_state_t MultidropMasterT<Transport>::checkBaudNegotiation(uint32_t time) {
+  uint8_t i;
+
+  switch (baudStep) {
+    case BAUD_IDLE:
+      return BAUD_DONE;
+
+    // Nodes are switching, so do we
+    case BAUD_SWITCH_UP:
+      if (time >= baudSwitchTime) {
+        baudRate = baudRates[baudRateIdx];
+        serial->begin(baudRate);
+        serial->clear();
+
+        // Nodes go back to the base rate this long after switching, unless confirmed
+        // (plus a delay for slow nodes)
+        baudRevertTime = baudSwitchTime + baudConfirmTimeout + baudSwitchDelay;
+
+        // Give slow nodes a chance to switch too
+        baudSwitchTime = time + baudSwitchDelay;
+        baudStep = BAUD_SETTLE;
+      }
+    break;
+
+    case BAUD_SETTLE:
+      if (time >= baudSwitchTime) {
+        censusRound = 0;
+        censusMissing = 0;
+        censusErrors = 0;
+        startCensus(time);
+      }
+    break;
+
+    // Tally census responses
+    case BAUD_CENSUS:
+      if (!checkForResponses(time)) break;
+
+      for (i = 0; i < nodeNum; i++) {
+        if (censusBuff[i] == MD_CENSUS_MISSING) {
+          censusMissing++;
+        } else {
+          censusErrors += censusBuff[i];
+        }
+      }
+
+      // Not reliable at this rate, go back to the base rate
+      if (censusMissing > MD_BAUD_MAX_MISSING || censusErrors > MD_BAUD_MAX_ERRORS) {
+        sendBaudRate(baseBaudRate, time, 0);
+        baudStep = BAUD_SWITCH_DOWN;
+
+        // Nodes that didn't get the message go back on their own
+        if (baudSwitchTime < baudRevertTime) {
+          baudSwitchTime = baudRevertTime;
+        }
+      }
+      else if (++censusRound < MD_BAUD_CENSUS_ROUNDS) {
+        startCensus(time);
+      }
+      // Done, everything works at this rate, so confirm it (a repeat is harmless to nodes)
+      else {
+        for (i = 0; i < MD_BAUD_CONFIRM_REPEAT; i++) {
+          sendBaudRate(baudRate, time, 0);
+        }
+        baudStep = BAUD_IDLE;
+        return BAUD_DONE;
+      }
+    break;
+
+    // Back to base rate, then try the next rate
+    case BAUD_SWITCH_DOWN:
+      if (time >= baudSwitchTime) {
+        baudRate = baseBaudRate;
+        serial->begin(baudRate);
+        serial->clear();
+
+        baudRateIdx++;
+        tryNextBaudRate(time);
+      }
+    break;
+  }
+
+  return (baudStep == BAUD_IDLE) ? BAUD_DONE : BAUD_WAITING;
+}
+
+template <class Transport>
+uint32_t MultidropMasterT<Transport>::getBaudRate() {
+  return baudRate;
+}
+
+template <class Transport>
+void MultidropMasterT<Transport>::tryNextBaudRate(uint32_t time) {
+
+  // Nothing faster than the base rate works
+  if (baudRateIdx >= numBaudRates || baudRates[baudRateIdx] == baseBaudRate) {
+    baudStep = BAUD_IDLE;
+    return;
+  }
+
+  sendBreak();
+  sendBaudRate(baudRates[baudRateIdx], time, baudConfirmTimeout);
+  baudStep = BAUD_SWITCH_UP;
+}
+
+template <class Transport>
+void MultidropMasterT<Transport>::sendBreak() {
+  serial->begin(baseBaudRate / 4);
+  serial->enable_write();
+  serial->write(0);
+  serial->flush();
+  serial->enable_read();
+
+  serial->begin(baseBaudRate);
+  serial->clear();
+}
+
+template <class Transport>
+void MultidropMasterT<Transport>::sendBaudRate(uint32_t baud, uint32_t time, uint16_t confirmTimeout) {
+  uint8_t data[MD_SET_BAUD_LEN] = {
+    (uint8_t)(baud >> 24),
+    (uint8_t)(baud >> 16),
+    (uint8_t)(baud >> 8),
+    (uint8_t)baud,
+    (uint8_t)(baudSwitchDelay >> 8),
+    (uint8_t)baudSwitchDelay,
+    (uint8_t)(confirmTimeout >> 8),
+    (uint8_t)confirmTimeout
+  };
+
+  startMessage(CMD_SET_BAUD, BROADCAST_ADDRESS, MD_SET_BAUD_LEN);
+  sendData(data, MD_SET_BAUD_LEN);
+  finishMessage();
+
+  // Nodes start their delay after receiving the entire message
+  serial->flush();
+  baudSwitchTime = time + baudSwitchDelay;
+}
+
+template <class Transport>
+void MultidropMasterT<Transport>::startCensus(uint32_t time) {
+  baudStep = BAUD_CENSUS;
+  startMessage(CMD_CENSUS, BROADCAST_ADDRESS, 1, true, true);
+  setResponseSettings(censusBuff, time, censusTimeout, &censusDefault);
+}
+
+template <class Transport>
+void MultidropMasterT<Transport>::setResponseSettings(uint8_t *buff, uint32_t time, uint32_t timeout, uint8_t *defaultResponse) {
   responseIndex = 0;
   responseBuff = buff;
   timeoutDuration = timeout;
   defaultResponseValues = defaultResponse;
   timeoutTime = time + timeoutDuration;
+  rxEscaped = 0;
 
   if (destAddress == BROADCAST_ADDRESS) {
     waitingOnNodes = nodeNum;
   } else {
     waitingOnNodes = 1;
   }
+  startNodeResponse(time);
+}
+
+template <class Transport>
+void MultidropMasterT<Transport>::setNodeTracking(MultidropNodeStatus *status, uint32_t minTimeout, uint8_t probeInterval) {
+  nodeStatus = status;
+  minTimeoutDuration = minTimeout;
+  deadProbeInterval = probeInterval;
+  resetNodeTracking();
+}
+
+template <class Transport>
+void MultidropMasterT<Transport>::resetNodeTracking() {
+  for (uint8_t i = 0; nodeStatus && i < nodeNum; i++) {
+    nodeStatus[i].latency = MD_LATENCY_UNKNOWN;
+    nodeStatus[i].misses = 0;
+    nodeStatus[i].skipped = 0;
+  }
+}
+
+template <class Transport>
+uint8_t MultidropMasterT<Transport>::isNodeDead(uint8_t address) {
+  if (!nodeStatus || address == 0 || address > nodeNum) return false;
+  return nodeStatus[address - 1].misses >= MD_DEAD_NODE_MISSES;
+}
+
+template <class Transport>
+MultidropNodeStatus* MultidropMasterT<Transport>::currentNodeStatus() {
+  // Only batch responses are tracked. Not census responses either: a node that
+  // can't do the baud rate being tried isn't dead, and every node has to be asked.
+  if (!nodeStatus || destAddress != BROADCAST_ADDRESS || dataLength == 0 || baudStep == BAUD_CENSUS) return 0;
+
+  uint16_t node = responseIndex / dataLength;
+  return (node < nodeNum) ? &nodeStatus[node] : 0;
+}
+
+template <class Transport>
+uint32_t MultidropMasterT<Transport>::responseTimeout() {
+  MultidropNodeStatus *node = currentNodeStatus();
+  if (!node || node->latency == MD_LATENCY_UNKNOWN) {
+    return timeoutDuration;
+  }
+
+  uint32_t timeout = ((uint32_t)node->latency * MD_LATENCY_TIMEOUT_FACTOR) / 4;
+  if (timeout < minTimeoutDuration) {
+    timeout = minTimeoutDuration;
+  }
+  return (timeout < timeoutDuration) ? timeout : timeoutDuration;
 }
 
-uint8_t MultidropMaster::checkForResponses(uint32_t time) {
-  uint8_t b, i;
+template <class Transport>
+void MultidropMasterT<Transport>::startNodeResponse(uint32_t time) {
+  MultidropNodeStatus *node;
+
+  // Skip dead nodes, unless it's time to try them again
+  while (waitingOnNodes > 0 && (node = currentNodeStatus()) && node->misses >= MD_DEAD_NODE_MISSES) {
+    if (++node->skipped >= deadProbeInterval) {
+      node->skipped = 0;
+      break;
+    }
+
+    // Make sure we're not butting up against the last node's response
+    _delay_us(150);
+    sendDefaultResponse();
+  }
+
+  responseWaitStart = time;
+  timeoutTime = time + responseTimeout();
+}
+
+template <class Transport>
+void MultidropMasterT<Transport>::sendDefaultResponse() {
+  // It's possible the node sent a partial response, so send whatever is left
+  for (uint8_t i = responseIndex % dataLength; i < dataLength; i++) {
+    sendByte(defaultResponseValues[i], true);
+    responseBuff[responseIndex] = defaultResponseValues[i];
+    responseIndex++;
+  }
+  waitingOnNodes--;
+}
+
+template <class Transport>
+uint8_t MultidropMasterT<Transport>::checkForResponses(uint32_t time) {
+  uint8_t i, len, nodeDone = false;
+  uint16_t remaining;
+  MultidropNodeStatus *node;
 
   if (dontTimeout) {
-    timeoutTime = time + timeoutDuration;
+    timeoutTime = time + responseTimeout();
   }
   dontTimeout = false;
 
@@ -125,33 +477,50 @@ uint8_t MultidropMaster::checkForResponses(uint32_t time) {
     return true;
   }
 
-  // Get more responses
-  while (serial->available()) {
-    b = serial->read();
-    responseBuff[responseIndex] = b;
-    messageCRC = _crc16_update(messageCRC, b);
+  // Get more responses, straight into the response buffer
+  while (waitingOnNodes > 0) {
+    remaining = ((uint16_t)waitingOnNodes * dataLength) - (responseIndex % dataLength);
+    len = serial->readBytes(&responseBuff[responseIndex], (remaining > 0xFF) ? 0xFF : remaining);
+    if (len == 0) break;
 
-    responseIndex++;
     dontTimeout = true;
+    len = unescape(&responseBuff[responseIndex], len);
+    for (i = 0; i < len; i++) {
+
+      // The node has started responding
+      if (responseIndex % dataLength == 0 && (node = currentNodeStatus())) {
+        uint16_t latency = (time - responseWaitStart < 0x3FFF) ? time - responseWaitStart : 0x3FFF;
+        node->latency = (node->latency == MD_LATENCY_UNKNOWN)
+                        ? latency * 4
+                        : node->latency - (node->latency / 4) + latency;
+        node->misses = 0;
+      }
 
-    // Have we received all the data for this node?
-    if (responseIndex % dataLength == 0) {
-      waitingOnNodes--;
+      messageCRC = _crc16_update(messageCRC, responseBuff[responseIndex]);
+      responseIndex++;
+
+      // Have we received all the data for this node?
+      if (responseIndex % dataLength == 0) {
+        waitingOnNodes--;
+        nodeDone = true;
+      }
     }
   }
 
-  // Node timeout, send default response
-  if (time > timeoutTime) {
-
-    // It's possible the node sent a partial response, so send whatever is left
-    for (i = responseIndex % dataLength; i < dataLength; i++) {
-      sendByte(defaultResponseValues[i], true);
-      responseBuff[responseIndex] = defaultResponseValues[i];
-      responseIndex++;
+  // Node timeout (and nothing received this time), send default response
+  if (waitingOnNodes > 0 && !dontTimeout && time > timeoutTime) {
+    if ((node = currentNodeStatus()) && node->misses < 0xFF) {
+      node->misses++;
     }
 
+    sendDefaultResponse();
     dontTimeout = true;
-    waitingOnNodes--;
+    nodeDone = true;
+  }
+
+  // On to the next node (if the next one hasn't already started)
+  if (nodeDone && responseIndex % dataLength == 0) {
+    startNodeResponse(time);
   }
 
   if (waitingOnNodes == 0) {
@@ -161,8 +530,11 @@ uint8_t MultidropMaster::checkForResponses(uint32_t time) {
   return false;
 }
 
-MultidropMaster::adr_state_t MultidropMaster::checkForAddresses(uint32_t time) {
-  uint8_t b;
+template <class Transport>
+typename MultidropMasterT<Transport>::adr_state_t MultidropMasterT<Transport>::checkForAddresses(uint32_t time) {
+  uint8_t b = 0,
+          raw,
+          received = false;
 
   if (dontTimeout) {
     timeoutTime = time + addrTimeoutDuration;
@@ -181,7 +553,16 @@ MultidropMaster::adr_state_t MultidropMaster::checkForAddresses(uint32_t time) {
   if (serial->available()) {
     dontTimeout = true; // skip timing out next call
     while (serial->available()) {
-      b = serial->read();
+      raw = serial->read();
+      if (unescape(&raw, 1)) {
+        b = raw;
+        received = true;
+      }
+    }
+
+    // Only an escape byte so far
+    if (!received) {
+      return ADR_WAITING;
     }
 
     // Verify it's 1 larger than the last address and send confirmation
@@ -228,29 +609,82 @@ MultidropMaster::adr_state_t MultidropMaster::checkForAddresses(uint32_t time) {
   return ADR_WAITING;
 }
 
-uint8_t MultidropMaster::sendData(uint8_t d) {
+template <class Transport>
+uint8_t MultidropMasterT<Transport>::sendData(uint8_t d) {
   if (state == EOM) return 0;
 
-  sendByte(d, true);
+  if (segmentMode) {
+    serial->enable_write();
+    sendSegmentByte(d);
+    serial->enable_read();
+  } else {
+    sendByte(d, true);
+  }
   state = DATA_SENDING;
   return 1;
 }
 
-uint8_t MultidropMaster::sendData(uint8_t *data, uint16_t len) {
+template <class Transport>
+uint8_t MultidropMasterT<Transport>::sendData(uint8_t *data, uint16_t len) {
   if (state == EOM) return 0;
 
   serial->enable_write();
-  for(uint16_t i = 0; i < len; i++) {
-    sendByte(data[i]);
+  if (segmentMode) {
+    for (uint16_t i = 0; i < len; i++) {
+      sendSegmentByte(data[i]);
+    }
+  }
+  else if (framing == MD_FRAMING_STUFFED) {
+    for (uint16_t i = 0; i < len; i++) {
+      sendByte(data[i]);
+    }
+  }
+  else {
+    serial->write(data, len);
+    for (uint16_t i = 0; i < len; i++) {
+      messageCRC = _crc16_update(messageCRC, data[i]);
+    }
   }
   serial->enable_read();
+
   state = DATA_SENDING;
   return 1;
 }
 
-void MultidropMaster::sendByte(uint8_t b, uint8_t directionCntrl, uint8_t updateCRC) {
+template <class Transport>
+void MultidropMasterT<Transport>::sendSegmentByte(uint8_t b) {
+  if (segmentPos == 0) {
+    segmentCheck = _crc8_ccitt_update(segmentHeader, segmentNode);
+    fecStart();
+  }
+
+  sendByte(b);
+  segmentCheck = _crc8_ccitt_update(segmentCheck, b);
+  if (segmentFec) {
+    fecUpdate(b);
+  }
+
+  // End of this node's data
+  if (++segmentPos == dataLength) {
+    sendByte(segmentCheck);
+    if (segmentFec) {
+      fecUpdate(segmentCheck);
+      sendByte(fecByte());
+    }
+    segmentPos = 0;
+    segmentNode++;
+  }
+}
+
+template <class Transport>
+void MultidropMasterT<Transport>::sendByte(uint8_t b, uint8_t directionCntrl, uint8_t updateCRC) {
   if (directionCntrl) serial->enable_write();
-  serial->write(b);
+  if (needsEscape(b)) {
+    serial->write(MD_FRAME_ESC);
+    serial->write(b ^ MD_FRAME_ESC_XOR);
+  } else {
+    serial->write(b);
+  }
   if (directionCntrl) serial->enable_read();
 
   if (updateCRC) {
@@ -258,7 +692,8 @@ void MultidropMaster::sendByte(uint8_t b, uint8_t directionCntrl, uint8_t update
   }
 }
 
-uint8_t MultidropMaster::finishMessage() {
+template <class Transport>
+uint8_t MultidropMasterT<Transport>::finishMessage() {
   if (state == EOM) return 0;
 
   serial->enable_write();
@@ -273,6 +708,9 @@ uint8_t MultidropMaster::finishMessage() {
     }
 
     // Send null message, just in case
+    if (framing == MD_FRAMING_STUFFED) {
+      serial->write(MD_FRAME_DELIM);
+    }
     messageCRC = ~0;
     sendByte(0x00);     // flags
     sendByte(0x00);     // broadcast address
@@ -287,6 +725,14 @@ uint8_t MultidropMaster::finishMessage() {
   serial->enable_read();
 
   state = EOM;
+  segmentMode = 0;
   return 1;
 }
 
+// Transports the master is built for
+template class MultidropMasterT<MultidropData>;
+#ifdef __AVR__
+template class MultidropMasterT<MultidropData485>;
+#elif defined(__linux__)
+template class MultidropMasterT<MultidropDataSerial>;
+#endif
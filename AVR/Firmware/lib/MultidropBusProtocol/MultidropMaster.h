@@ -3,8 +3,7 @@
 #ifndef MultidropMaster_H
 #define MultidropMaster_H
 
-#include <avr/io.h>
-#include <stdint.h>
+#include "MultidropPlatform.h"
 #include "Multidrop.h"
 
 // How many times master will try to get a node's address, before deciding it is done
@@ -12,7 +11,59 @@
 #define MD_MASTER_ADDR_MAX_TRIES 4
 #endif
 
-class MultidropMaster: public Multidrop {
+// Baud negotiation: how many census messages are sent at each new baud rate
+#ifndef MD_BAUD_CENSUS_ROUNDS
+#define MD_BAUD_CENSUS_ROUNDS 3
+#endif
+
+// Baud negotiation: missing node responses allowed, across all census rounds
+#ifndef MD_BAUD_MAX_MISSING
+#define MD_BAUD_MAX_MISSING 0
+#endif
+
+// Baud negotiation: node CRC errors allowed, across all census rounds
+#ifndef MD_BAUD_MAX_ERRORS
+#define MD_BAUD_MAX_ERRORS 0
+#endif
+
+// Baud negotiation: how many times the new rate is confirmed (nodes that miss every one go back)
+#ifndef MD_BAUD_CONFIRM_REPEAT
+#define MD_BAUD_CONFIRM_REPEAT 3
+#endif
+
+// Node tracking: response timeouts in a row before a node is considered dead
+#ifndef MD_DEAD_NODE_MISSES
+#define MD_DEAD_NODE_MISSES 3
+#endif
+
+// Node tracking: how many response messages a dead node is skipped for, before it's tried again
+#ifndef MD_DEAD_NODE_PROBE
+#define MD_DEAD_NODE_PROBE 50
+#endif
+
+// Node tracking: a node's response timeout is its average response latency times this
+#ifndef MD_LATENCY_TIMEOUT_FACTOR
+#define MD_LATENCY_TIMEOUT_FACTOR 4
+#endif
+
+// Node tracking: latency value for a node that hasn't responded yet
+#define MD_LATENCY_UNKNOWN 0xFFFF
+
+// The response history of a node (see MultidropMasterT::setNodeTracking)
+struct MultidropNodeStatus {
+  uint16_t latency; // Average time until the node starts to respond, times 4 (MD_LATENCY_UNKNOWN when not known)
+  uint8_t  misses;  // Response timeouts in a row
+  uint8_t  skipped; // Response messages skipped since the node was last tried
+};
+
+/**
+  Multidrop Master class
+
+  Like MultidropSlaveT, the transport is a template parameter. `MultidropMaster`
+  uses any `MultidropData` transport, through virtual calls.
+*/
+template <class Transport>
+class MultidropMasterT: public Multidrop {
 
 public:
   enum adr_state_t {
@@ -20,13 +71,21 @@ public:
     ADR_DONE,
     ADR_ERROR
   };
+  enum baud_state_t {
+    BAUD_WAITING,
+    BAUD_DONE
+  };
   uint8_t nodeNum;
 
-  MultidropMaster(MultidropData *_serial);
+  MultidropMasterT(Transport *_serial);
 
   // Set the number of nodes on the bus
   void setNodeLength(uint8_t);
 
+  // Set how the start of each message is marked (MD_FRAMING_SOM or MD_FRAMING_STUFFED).
+  // All nodes need to be set to the same framing.
+  void setFraming(uint8_t mode);
+
   // Add the pin and registers for the next daisy chain line
   // This is for master nodes that only have an out line and the
   // bus does not come back around to master
@@ -35,6 +94,10 @@ public:
                          volatile uint8_t* next_port_register,
                          volatile uint8_t* next_pin_register);
 
+  // Use a function to set the next daisy chain line, instead of a pin
+  // (i.e. when the line is a modem control line on a host serial port)
+  void addNextDaisyChain(multidropDaisyFunction handler);
+
   // Start a new message to send
   uint8_t startMessage(uint8_t command,
                       uint8_t destination=BROADCAST_ADDRESS,
@@ -42,6 +105,33 @@ public:
                       uint8_t batchMode=false,
                       uint8_t responseMessage=false);
 
+  // Start a delta batch message, which only has data for some of the nodes
+  // (i.e. only the nodes whose color has changed).
+  //   * changed: Bitmap of the nodes that have data, `(nodeNum + 7) / 8` bytes long.
+  //              The first byte's least significant bit is node 1.
+  // Then send `dataLength` bytes for each of those nodes, in address order, and finish the message.
+  //   * nibbleMode: `dataLength` is in nibbles (see startNibbleMessage)
+  uint8_t startDeltaMessage(uint8_t command, uint8_t dataLength, const uint8_t *changed, uint8_t nibbleMode=false);
+
+  // Start a batch message where each node's data is `nibbles` x 4 bits, packed back to back
+  // (high nibble first). Send `(nodeNum * nibbles + 1) / 2` bytes of data and finish the message.
+  uint8_t startNibbleMessage(uint8_t command, uint8_t nibbles);
+
+  // Start an exchange message, where master sends data to every node and then every node
+  // responds, in a single message (see Multidrop::EXCHANGE_FLAG).
+  // Send `dataLength` bytes for each node, then call `setResponseSettings` and `checkForResponses`
+  // like any other response message, with responses that are `responseLength` bytes for each node.
+  // Wait until the data has been sent (i.e. flush the transport) before calling `setResponseSettings`,
+  // so the response timeout doesn't start before the nodes have their data.
+  uint8_t startExchangeMessage(uint8_t command, uint8_t dataLength, uint8_t responseLength);
+
+  // Start a segment batch message, where every node's data is sent with its own check byte
+  // (see Multidrop::SEGMENT_FLAG). Send `dataLength` bytes for each node, like any batch
+  // message, and the check bytes are added. `dataLength` cannot be 0.
+  //   * errorCorrection: Also add an error correction byte for each node (see Multidrop::FEC_FLAG).
+  //                      `dataLength` can then be up to MD_FEC_MAX_LEN.
+  uint8_t startSegmentMessage(uint8_t command, uint8_t dataLength, uint8_t errorCorrection=false);
+
   // Send a reset message to all nodes, which tells them to forget their address and
   // drop their daisy lines to low.
   void resetAllNodes();
@@ -56,6 +146,41 @@ public:
   // Check for new addresses received
   adr_state_t checkForAddresses(uint32_t time);
 
+  // Find the fastest baud rate that all nodes can reliably communicate at.
+  // Each rate is tried in order: all nodes are told to switch with a CMD_SET_BAUD message,
+  // then they are checked with several census messages. If nodes are missing, or reporting
+  // CRC errors (see MD_BAUD_MAX_MISSING and MD_BAUD_MAX_ERRORS), everything is switched
+  // back to `currentBaud` and the next rate is tried.
+  // Switching is a two step commit: once every census round passes, master confirms the
+  // rate with a second CMD_SET_BAUD (sent MD_BAUD_CONFIRM_REPEAT times). Until then, each
+  // node goes back to its previous rate on its own, after a confirm timeout (long enough
+  // for all census rounds to time out).
+  // Nodes that miss the message back to `currentBaud`, at a rate that isn't working, still
+  // make it back; master waits for their timeout before trying the next rate. And before
+  // each rate is sent, master sends a break, so nodes that couldn't read the last rate
+  // are ready for the message.
+  // You'll need to call `checkBaudNegotiation` regularly to handle the process.
+  //   * rates: The baud rates to try, fastest first.
+  //   * numRates: The number of rates.
+  //   * currentBaud: The baud rate everything is running at now. This is the final fallback.
+  //   * buff: Buffer used for census responses (at least `nodeNum` bytes).
+  //   * time: The current system time, in milliseconds.
+  //   * switchDelay: (optional) How long nodes wait, after the message, to switch baud rates (in milliseconds)
+  //   * timeout: (optional) How long master will wait for each node to respond to the census.
+  void startBaudNegotiation(const uint32_t *rates,
+                            uint8_t numRates,
+                            uint32_t currentBaud,
+                            uint8_t *buff,
+                            uint32_t time,
+                            uint16_t switchDelay=20,
+                            uint32_t timeout=10);
+
+  // Continue the baud rate negotiation
+  baud_state_t checkBaudNegotiation(uint32_t time);
+
+  // Return the baud rate that master is currently using
+  uint32_t getBaudRate();
+
   // When sending a response request message, we need three more values:
   //   * buff: The buffer to store the responses for all nodes. This needs to be initialized
   //        large enough for everything (number of nodes * size of response for each).
@@ -67,6 +192,20 @@ public:
   //        node response.
   void setResponseSettings(uint8_t buff[], uint32_t time, uint32_t timeout, uint8_t defaultResponse[]);
 
+  // Track how each node responds to batch response messages, so the response timeout can
+  // follow how fast each node is, and nodes that keep timing out are skipped (their default
+  // response is sent right away, without waiting). Dead nodes are tried again every
+  // `probeInterval` response messages. Baud negotiation census messages aren't tracked,
+  // and the status is reset when a negotiation starts.
+  //   * status: The status of each node, `nodeNum` long. These are reset, so call this again
+  //             after addressing. Pass 0 to stop tracking.
+  //   * minTimeout: The shortest response timeout to use (in the same units as `time`)
+  //   * probeInterval: (optional) How many response messages a dead node is skipped for.
+  void setNodeTracking(MultidropNodeStatus *status, uint32_t minTimeout, uint8_t probeInterval=MD_DEAD_NODE_PROBE);
+
+  // Is a node (by address) being skipped, because it keeps timing out
+  uint8_t isNodeDead(uint8_t address);
+
   // Call regularly to check for node responses.
   //  - time: Used to keep accurate time and timeout nodes who take too long to respond
   // Return: true when all nodes have responded
@@ -89,11 +228,27 @@ private:
     DATA_SENDING
   };
 
+  enum BaudStep {
+    BAUD_IDLE,
+    BAUD_SWITCH_UP,   // Waiting to switch to the new baud rate
+    BAUD_SETTLE,      // Waiting for all nodes to switch
+    BAUD_CENSUS,      // Checking all nodes at the new rate
+    BAUD_SWITCH_DOWN  // Waiting to switch back to the base baud rate
+  };
+
+  Transport *serial;
+
   uint32_t timeoutTime,
            timeoutDuration,
            addrTimeoutDuration;
   uint16_t responseIndex;
 
+  // Node tracking
+  MultidropNodeStatus *nodeStatus;
+  uint32_t minTimeoutDuration,
+           responseWaitStart;
+  uint8_t  deadProbeInterval;
+
   uint8_t  destAddress,
            dataLength,
            state,
@@ -105,8 +260,77 @@ private:
   uint8_t *responseBuff,
           *defaultResponseValues;
 
-  // Send a byte and, optionally, update the messageCRC value
+  // Segment messages
+  uint8_t segmentMode,
+          segmentFec,    // Error correction bytes are added (see Multidrop::FEC_FLAG)
+          segmentHeader, // CRC-8 of the header
+          segmentCheck,  // CRC-8 of the current node's segment
+          segmentNode,   // The node the data is for
+          segmentPos;    // Data bytes sent for the current node
+
+  // Baud negotiation
+  const uint32_t *baudRates;
+  uint32_t baudRate,
+           baseBaudRate,
+           baudSwitchTime,
+           baudRevertTime,  // When the nodes give up on an unconfirmed rate
+           censusTimeout;
+  uint16_t baudSwitchDelay,
+           baudConfirmTimeout,
+           censusMissing,
+           censusErrors;
+  uint8_t  baudStep,
+           baudRateIdx,
+           numBaudRates,
+           censusRound,
+           censusDefault,
+           *censusBuff;
+
+  // Tell all nodes to switch baud rates after `baudSwitchDelay`.
+  // Unless `confirmTimeout` is 0, they go back to their previous rate after that long,
+  // if the switch isn't confirmed by sending the same rate again.
+  void sendBaudRate(uint32_t baud, uint32_t time, uint16_t confirmTimeout);
+
+  // Start switching to the next baud rate in the negotiation list
+  void tryNextBaudRate(uint32_t time);
+
+  // Hold the line low for a few byte times at the base rate, so every node listening at it
+  // gets a framing error, and drops whatever it was parsing (see MultidropData::bytesBeforeError).
+  // A node that stayed behind at the base rate can take a census at a rate it can't read
+  // for the start of a long message, which would swallow the next CMD_SET_BAUD.
+  void sendBreak();
+
+  // Send the next census message for the baud negotiation
+  void startCensus(uint32_t time);
+
+  // Forget every node's response history
+  void resetNodeTracking();
+
+  // The tracking status of the node we're waiting on for a response (0 if not tracking)
+  MultidropNodeStatus* currentNodeStatus();
+
+  // The response timeout for the node we're waiting on
+  uint32_t responseTimeout();
+
+  // Start waiting for the next node to respond, and skip it if it's dead
+  void startNodeResponse(uint32_t time);
+
+  // Send the rest of the current node's response with the default values
+  void sendDefaultResponse();
+
+  // Start a message by sending the header
+  // (`responseLen` is only sent for exchange messages)
+  void sendHeader(uint8_t command, uint8_t destinationAddr, uint8_t dataLen, uint8_t flags, uint8_t responseLen=0);
+
+  // Send a byte of a segment message, followed by the check byte when it's the
+  // last one for the node
+  void sendSegmentByte(uint8_t b);
+
+  // Send a byte (escaped, if needed) and, optionally, update the messageCRC value
   void sendByte(uint8_t b, uint8_t directionCntrl=0, uint8_t updateCRC=1);
 };
 
+// Master using any MultidropData transport
+typedef MultidropMasterT<MultidropData> MultidropMaster;
+
 #endif
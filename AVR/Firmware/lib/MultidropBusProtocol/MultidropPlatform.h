@@ -0,0 +1,54 @@
+#ifndef MultidropPlatform_H
+#define MultidropPlatform_H
+
+/************************************************************************************
+ *  The few platform specific pieces the protocol library needs.
+ *
+ *  On AVR these come straight from avr-libc. Anywhere else (i.e. running the master
+ *  on a Linux host, see linux/), equivalent versions are defined here so the library
+ *  sources can be compiled unchanged.
+ ************************************************************************************/
+
+#include <stdint.h>
+
+#ifdef __AVR__
+
+#include <avr/io.h>
+#include <util/crc16.h>
+#include <util/delay.h>
+
+#else
+
+// Same as avr-libc's _crc16_update (polynomial 0xA001)
+static inline uint16_t _crc16_update(uint16_t crc, uint8_t a) {
+  crc ^= a;
+  for (uint8_t i = 0; i < 8; ++i) {
+    if (crc & 1) {
+      crc = (crc >> 1) ^ 0xA001;
+    } else {
+      crc = (crc >> 1);
+    }
+  }
+  return crc;
+}
+
+// Same as avr-libc's _crc8_ccitt_update (polynomial 0x07)
+static inline uint8_t _crc8_ccitt_update(uint8_t crc, uint8_t a) {
+  crc ^= a;
+  for (uint8_t i = 0; i < 8; ++i) {
+    if (crc & 0x80) {
+      crc = (crc << 1) ^ 0x07;
+    } else {
+      crc = (crc << 1);
+    }
+  }
+  return crc;
+}
+
+// Host transports handle their own bus turnaround timing,
+// so the small protocol delays are not needed.
+static inline void _delay_us(double) {}
+
+#endif
+
+#endif
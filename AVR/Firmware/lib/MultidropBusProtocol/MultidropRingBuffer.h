@@ -0,0 +1,105 @@
+#ifndef MultidropRingBuffer_H
+#define MultidropRingBuffer_H
+
+/************************************************************************************
+ *  A fixed size FIFO byte buffer, shared between an interrupt and the main program.
+ *
+ *  The size is set at compile time and must be a power of two. This lets the head
+ *  and tail run freely as 8-bit counters, which are wrapped into the buffer with a
+ *  mask, instead of a (software) modulo on every byte. The number of bytes in the
+ *  buffer is simply `head - tail`.
+ *
+ *  Only one side (i.e. the interrupt) should push and only one side should shift.
+ *
+ *  Example:
+ *  ```
+ *    static MultidropRingBuffer<64> buffer;
+ *    buffer.push(0x01);
+ *    uint8_t b = buffer.shift();
+ *  ```
+ ************************************************************************************/
+
+#include <stdint.h>
+
+template <uint8_t Size>
+class MultidropRingBuffer {
+  static_assert(Size >= 2 && (Size & (Size - 1)) == 0, "MultidropRingBuffer size must be a power of two");
+  static_assert(Size <= 128, "MultidropRingBuffer size cannot be larger than 128");
+
+public:
+  static const uint8_t SIZE = Size;
+  static const uint8_t MASK = Size - 1;
+
+  // How many bytes are in the buffer
+  inline uint8_t count() const {
+    return (uint8_t)(head - tail);
+  }
+
+  inline uint8_t isEmpty() const {
+    return head == tail;
+  }
+
+  inline uint8_t isFull() const {
+    return (uint8_t)(head - tail) == Size;
+  }
+
+  // Add a byte to the head of the buffer (check `isFull()` first)
+  inline void push(uint8_t b) {
+    uint8_t h = head;
+    data[h & MASK] = b;
+    head = h + 1;
+  }
+
+  // Remove a byte from the tail of the buffer (check `isEmpty()` first)
+  inline uint8_t shift() {
+    uint8_t t = tail;
+    uint8_t b = data[t & MASK];
+    tail = t + 1;
+    return b;
+  }
+
+  // Return the byte at the tail, without removing it
+  inline uint8_t peek() const {
+    return data[tail & MASK];
+  }
+
+  // The number of bytes, starting at the tail, that are stored contiguously in memory
+  inline uint8_t contiguous() const {
+    uint8_t c = count(),
+            toEnd = Size - (tail & MASK);
+    return (c < toEnd) ? c : toEnd;
+  }
+
+  // Pointer to the tail byte in memory (see `contiguous()`)
+  inline const uint8_t* front() const {
+    return (const uint8_t*)&data[tail & MASK];
+  }
+
+  // Remove `len` bytes from the tail of the buffer
+  inline void skip(uint8_t len) {
+    tail = tail + len;
+  }
+
+  // Drop everything in the buffer (from the shifting side)
+  inline void clear() {
+    tail = head;
+  }
+
+  // The free running positions of the next byte pushed and of the tail byte.
+  // A byte in the stream can be marked with `headPosition()` before it's pushed,
+  // and found again at `mark - tailPosition()` bytes from the tail.
+  inline uint8_t headPosition() const {
+    return head;
+  }
+
+  inline uint8_t tailPosition() const {
+    return tail;
+  }
+
+private:
+  volatile uint8_t data[Size];
+  volatile uint8_t head;
+  volatile uint8_t tail;
+};
+
+#endif
@@ -1,67 +1,135 @@
 
 #include "MultidropSlave.h"
-#include <util/crc16.h>
-#include <util/delay.h>
+#ifdef __AVR__
+#include "MultidropData485.h"
+#endif
 
 #define MAX_ADDR_ERRORS 5
 
 #define SOM 0xFF
 
-MultidropSlave::MultidropSlave(MultidropData *_serial) : Multidrop(_serial) {
+template <class Transport>
+MultidropSlaveT<Transport>::MultidropSlaveT(Transport *_serial) : serial(_serial) {
   flags = 0;
   myAddress = 0;
   responseHandler = 0;
+  parsingSpan = 0;
+  spanIndex = 0;
+  rxFilter = MD_FILTER_OFF;
+  rxFilterMode = MD_FILTER_OFF;
+  crcErrorCount = 0;
+  messageCount = 0;
+  correctedCount = 0;
+  censusErrorBase = 0;
   parseState = NO_MESSAGE;
+  resumeState = NO_MESSAGE;
 }
 
-void MultidropSlave::resetNode() {
+template <class Transport>
+void MultidropSlaveT<Transport>::resetNode() {
   lastAddr = 0xFF;
   address = 0;
   myAddress = 0;
   setNextDaisyValue(0);
+  applyRxFilter();
 }
 
-uint8_t MultidropSlave::hasNewMessage() {
+template <class Transport>
+uint8_t MultidropSlaveT<Transport>::hasNewMessage() {
   return parseState == MESSAGE_READY;
 }
 
-uint8_t MultidropSlave::isAddressedToMe() {
+template <class Transport>
+uint8_t MultidropSlaveT<Transport>::isAddressedToMe() {
   return hasNewMessage() && (address == myAddress || address == BROADCAST_ADDRESS);
 }
 
-uint8_t MultidropSlave::inBatchMode() {
+template <class Transport>
+uint8_t MultidropSlaveT<Transport>::inBatchMode() {
   return flags & BATCH_FLAG;
 }
 
-uint8_t MultidropSlave::isResponseMessage() {
+template <class Transport>
+uint8_t MultidropSlaveT<Transport>::inNibbleMode() {
+  return flags & NIBBLE_FLAG;
+}
+
+template <class Transport>
+uint8_t MultidropSlaveT<Transport>::inExchangeMode() {
+  return flags & EXCHANGE_FLAG;
+}
+
+template <class Transport>
+uint8_t MultidropSlaveT<Transport>::inSegmentMode() {
+  return (flags & (BATCH_FLAG | SEGMENT_FLAG | RESPONSE_MESSAGE_FLAG | DELTA_FLAG | NIBBLE_FLAG)) == (BATCH_FLAG | SEGMENT_FLAG);
+}
+
+template <class Transport>
+uint8_t MultidropSlaveT<Transport>::inFecMode() {
+  return inSegmentMode() && (flags & FEC_FLAG);
+}
+
+template <class Transport>
+uint8_t MultidropSlaveT<Transport>::isResponseMessage() {
   return flags & RESPONSE_MESSAGE_FLAG;
 }
 
-uint8_t* MultidropSlave::getData() {
+template <class Transport>
+uint8_t* MultidropSlaveT<Transport>::getData() {
   return dataBuffer;
 }
 
-uint8_t MultidropSlave::getDataLen() {
+template <class Transport>
+uint8_t MultidropSlaveT<Transport>::getDataLen() {
   return dataIndex;
 }
 
-uint8_t MultidropSlave::getCommand() {
+template <class Transport>
+uint8_t MultidropSlaveT<Transport>::getCommand() {
   return command;
 }
 
-void MultidropSlave::setAddress(uint8_t addr) {
+template <class Transport>
+void MultidropSlaveT<Transport>::setAddress(uint8_t addr) {
   myAddress = addr;
+  applyRxFilter();
+}
+
+template <class Transport>
+void MultidropSlaveT<Transport>::setRxFilter(uint8_t mode) {
+  rxFilter = mode;
+  applyRxFilter();
+}
+
+template <class Transport>
+void MultidropSlaveT<Transport>::setFraming(uint8_t mode) {
+  framing = mode;
+  rxEscaped = 0;
+  parseState = NO_MESSAGE;
+  applyRxFilter();
+}
+
+template <class Transport>
+void MultidropSlaveT<Transport>::applyRxFilter() {
+  uint8_t mode = rxFilter;
+  if (mode && framing == MD_FRAMING_STUFFED) {
+    mode |= MD_FILTER_STUFFED;
+  }
+  rxFilterMode = serial->setAddressFilter(myAddress, mode);
 }
 
-uint8_t MultidropSlave::getAddress() {
+template <class Transport>
+uint8_t MultidropSlaveT<Transport>::getAddress() {
   return myAddress;
 }
 
-void MultidropSlave::setResponseHandler(multidropResponseFunction handler) {
+template <class Transport>
+void MultidropSlaveT<Transport>::setResponseHandler(multidropResponseFunction handler) {
   responseHandler = handler;
 }
 
-void MultidropSlave::startMessage() {
+template <class Transport>
+void MultidropSlaveT<Transport>::startMessage() {
   flags = 0;
   length = 0;
   address = 0;
@@ -71,51 +139,188 @@ void MultidropSlave::startMessage() {
   fullDataLength = 0;
   fullDataIndex = 0;
   dataStartOffset = 0;
+  batchSliced = 0;
+  deltaMapLength = 0;
+  deltaRank = 0;
+  deltaChanged = 0;
+  deltaMine = 0;
+  exchangeDataLen = 0;
+  exchangeLength = 0;
+  exchangeStart = 0;
+  segmentCheck = 0;
+  segmentDone = 0;
+  segmentReceived = 0;
+  resumeState = NO_MESSAGE;
   errCount = 0;
   messageCRC = ~0;
 }
 
-uint8_t MultidropSlave::read() {
+template <class Transport>
+uint8_t MultidropSlaveT<Transport>::read() {
   checkDaisyChainPolarity();
 
-  // Move onto the next message
+  // Move onto the next message (or the rest of this one)
   if (parseState == MESSAGE_READY) {
-    parseState = NO_MESSAGE;
+    parseState = resumeState;
+    resumeState = NO_MESSAGE;
   }
 
   // No new data, but our prev daisy line became enabled
-  if (command == CMD_ADDRESS && parsePos == ADDR_UNSET && isPrevDaisyEnabled() && !serial->available()){
+  if (command == CMD_ADDRESS && parsePos == ADDR_UNSET && isPrevDaisyEnabled() && !bytesWaiting()){
     processAddressing(lastAddr);
   }
 
-  // Handle incoming bytes
-  while (serial->available()) {
-    if(parse(serial->read()) == 1 && !isResponseMessage()) {
-
-      if (command == CMD_RESET) {
-        resetNode();
+  // Handle incoming bytes, a span at a time
+  const uint8_t *span;
+  uint8_t len, i, idle, error;
+  while ((len = serial->peekSpan(&span)) > 0) {
+    parsingSpan = 1;
+    idle = serial->bytesBeforeIdle();
+    error = serial->bytesBeforeError();
+
+    for (i = 0; i < len; i++) {
+      spanIndex = i;
+      if (i == error) {
+        dropMessage();
+        continue;
+      }
+      if (i == idle) {
+        idleReset();
       }
+      if(parse(span[i]) == 1) {
+        parsingSpan = 0;
+        serial->consume(i + 1);
+
+        // This node already sent its response, so it's not new. The rest of the
+        // span is parsed on the next call, once the message is out of the way.
+        if (isResponseMessage() && !inExchangeMode()) {
+          return 0;
+        }
 
-      return 1;
+        if (command == CMD_RESET) {
+          resetNode();
+        }
+        // Only count errors at the new baud rate
+        else if (command == CMD_SET_BAUD) {
+          censusErrorBase = errorCount();
+        }
+
+        return 1;
+      }
     }
+
+    parsingSpan = 0;
+    serial->consume(len);
   }
   return 0;
 }
 
+/**
+ * The line went idle before the next byte, so the message being parsed
+ * has ended, whether or not all of it arrived.
+ */
+template <class Transport>
+void MultidropSlaveT<Transport>::idleReset() {
+
+  // Nodes can take a while to respond, so there are gaps in these
+  if (parseState >= DATA_SECTION && (isResponseMessage() || command == CMD_ADDRESS)) return;
+
+  dropMessage();
+}
+
+/**
+ * Drop the message being parsed, if there is one
+ * (a byte with a framing error was received, see MultidropData::bytesBeforeError).
+ */
+template <class Transport>
+void MultidropSlaveT<Transport>::dropMessage() {
+  if (parseState == NO_MESSAGE || parseState == MESSAGE_READY) return;
+
+  // The message was cut short (not just a stray start byte)
+  if (parseState != START_SECTION) {
+    crcErrorCount++;
+  }
+  parseState = NO_MESSAGE;
+  rxEscaped = 0;
+}
+
+/**
+ * The number of bytes received after the one currently being parsed.
+ */
+template <class Transport>
+uint8_t MultidropSlaveT<Transport>::bytesWaiting() {
+  // The span, up to and including the byte being parsed, has not been consumed yet
+  if (parsingSpan) {
+    return serial->available() - (spanIndex + 1);
+  }
+  return serial->available();
+}
+
+/**
+ * The total of all receive errors (transport and CRC).
+ */
+template <class Transport>
+uint16_t MultidropSlaveT<Transport>::errorCount() {
+  MultidropDataErrors errors;
+  serial->getErrors(&errors);
+  return errors.framing + errors.overrun + errors.dropped + crcErrorCount;
+}
+
 /**
  * Parse the next byte off the bus.
  * Returns 1 if a full message has been received, 0 if not.
  */
-uint8_t MultidropSlave::parse(uint8_t b) {
+template <class Transport>
+uint8_t MultidropSlaveT<Transport>::parse(uint8_t b) {
+
+  // Every delimiter starts a new message (the delimiter is never escaped)
+  if (framing == MD_FRAMING_STUFFED) {
+    if (b == MD_FRAME_ESC) {
+      rxEscaped = 1;
+      return 0;
+    }
+    if (b == MD_FRAME_DELIM) {
+      rxEscaped = 0;
+      if (parseState == MESSAGE_READY) return 0;
+
+      // The last message was cut short
+      if (parseState != NO_MESSAGE) {
+        crcErrorCount++;
+      }
+      startMessage();
+      parsePos = SOM2_POS;
+      parseState = HEADER_SECTION;
+      return 0;
+    }
+    if (rxEscaped) {
+      b ^= MD_FRAME_ESC_XOR;
+      rxEscaped = 0;
+    }
+
+    // Between messages
+    if (parseState == NO_MESSAGE) return 0;
+  }
 
   if (parseState == HEADER_SECTION) {
     parseHeader(b);
+
+    // Empty batch slice
+    if (parseState == MESSAGE_READY) {
+      messageCount++;
+      return 1;
+    }
   }
   else if (parseState == DATA_SECTION) {
     if (command == CMD_ADDRESS) {
       processAddressing(b);
     } else {
       processData(b);
+
+      // Batch slice complete (there's no CRC, see MD_FILTER_BATCH_SLICE)
+      if (parseState == MESSAGE_READY) {
+        messageCount++;
+        return 1;
+      }
     }
   }
   // Validate CRC
@@ -134,9 +339,17 @@ uint8_t MultidropSlave::parse(uint8_t b) {
     // Validate each byte
     if (crcByte != b) {
       parseState = NO_MESSAGE; // no match, abort
+      crcErrorCount++;
+      endFilteredMessage();
+    }
+    // Segment messages are ready once our segment is checked, not again here
+    else if (parsePos == EOM2_POS && segmentDone) {
+      parseState = NO_MESSAGE;
     }
     else if (parsePos == EOM2_POS) {
       parseState = MESSAGE_READY;
+      messageCount++;
+      endFilteredMessage();
       return 1;
     }
   }
@@ -161,13 +374,21 @@ uint8_t MultidropSlave::parse(uint8_t b) {
   return 0;
 }
 
-void MultidropSlave::parseHeader(uint8_t b) {
+template <class Transport>
+void MultidropSlaveT<Transport>::parseHeader(uint8_t b) {
   messageCRC = _crc16_update(messageCRC, b);
+  segmentCheck = _crc8_ccitt_update(segmentCheck, b);
 
   // Header flags
   if (parsePos == SOM2_POS) {
     parsePos = HEADER_FLAGS_POS;
     flags = b;
+
+    // Flags that master never sends: this isn't really the start of a message
+    // (and it shouldn't be mistaken for a response message, see idleReset)
+    if (b & ~(BATCH_FLAG | RESPONSE_MESSAGE_FLAG | DELTA_FLAG | NIBBLE_FLAG | EXCHANGE_FLAG | SEGMENT_FLAG | FEC_FLAG)) {
+      parseState = NO_MESSAGE;
+    }
   }
   // Address
   else if (parsePos == HEADER_FLAGS_POS) {
@@ -186,7 +407,16 @@ void MultidropSlave::parseHeader(uint8_t b) {
     // in batch mode, the first length byte is the number of nodes
     if (inBatchMode()) {
       numNodes = b;
-    } else {
+    }
+    // The RX filter drops the rest of messages for other nodes (see MD_FILTER_ADDRESSED)
+    else if ((rxFilterMode & MD_FILTER_ADDRESSED) &&
+             address != myAddress &&
+             address != BROADCAST_ADDRESS &&
+             !isResponseMessage() &&
+             command != CMD_ADDRESS) {
+      parseState = NO_MESSAGE;
+    }
+    else {
       length = b;
       fullDataLength = b;
       dataStartOffset = 0;
@@ -197,9 +427,40 @@ void MultidropSlave::parseHeader(uint8_t b) {
   else if (parsePos == HEADER_LEN1_POS) {
     length = b;
 
-    if (myAddress != 0) {
-      fullDataLength = length * numNodes;
-      dataStartOffset = (myAddress - 1) * length; // Where our data starts in the message
+    // Exchange message: the response length is next
+    if (inExchangeMode()) {
+      parsePos = HEADER_LEN2_POS;
+      return;
+    }
+
+    // Delta message: The data length and our offset come from the bitmap
+    if (myAddress != 0 && (flags & DELTA_FLAG) && !isResponseMessage() && numNodes > 0) {
+      deltaMapLength = (numNodes + 7) / 8;
+      fullDataLength = deltaMapLength;
+      dataStartOffset = 0xFFFF;
+    }
+    // Nibble message: our offset is in nibbles
+    else if (myAddress != 0 && inNibbleMode()) {
+      fullDataLength = ((uint16_t)length * numNodes + 1) / 2;
+      dataStartOffset = (uint16_t)(myAddress - 1) * length;
+    }
+    else if (myAddress != 0) {
+      // Segment messages: each node's data has a check byte after it
+      // (and an error correction byte after that)
+      uint16_t segment = length + (inFecMode() ? 2 : inSegmentMode() ? 1 : 0);
+
+      fullDataLength = segment * numNodes;
+      dataStartOffset = (myAddress - 1) * segment; // Where our data starts in the message
+
+      // The RX filter only passes our slice of the data
+      if ((rxFilterMode & MD_FILTER_BATCH_SLICE) &&
+          myAddress <= numNodes &&
+          !isResponseMessage() &&
+          command != CMD_ADDRESS) {
+        batchSliced = 1;
+        fullDataLength = segment;
+        dataStartOffset = 0;
+      }
     }
     else {
       // We don't have an address, so cannot read message
@@ -209,6 +470,23 @@ void MultidropSlave::parseHeader(uint8_t b) {
     parsePos = HEADER_LEN2_POS;
     parseState = DATA_SECTION;
   }
+  // Length, 3rd byte (exchange messages): master's data comes first, then the responses
+  else if (parsePos == HEADER_LEN2_POS) {
+    exchangeDataLen = length;
+    length = b;
+
+    if (myAddress != 0) {
+      exchangeLength = (uint16_t)exchangeDataLen * numNodes;
+      exchangeStart = (uint16_t)(myAddress - 1) * exchangeDataLen;
+      fullDataLength = exchangeLength + (uint16_t)length * numNodes;
+      dataStartOffset = exchangeLength + (uint16_t)(myAddress - 1) * length;
+    } else {
+      length = 0;
+    }
+
+    parsePos = HEADER_LEN3_POS;
+    parseState = DATA_SECTION;
+  }
 
   // Finishing header
   if (parseState == DATA_SECTION) {
@@ -221,26 +499,49 @@ void MultidropSlave::parseHeader(uint8_t b) {
     // No data, continue to CRC
     else if (length == 0) {
       parsePos = DATA_POS;
-      parseState = END_SECTION;
+      parseState = (batchSliced) ? MESSAGE_READY : END_SECTION;
     }
 
     // If in response message and we're the first node, move straight to sending a response
-    else if (isResponseMessage() && myAddress == 1) {
+    else if (isResponseMessage() && myAddress == 1 && dataStartOffset == 0) {
       sendResponse();
     }
   }
 }
 
-void MultidropSlave::processData(uint8_t b) {
+template <class Transport>
+void MultidropSlaveT<Transport>::processData(uint8_t b) {
   messageCRC = _crc16_update(messageCRC, b);
   parsePos = DATA_POS;
-  
+
+  if (fullDataIndex < deltaMapLength) {
+    parseDeltaMap(b);
+  }
+
   // If we're in our data section, fill data buffer
-  if (fullDataIndex >= dataStartOffset && dataIndex < length){
+  if (fullDataIndex < exchangeLength) {
+    if (fullDataIndex >= exchangeStart && dataIndex < exchangeDataLen && dataIndex < MD_MAX_DATA_LEN) {
+      dataBuffer[dataIndex++] = b;
+      dataBuffer[dataIndex] = '\0';
+    }
+  }
+  else if (inNibbleMode()) {
+    storeNibble(fullDataIndex * 2, b >> 4);
+    storeNibble(fullDataIndex * 2 + 1, b & 0x0F);
+  }
+  else if (fullDataIndex >= dataStartOffset && dataIndex < length && dataIndex < MD_MAX_DATA_LEN && !inExchangeMode()){
     dataBuffer[dataIndex++] = b;
     dataBuffer[dataIndex] = '\0';
   }
 
+  // Segment messages: check our data, and make the message ready right after it
+  if (inSegmentMode() && fullDataIndex >= dataStartOffset &&
+      fullDataIndex - dataStartOffset <= length + (inFecMode() ? 1 : 0)) {
+    if (checkSegment(b)) {
+      return;
+    }
+  }
+
   fullDataIndex++;
 
   // It's our turn to respond with some data
@@ -251,15 +552,142 @@ void MultidropSlave::processData(uint8_t b) {
 
   // Done with data
   if (fullDataIndex >= fullDataLength) {
+    parseState = (batchSliced) ? MESSAGE_READY : END_SECTION;
+  }
+}
+
+
+template <class Transport>
+uint8_t MultidropSlaveT<Transport>::checkSegment(uint8_t b) {
+  uint8_t pos = fullDataIndex - dataStartOffset;
+
+  if (pos == 0) {
+    segmentCheck = _crc8_ccitt_update(segmentCheck, myAddress);
+    fecStart();
+  }
+
+  // With error correction, the data is checked once it's been corrected
+  if (inFecMode()) {
+    if (pos <= length) {
+      fecUpdate(b);
+      segmentReceived = b;
+      return 0;
+    }
+    b = correctSegment(b);
+  }
+  else if (pos < length) {
+    segmentCheck = _crc8_ccitt_update(segmentCheck, b);
+    return 0;
+  }
+
+  // The check byte (after the error correction byte, with error correction)
+  fullDataIndex++;
+  if (b == segmentCheck) {
+    segmentDone = 1;
+    parseState = MESSAGE_READY;
+
+    // Then go on with the rest of the message, so the next one is found
+    if (!batchSliced) {
+      resumeState = (fullDataIndex >= fullDataLength) ? END_SECTION : DATA_SECTION;
+    }
+  }
+  // There's no message CRC after our slice, so this is the only check
+  else if (batchSliced) {
+    crcErrorCount++;
+    parseState = NO_MESSAGE;
+  }
+  // The message CRC will fail too
+  else if (fullDataIndex >= fullDataLength) {
     parseState = END_SECTION;
   }
+  return 1;
 }
 
+template <class Transport>
+uint8_t MultidropSlaveT<Transport>::correctSegment(uint8_t b) {
+  uint8_t i, result;
+
+  // All of our data has to be in the buffer
+  if (length > MD_MAX_DATA_LEN || length > MD_FEC_MAX_LEN) {
+    return ~segmentCheck;
+  }
+
+  // The check byte is corrected along with the data, after it
+  dataBuffer[length] = segmentReceived;
+  result = fecCorrect(b, dataBuffer, length + 1);
+  b = dataBuffer[length];
+  dataBuffer[length] = '\0';
+
+  for (i = 0; i < length; i++) {
+    segmentCheck = _crc8_ccitt_update(segmentCheck, dataBuffer[i]);
+  }
+
+  if (result == MD_FEC_FAILED) {
+    return ~segmentCheck;
+  }
+  if (result == MD_FEC_CORRECTED && b == segmentCheck) {
+    correctedCount++;
+  }
+  return b;
+}
+
+template <class Transport>
+void MultidropSlaveT<Transport>::parseDeltaMap(uint8_t b) {
+  uint8_t i,
+          node = fullDataIndex * 8, // First node (from 0) in this byte
+          me = myAddress - 1;
+
+  for (i = 0; i < 8; i++, node++) {
+    if (b & (1 << i)) {
+      if (node < me) {
+        deltaRank++;
+      } else if (node == me) {
+        deltaMine = 1;
+      }
+      deltaChanged++;
+    }
+  }
 
-void MultidropSlave::processAddressing(uint8_t b) {
+  // End of the bitmap, now we know where everything is
+  if (fullDataIndex == deltaMapLength - 1) {
+    dataStartOffset = 0xFFFF; // Not ours
+
+    if (inNibbleMode()) {
+      fullDataLength = deltaMapLength + ((uint16_t)deltaChanged * length + 1) / 2;
+      if (deltaMine) {
+        dataStartOffset = deltaMapLength * 2 + (uint16_t)deltaRank * length;
+      }
+    }
+    else {
+      fullDataLength = deltaMapLength + (uint16_t)deltaChanged * length;
+      if (deltaMine) {
+        dataStartOffset = deltaMapLength + (uint16_t)deltaRank * length;
+      }
+    }
+  }
+}
+
+template <class Transport>
+void MultidropSlaveT<Transport>::storeNibble(uint16_t pos, uint8_t nibble) {
+  if (pos < dataStartOffset || pos - dataStartOffset >= length) return;
+
+  uint8_t i = pos - dataStartOffset;
+  if (i / 2 >= MD_MAX_DATA_LEN) return;
+
+  if (i & 1) {
+    dataBuffer[i / 2] |= nibble;
+  } else {
+    dataBuffer[i / 2] = nibble << 4;
+    dataIndex = i / 2 + 1;
+    dataBuffer[dataIndex] = '\0';
+  }
+}
+
+template <class Transport>
+void MultidropSlaveT<Transport>::processAddressing(uint8_t b) {
 
   // We still waiting for an address
-  if (myAddress == 0 && isPrevDaisyEnabled() && !serial->available()){
+  if (myAddress == 0 && isPrevDaisyEnabled() && !bytesWaiting()){
 
     // Address confirmation
     if (parsePos == ADDR_SENT) {
@@ -302,7 +730,7 @@ void MultidropSlave::processAddressing(uint8_t b) {
       parsePos = ADDR_SENT;
       _delay_us(200);
       serial->enable_write();
-      serial->write(b);
+      writeData(&b, 1);
       serial->enable_read();
       lastAddr = b;
       return;
@@ -321,28 +749,108 @@ void MultidropSlave::processAddressing(uint8_t b) {
   }
 }
 
-void MultidropSlave::doneAddressing() {
+template <class Transport>
+void MultidropSlaveT<Transport>::doneAddressing() {
   dataIndex = 0;
   dataBuffer[dataIndex++] = myAddress;
   dataBuffer[dataIndex] = '\0';
   parseState = MESSAGE_READY;
+  endFilteredMessage();
+  applyRxFilter();
+}
+
+template <class Transport>
+void MultidropSlaveT<Transport>::endFilteredMessage() {
+  // The RX filter cannot find the end of these messages itself
+  if (rxFilterMode && (isResponseMessage() || (flags & DELTA_FLAG) || command == CMD_ADDRESS)) {
+    serial->resetAddressFilter();
+  }
 }
 
-void MultidropSlave::sendResponse() {
-  if (responseHandler) {
-    uint8_t i;
-    responseHandler(command, dataBuffer, length);
+template <class Transport>
+void MultidropSlaveT<Transport>::sendResponse() {
+  uint8_t i;
+
+  // The response goes after any data master sent us (exchange messages)
+  uint8_t *buff = &dataBuffer[dataIndex];
+
+  // Too long for the data buffer (or a corrupt header)
+  if ((uint16_t)dataIndex + length > MD_MAX_DATA_LEN) return;
+
+  // Census: respond with the number of errors since the last census
+  if (command == CMD_CENSUS) {
+    if (length >= 1) {
+      uint16_t errors = errorCount() - censusErrorBase;
+      censusErrorBase += errors;
+      buff[0] = (errors < MD_CENSUS_MISSING) ? errors : MD_CENSUS_MISSING - 1;
+    }
+  }
+  // Error and message counters
+  else if (command == CMD_GET_STATS) {
+    if (length >= MD_STATS_LEN) {
+      MultidropDataErrors errors;
+      serial->getErrors(&errors);
+
+      uint16_t stats[MD_STATS_LEN / 2] = {
+        errors.framing,
+        errors.overrun,
+        errors.dropped,
+        crcErrorCount,
+        messageCount,
+        correctedCount
+      };
+      for (i = 0; i < MD_STATS_LEN / 2; i++) {
+        buff[i * 2]     = stats[i] >> 8;
+        buff[i * 2 + 1] = stats[i] & 0xFF;
+      }
+    }
+  }
+  else if (responseHandler) {
+    responseHandler(command, buff, length);
+  }
+  else {
+    return;
+  }
+
+  // Make sure we're not butting up against other data that was just received
+  _delay_us(150);
 
-    // Make sure we're not butting up against other data that was just received
-    _delay_us(150);
+  // Write response buffer to stream
+  serial->enable_write();
+  writeData(buff, length);
+  serial->enable_read();
+
+  for (i = 0; i < length; i++) {
+    messageCRC = _crc16_update(messageCRC, buff[i]);
+  }
+  fullDataIndex += length;
 
-    // Write response buffer to stream
-    serial->enable_write();
-    for (i = 0; i < length; i++) {
-      serial->write(dataBuffer[i]);
-      messageCRC = _crc16_update(messageCRC, dataBuffer[i]);
-      fullDataIndex++;
+  // We were the last node to respond, so the CRC is next
+  if (fullDataIndex >= fullDataLength) {
+    parsePos = DATA_POS;
+    parseState = END_SECTION;
+  }
+}
+
+template <class Transport>
+void MultidropSlaveT<Transport>::writeData(const uint8_t *buf, uint8_t len) {
+  if (framing != MD_FRAMING_STUFFED) {
+    serial->write(buf, len);
+    return;
+  }
+
+  for (uint8_t i = 0; i < len; i++) {
+    if (needsEscape(buf[i])) {
+      serial->write(MD_FRAME_ESC);
+      serial->write(buf[i] ^ MD_FRAME_ESC_XOR);
+    } else {
+      serial->write(buf[i]);
     }
-    serial->enable_read();
   }
 }
+
+// Transports the slave is built for
+template class MultidropSlaveT<MultidropData>;
+#ifdef __AVR__
+template class MultidropSlaveT<MultidropData485>;
+#endif
@@ -2,23 +2,39 @@
 #ifndef MultidropSlave_H
 #define MultidropSlave_H
 
-#include <avr/io.h>
-#include <stdint.h>
+#include "MultidropPlatform.h"
 #include "Multidrop.h"
 
 typedef void (*multidropResponseFunction)(uint8_t command, uint8_t *buff, uint8_t len);
 
+// The most data a node keeps from a message (or from its part of a batch message)
 #ifndef MD_MAX_DATA_LEN
-#define MD_MAX_DATA_LEN 10
+#define MD_MAX_DATA_LEN 12
 #endif
 
+static_assert(MD_STATS_LEN <= MD_MAX_DATA_LEN, "MD_MAX_DATA_LEN is too small for CMD_GET_STATS responses");
+
 /**
   Multidrop Slave class
+
+  The transport is a template parameter, so calls to it can be resolved at
+  compile time. Use `MultidropSlave` to reach the transport through the
+  `MultidropData` interface (virtual calls), or `MultidropSlaveT<>` with the
+  concrete transport class to have them inlined:
+
+  ```
+    MultidropData485 serial(PD2, &DDRD, &PORTD);
+    MultidropSlaveT<MultidropData485> comm(&serial);
+  ```
+
+  Each transport used needs to be explicitly instantiated at the bottom of
+  MultidropSlave.cpp.
 */
-class MultidropSlave: public Multidrop {
+template <class Transport>
+class MultidropSlaveT: public Multidrop {
 
 public:
-  MultidropSlave(MultidropData *_serial);
+  MultidropSlaveT(Transport *_serial);
 
   // Reset the node's stat and unset it's address.
   void resetNode();
@@ -30,6 +46,17 @@ public:
   // Get our address on the network
   uint8_t getAddress();
 
+  // Have the transport drop messages for other nodes, before they are parsed.
+  // `mode` is a combination of the MD_FILTER_* flags (see MultidropData.h).
+  //
+  // NOTE: With MD_FILTER_BATCH_SLICE, only this node's slice of batch messages is
+  // received, so the message CRC cannot be checked for them.
+  void setRxFilter(uint8_t mode);
+
+  // Set how the start of each message is marked (MD_FRAMING_SOM or MD_FRAMING_STUFFED).
+  // This needs to match master.
+  void setFraming(uint8_t mode);
+
   // Reads the latest data on the serial line
   // returns 1 if a new message is ready
   uint8_t read();
@@ -56,6 +83,24 @@ public:
   // Is the current message in batch mode
   uint8_t inBatchMode();
 
+  // Is the current message's data length in nibbles (see Multidrop::NIBBLE_FLAG).
+  // The node's nibbles are moved to the start of the data buffer, high nibble first.
+  uint8_t inNibbleMode();
+
+  // Is the current message an exchange message (see Multidrop::EXCHANGE_FLAG).
+  // The data buffer has the data master sent to this node, and the response handler
+  // is passed the space after it.
+  uint8_t inExchangeMode();
+
+  // Is the current message a segment message (see Multidrop::SEGMENT_FLAG).
+  // The message is ready as soon as this node's data has been checked, so
+  // `read()` goes on with the rest of the message the next time it's called.
+  uint8_t inSegmentMode();
+
+  // Is the current message a segment message with error correction (see Multidrop::FEC_FLAG).
+  // When a bit of this node's data is corrected, it's counted in the CMD_GET_STATS counters.
+  uint8_t inFecMode();
+
   // Set to the function that will provide the proper
   // data for a response message. It is  best to keep
   // this function short and quick, because it will be
@@ -63,6 +108,7 @@ public:
   void setResponseHandler(multidropResponseFunction handler);
 
 private:
+  Transport *serial;
   multidropResponseFunction responseHandler;
 
   enum msg_state_t {
@@ -82,6 +128,7 @@ private:
     HEADER_CMD_POS,
     HEADER_LEN1_POS,
     HEADER_LEN2_POS,
+    HEADER_LEN3_POS, // Exchange messages: response length
     DATA_POS,
     EOM1_POS,
     EOM2_POS,
@@ -92,7 +139,8 @@ private:
     ADDR_ERROR,      // Addressing: ended in error
   };
 
-  enum msg_state_t  parseState;
+  enum msg_state_t  parseState,
+                    resumeState;  // Where to go on from MESSAGE_READY (the rest of a segment message)
   enum ms_position_t parsePos;
 
   uint8_t flags,
@@ -103,12 +151,33 @@ private:
           myAddress,
           dataIndex,
           lastAddr,
-          errCount;
+          errCount,
+          parsingSpan,    // Parsing bytes that haven't been consumed from the transport yet
+          spanIndex,      // The byte being parsed, in the span (see parsingSpan)
+          rxFilter,       // RX filter mode requested
+          rxFilterMode,   // RX filter mode the transport is using
+          batchSliced,    // The transport is only passing our batch slice
+          deltaMapLength, // Delta messages: Length of the node bitmap
+          deltaRank,      // Delta messages: Nodes with data before ours
+          deltaChanged,   // Delta messages: Nodes with data
+          deltaMine,      // Delta messages: There's data for us
+          exchangeDataLen,// Exchange messages: Length of the data for each node
+          segmentCheck,   // Segment messages: CRC-8 of the header, then of our segment
+          segmentDone,    // Segment messages: Our segment checked out, and the message was ready
+          segmentReceived;// Segment messages with error correction: The check byte received
+
+  // Counters
+  uint16_t crcErrorCount,   // Messages that failed the CRC check (or were cut short by the next message)
+           messageCount,    // Valid messages received
+           correctedCount,  // Bit errors corrected in segment messages (see Multidrop::FEC_FLAG)
+           censusErrorBase; // errorCount() at the last census
 
   // Batch mode values
   uint16_t fullDataLength,  // Length of the entire data section for all nodes
            fullDataIndex,   // The actual index of the entire data section
-           dataStartOffset; // Where this node's data starts.
+           dataStartOffset, // Where this node's data starts.
+           exchangeLength,  // Exchange messages: Length of master's data section, before the responses
+           exchangeStart;   // Exchange messages: Where this node's data from master starts
 
   uint8_t dataBuffer[MD_MAX_DATA_LEN + 1];
 
@@ -118,12 +187,38 @@ private:
   // Continue parsing the current message from the latest received byte
   uint8_t parse(uint8_t b);
 
+  // Drop the message being parsed when the line goes idle (see MultidropData::bytesBeforeIdle)
+  void idleReset();
+
+  // Drop the message being parsed, even a response message
+  void dropMessage();
+
+  // The number of bytes received after the one currently being parsed
+  uint8_t bytesWaiting();
+
+  // The total of all receive errors (transport and CRC)
+  uint16_t errorCount();
+
   // Parse the header section of the message
   void parseHeader(uint8_t);
 
   // Process the data section of the message
   void processData(uint8_t);
 
+  // Check our segment of a segment message (see Multidrop::SEGMENT_FLAG), a byte at a time.
+  // Returns 1 when it's handled the check byte.
+  uint8_t checkSegment(uint8_t b);
+
+  // Correct our data and check byte with the error correction byte of a segment message,
+  // and return the check byte.
+  uint8_t correctSegment(uint8_t b);
+
+  // Work out where our data is from a byte of the delta message bitmap
+  void parseDeltaMap(uint8_t);
+
+  // Store a nibble of data, if it's ours (nibble mode)
+  void storeNibble(uint16_t pos, uint8_t nibble);
+
   // Process the addressing response part of the addressing message
   void processAddressing(uint8_t);
 
@@ -132,6 +227,18 @@ private:
 
   // Send a response to a message
   void sendResponse();
+
+  // Write bytes to the bus (escaped, if needed)
+  void writeData(const uint8_t *buf, uint8_t len);
+
+  // Set the transport address filter for our current address
+  void applyRxFilter();
+
+  // Let the transport filter know a message it cannot measure has ended
+  void endFilteredMessage();
 };
 
+// Slave using any MultidropData transport
+typedef MultidropSlaveT<MultidropData> MultidropSlave;
+
 #endif
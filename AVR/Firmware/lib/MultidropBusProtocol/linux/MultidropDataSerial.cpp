@@ -0,0 +1,316 @@
+
+#include "MultidropDataSerial.h"
+
+// termios2 (from the kernel headers) is used instead of <termios.h>, for any baud rate
+#include <asm/termbits.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+MultidropDataSerial::MultidropDataSerial(const char *device, Direction dir) {
+  direction = dir;
+  lastError = 0;
+  rxStart = rxEnd = 0;
+  txLength = 0;
+  memset(&errorBase, 0, sizeof(errorBase));
+
+  fd = ::open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0) {
+    lastError = errno;
+  }
+}
+
+MultidropDataSerial::MultidropDataSerial(int _fd, Direction dir) {
+  direction = dir;
+  lastError = 0;
+  rxStart = rxEnd = 0;
+  txLength = 0;
+  memset(&errorBase, 0, sizeof(errorBase));
+
+  fd = _fd;
+  if (fd >= 0) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  }
+}
+
+MultidropDataSerial::~MultidropDataSerial() {
+  close();
+}
+
+uint8_t MultidropDataSerial::isOpen() {
+  return fd >= 0;
+}
+
+int MultidropDataSerial::getLastError() {
+  return lastError;
+}
+
+void MultidropDataSerial::close() {
+  if (fd < 0) return;
+
+  sendTxBuffer();
+  ::close(fd);
+  fd = -1;
+}
+
+void MultidropDataSerial::begin(uint32_t baud) {
+  if (fd < 0) return;
+
+  struct termios2 tio;
+  if (ioctl(fd, TCGETS2, &tio) < 0) {
+    lastError = errno;
+    return;
+  }
+
+  // Raw 8N1, without flow control
+  tio.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON | IXOFF | IXANY | INPCK);
+  tio.c_oflag &= ~OPOST;
+  tio.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+  tio.c_cflag &= ~(CSIZE | PARENB | CSTOPB | CRTSCTS | CBAUD | (CBAUD << IBSHIFT));
+  tio.c_cflag |= CS8 | CLOCAL | CREAD;
+
+  // Any baud rate
+  tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+  tio.c_ispeed = baud;
+  tio.c_ospeed = baud;
+
+  // Reads never block
+  tio.c_cc[VMIN] = 0;
+  tio.c_cc[VTIME] = 0;
+
+  if (ioctl(fd, TCSETS2, &tio) < 0) {
+    lastError = errno;
+    return;
+  }
+
+  setLowLatency();
+  if (direction == DIRECTION_RTS) {
+    setModemLines(TIOCM_RTS, false);
+  }
+
+  txLength = 0;
+  clear();
+
+  if (!readDriverErrors(&errorBase)) {
+    memset(&errorBase, 0, sizeof(errorBase));
+  }
+}
+
+void MultidropDataSerial::setLowLatency() {
+  struct serial_struct ss;
+  if (ioctl(fd, TIOCGSERIAL, &ss) == 0) {
+    ss.flags |= ASYNC_LOW_LATENCY;
+    ioctl(fd, TIOCSSERIAL, &ss);
+  }
+
+  // FTDI adapters hold received data for up to the latency timer (16ms by default)
+  char link[32], device[PATH_MAX], path[PATH_MAX + 64];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+  ssize_t len = readlink(link, device, sizeof(device) - 1);
+  if (len <= 0) return;
+  device[len] = '\0';
+
+  const char *name = strrchr(device, '/');
+  name = (name) ? name + 1 : device;
+  snprintf(path, sizeof(path), "/sys/bus/usb-serial/devices/%s/latency_timer", name);
+
+  int timer = ::open(path, O_WRONLY);
+  if (timer >= 0) {
+    if (::write(timer, "1", 1) < 0) {
+      // Needs root (or a udev rule), the default latency will still work
+    }
+    ::close(timer);
+  }
+}
+
+void MultidropDataSerial::fillRxBuffer() {
+  if (fd < 0) return;
+
+  if (rxStart == rxEnd) {
+    rxStart = rxEnd = 0;
+  }
+  else if (rxEnd == sizeof(rxBuffer) && rxStart > 0) {
+    memmove(rxBuffer, &rxBuffer[rxStart], rxEnd - rxStart);
+    rxEnd -= rxStart;
+    rxStart = 0;
+  }
+  if (rxEnd == sizeof(rxBuffer)) return;
+
+  ssize_t len = ::read(fd, &rxBuffer[rxEnd], sizeof(rxBuffer) - rxEnd);
+  if (len > 0) {
+    rxEnd += len;
+  }
+  else if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+    lastError = errno;
+  }
+}
+
+uint8_t MultidropDataSerial::available() {
+  if (rxEnd - rxStart < 0xFF) {
+    fillRxBuffer();
+  }
+
+  uint16_t len = rxEnd - rxStart;
+  return (len > 0xFF) ? 0xFF : len;
+}
+
+uint8_t MultidropDataSerial::read() {
+  if (rxStart == rxEnd && !available()) return 0;
+  return rxBuffer[rxStart++];
+}
+
+uint8_t MultidropDataSerial::peek() {
+  if (rxStart == rxEnd && !available()) return 0;
+  return rxBuffer[rxStart];
+}
+
+uint8_t MultidropDataSerial::readBytes(uint8_t *buf, uint8_t max) {
+  uint8_t len = available();
+  if (len > max) {
+    len = max;
+  }
+  memcpy(buf, &rxBuffer[rxStart], len);
+  rxStart += len;
+  return len;
+}
+
+uint8_t MultidropDataSerial::peekSpan(const uint8_t **span) {
+  uint8_t len = available();
+  *span = &rxBuffer[rxStart];
+  return len;
+}
+
+void MultidropDataSerial::consume(uint8_t len) {
+  if (len > rxEnd - rxStart) {
+    len = rxEnd - rxStart;
+  }
+  rxStart += len;
+}
+
+void MultidropDataSerial::clear() {
+  rxStart = rxEnd = 0;
+  if (fd >= 0) {
+    ioctl(fd, TCFLSH, TCIFLUSH);
+  }
+}
+
+void MultidropDataSerial::write(uint8_t byte) {
+  if (txLength == sizeof(txBuffer)) {
+    sendTxBuffer();
+  }
+  txBuffer[txLength++] = byte;
+}
+
+void MultidropDataSerial::write(const uint8_t *buf, uint16_t len) {
+  while (len) {
+    if (txLength == sizeof(txBuffer)) {
+      sendTxBuffer();
+    }
+
+    uint16_t chunk = sizeof(txBuffer) - txLength;
+    if (chunk > len) {
+      chunk = len;
+    }
+    memcpy(&txBuffer[txLength], buf, chunk);
+    txLength += chunk;
+    buf += chunk;
+    len -= chunk;
+  }
+}
+
+void MultidropDataSerial::sendTxBuffer() {
+  uint16_t sent = 0;
+
+  while (fd >= 0 && sent < txLength) {
+    ssize_t len = ::write(fd, &txBuffer[sent], txLength - sent);
+    if (len > 0) {
+      sent += len;
+    }
+    else if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      struct pollfd pfd = { fd, POLLOUT, 0 };
+      poll(&pfd, 1, 100);
+    }
+    else if (len < 0 && errno != EINTR) {
+      lastError = errno;
+      break;
+    }
+  }
+  txLength = 0;
+}
+
+void MultidropDataSerial::flush() {
+  sendTxBuffer();
+  if (fd >= 0) {
+    ioctl(fd, TCSBRK, 1); // tcdrain
+  }
+}
+
+void MultidropDataSerial::enable_write() {
+  if (direction == DIRECTION_RTS) {
+    setModemLines(TIOCM_RTS, true);
+  }
+}
+
+void MultidropDataSerial::enable_read() {
+  if (direction == DIRECTION_RTS) {
+    flush();
+    setModemLines(TIOCM_RTS, false);
+  } else {
+    sendTxBuffer();
+  }
+}
+
+void MultidropDataSerial::setDaisy(uint8_t enabled) {
+  int bits = TIOCM_DTR;
+  if (direction != DIRECTION_RTS) {
+    bits |= TIOCM_RTS;
+  }
+  setModemLines(bits, enabled);
+}
+
+void MultidropDataSerial::setModemLines(int bits, uint8_t enabled) {
+  if (fd < 0) return;
+
+  // Not every device has modem lines (i.e. ptys), which is fine
+  ioctl(fd, (enabled) ? TIOCMBIS : TIOCMBIC, &bits);
+}
+
+uint8_t MultidropDataSerial::waitForData(uint16_t timeout) {
+  if (available()) return true;
+  if (fd < 0) return false;
+
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  if (poll(&pfd, 1, timeout) > 0) {
+    return available() > 0;
+  }
+  return false;
+}
+
+uint8_t MultidropDataSerial::readDriverErrors(MultidropDataErrors *errors) {
+  struct serial_icounter_struct count;
+  if (fd < 0 || ioctl(fd, TIOCGICOUNT, &count) < 0) {
+    return false;
+  }
+
+  errors->framing = count.frame;
+  errors->overrun = count.overrun;
+  errors->dropped = count.buf_overrun;
+  return true;
+}
+
+void MultidropDataSerial::getErrors(MultidropDataErrors *errors) {
+  if (!readDriverErrors(errors)) {
+    memset(errors, 0, sizeof(*errors));
+    return;
+  }
+
+  errors->framing -= errorBase.framing;
+  errors->overrun -= errorBase.overrun;
+  errors->dropped -= errorBase.dropped;
+}
@@ -0,0 +1,125 @@
+#ifndef MultidropDataSerial_H
+#define MultidropDataSerial_H
+
+#include "../MultidropData.h"
+
+#ifndef MD_SERIAL_RX_BUFFER_SIZE
+#define MD_SERIAL_RX_BUFFER_SIZE 512
+#endif
+
+#ifndef MD_SERIAL_TX_BUFFER_SIZE
+#define MD_SERIAL_TX_BUFFER_SIZE 512
+#endif
+
+/************************************************************************************
+ *  Connects a Linux host to the bus through a serial port (i.e. a USB RS485 adapter),
+ *  so MultidropMaster can run natively:
+ *  ```
+ *    MultidropDataSerial serial("/dev/ttyUSB0");
+ *    MultidropMasterT<MultidropDataSerial> master(&serial);
+ *    serial.begin(250000);
+ *  ```
+ *
+ *  The port is put into raw mode with any baud rate (termios2/BOTHER), so it does
+ *  not have to be one of the standard Bxxxx rates. The kernel's low latency flag is
+ *  set and, for FTDI adapters, the USB latency timer is lowered to 1ms. Otherwise,
+ *  responses can sit in the adapter for up to 16ms before reaching the host.
+ *
+ *  Direction:
+ *    DIRECTION_AUTO  The adapter switches the driver itself (i.e. FT232 TXDEN).
+ *                    This is the best option for USB adapters.
+ *    DIRECTION_RTS   RTS is raised while sending and dropped once the kernel has
+ *                    sent everything (tcdrain).
+ *
+ *  The daisy chain line is driven from DTR (and RTS, when it's not used for direction),
+ *  which can be passed to the master through `addNextDaisyChain(handler)`.
+ *
+ *  Writes are buffered until `enable_read()` or `flush()`, so each message is handed
+ *  to the kernel in one call. Modem lines and serial settings that a device doesn't
+ *  support are skipped, so this also works on one side of a pty pair (see `openpty`).
+ ************************************************************************************/
+class MultidropDataSerial : public MultidropData {
+public:
+  enum Direction {
+    DIRECTION_AUTO,
+    DIRECTION_RTS
+  };
+
+  // Open a serial device (i.e. "/dev/ttyUSB0"). Check `isOpen()` afterwards.
+  MultidropDataSerial(const char *device, Direction direction=DIRECTION_AUTO);
+
+  // Use a file descriptor that's already open (i.e. a pty).
+  // It will be closed with this object.
+  MultidropDataSerial(int fd, Direction direction=DIRECTION_AUTO);
+
+  ~MultidropDataSerial();
+
+  uint8_t isOpen();
+
+  // The errno value of the last failed call to the device (0 when there hasn't been one)
+  int getLastError();
+
+  // Setup the port for `baud` (8N1, raw) and clear all buffers
+  void begin(uint32_t baud);
+
+  uint8_t available();
+  uint8_t read();
+  uint8_t peek();
+  uint8_t readBytes(uint8_t *buf, uint8_t max);
+  uint8_t peekSpan(const uint8_t **span);
+  void consume(uint8_t len);
+
+  void write(uint8_t byte);
+  void write(const uint8_t *buf, uint16_t len);
+
+  // Send everything buffered and wait for the kernel to finish sending it
+  void flush();
+
+  void clear();
+  void enable_write();
+  void enable_read();
+
+  // Errors counted by the serial driver since `begin()`, when it supports it
+  void getErrors(MultidropDataErrors *errors);
+
+  // Set the outgoing daisy chain line
+  void setDaisy(uint8_t enabled);
+
+  // Block for up to `timeout` milliseconds, until there's data to read.
+  // Returns true if there is.
+  uint8_t waitForData(uint16_t timeout);
+
+  // Close the port
+  void close();
+
+private:
+  int fd;
+  int lastError;
+  Direction direction;
+
+  uint8_t rxBuffer[MD_SERIAL_RX_BUFFER_SIZE];
+  uint16_t rxStart,
+           rxEnd;
+
+  uint8_t txBuffer[MD_SERIAL_TX_BUFFER_SIZE];
+  uint16_t txLength;
+
+  // Driver error counters at `begin()`
+  MultidropDataErrors errorBase;
+
+  // Read whatever the kernel has into the RX buffer
+  void fillRxBuffer();
+
+  // Hand the TX buffer to the kernel
+  void sendTxBuffer();
+
+  // Set or clear modem control lines (TIOCM_* bits)
+  void setModemLines(int bits, uint8_t enabled);
+
+  // Get the driver's error counters
+  uint8_t readDriverErrors(MultidropDataErrors *errors);
+
+  void setLowLatency();
+};
+
+#endif
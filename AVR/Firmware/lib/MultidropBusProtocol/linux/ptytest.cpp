@@ -0,0 +1,114 @@
+/************************************************************************************
+ *  A smoke test for MultidropDataSerial, without hardware: a master and one slave
+ *  talk through the two ends of a pty pair (see openpty).
+ *
+ *    1. Master sends a message to the node, and checks that the node got the data.
+ *    2. Master sends a batch response message, and checks the node's response.
+ *
+ *  Run it with `make test`. Exits with 1 when a check fails.
+ ************************************************************************************/
+
+#include "MultidropDataSerial.h"
+#include "../MultidropMaster.h"
+#include "../MultidropSlave.h"
+
+#include <pty.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define CMD_SET_COLOR         0xA1
+#define CMD_SEND_SENSOR_VALUE 0xA3
+
+#define TEST_BAUD 250000
+
+// How long to wait for each exchange (ms)
+#define TEST_TIMEOUT 1000
+
+#define TEST_SENSOR_VALUE 0x5A
+
+// The time, in milliseconds (for the master's `time` arguments)
+static uint32_t millis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void handleResponse(uint8_t command, uint8_t *buff, uint8_t len) {
+  if (command == CMD_SEND_SENSOR_VALUE && len >= 1) {
+    buff[0] = TEST_SENSOR_VALUE;
+  }
+}
+
+int main() {
+  int ptm, pts;
+  uint8_t failed = false;
+
+  if (openpty(&ptm, &pts, 0, 0, 0) < 0) {
+    perror("openpty");
+    return 1;
+  }
+
+  // The pty's tty end is the master's serial port, the other end is the node's
+  MultidropDataSerial masterSerial(pts),
+                      nodeSerial(ptm);
+  masterSerial.begin(TEST_BAUD);
+  nodeSerial.begin(TEST_BAUD);
+  if (masterSerial.getLastError() || nodeSerial.getLastError()) {
+    fprintf(stderr, "Could not set up the pty: %s\n",
+            strerror(masterSerial.getLastError() ? masterSerial.getLastError() : nodeSerial.getLastError()));
+    return 1;
+  }
+
+  MultidropMasterT<MultidropDataSerial> master(&masterSerial);
+  master.setNodeLength(1);
+
+  // There's no daisy chain, but the slave needs registers for it
+  volatile uint8_t ddr = 0, port = 0, pin = 0xFF;
+
+  MultidropSlave slave(&nodeSerial);
+  slave.addDaisyChain(0, &ddr, &port, &pin, 1, &ddr, &port, &pin);
+  slave.setAddress(1);
+  slave.setResponseHandler(&handleResponse);
+
+  // A message in
+  uint8_t color[3] = { 0x12, 0x34, 0x56 };
+  uint32_t timeout = millis() + TEST_TIMEOUT;
+
+  master.startMessage(CMD_SET_COLOR, 1, 3);
+  master.sendData(color, 3);
+  master.finishMessage();
+  masterSerial.flush();
+
+  while (!slave.read() && (int32_t)(millis() - timeout) < 0) {
+    nodeSerial.waitForData(10);
+  }
+  if (!slave.hasNewMessage() || slave.getCommand() != CMD_SET_COLOR ||
+      slave.getDataLen() != 3 || memcmp(slave.getData(), color, 3) != 0) {
+    printf("message: FAILED\n");
+    failed = true;
+  } else {
+    printf("message: ok\n");
+  }
+
+  // A response back
+  uint8_t sensor = 0,
+          defaultSensor = 0xFF;
+  timeout = millis() + TEST_TIMEOUT;
+
+  master.startMessage(CMD_SEND_SENSOR_VALUE, MultidropMaster::BROADCAST_ADDRESS, 1, true, true);
+  master.setResponseSettings(&sensor, millis(), TEST_TIMEOUT, &defaultSensor);
+  while (!master.checkForResponses(millis()) && (int32_t)(millis() - timeout) < 0) {
+    nodeSerial.waitForData(1);
+    slave.read();
+    masterSerial.waitForData(1);
+  }
+  if (sensor != TEST_SENSOR_VALUE) {
+    printf("response: FAILED (got 0x%02X)\n", sensor);
+    failed = true;
+  } else {
+    printf("response: ok\n");
+  }
+
+  return (failed) ? 1 : 0;
+}
@@ -0,0 +1,366 @@
+
+#include "MultidropSimBus.h"
+#include <string.h>
+
+/************************************************************************************
+ *  MultidropDataSim
+ ************************************************************************************/
+
+MultidropDataSim::MultidropDataSim(MultidropSimBus *_bus, uint32_t _turnaround) {
+  bus = _bus;
+  turnaround = _turnaround;
+  baud = bus->defaultBaud;
+
+  ddr = 0;
+  port = 0;
+  pin = 0xFF;
+
+  writing = 0;
+  driving = 0;
+  driverOn = 0;
+  driverOff = 0;
+
+  txActive = 0;
+  txByte = 0;
+  txStart = 0;
+  txEnd = 0;
+  txBaud = 0;
+
+  rxStart = rxEnd = 0;
+  memset(&errors, 0, sizeof(errors));
+
+  idleBytes = 0;
+  idleMarked = 0;
+  idleMark = 0;
+  lastRx = 0;
+
+  errorMarked = 0;
+  errorMark = 0;
+}
+
+void MultidropDataSim::begin(uint32_t _baud) {
+  baud = _baud;
+  clear();
+}
+
+uint8_t MultidropDataSim::available() {
+  return rxEnd - rxStart;
+}
+
+uint8_t MultidropDataSim::read() {
+  if (rxStart == rxEnd) {
+    return -1;
+  }
+  return rxBuffer[rxStart++];
+}
+
+uint8_t MultidropDataSim::peek() {
+  if (rxStart == rxEnd) {
+    return -1;
+  }
+  return rxBuffer[rxStart];
+}
+
+uint8_t MultidropDataSim::readBytes(uint8_t *buf, uint8_t max) {
+  uint8_t len = available();
+  if (len > max) {
+    len = max;
+  }
+  memcpy(buf, &rxBuffer[rxStart], len);
+  rxStart += len;
+  return len;
+}
+
+uint8_t MultidropDataSim::peekSpan(const uint8_t **span) {
+  *span = &rxBuffer[rxStart];
+  return available();
+}
+
+void MultidropDataSim::consume(uint8_t len) {
+  if (len > available()) {
+    len = available();
+  }
+  rxStart += len;
+}
+
+void MultidropDataSim::clear() {
+  rxStart = rxEnd = 0;
+}
+
+void MultidropDataSim::receive(uint8_t b, uint8_t framingError) {
+  uint8_t idle = idleBytes && bus->time - lastRx > idleBytes * MultidropSimBus::byteTime(baud);
+  lastRx = bus->time;
+
+  if (rxStart == rxEnd) {
+    rxStart = rxEnd = 0;
+    idleMarked = 0;
+    errorMarked = 0;
+  }
+  else if (rxEnd == sizeof(rxBuffer) && rxStart > 0) {
+    memmove(rxBuffer, &rxBuffer[rxStart], rxEnd - rxStart);
+    rxEnd -= rxStart;
+    if (idleMarked && idleMark >= rxStart) {
+      idleMark -= rxStart;
+    } else {
+      idleMarked = 0;
+    }
+    if (errorMarked && errorMark >= rxStart) {
+      errorMark -= rxStart;
+    } else {
+      errorMarked = 0;
+    }
+    rxStart = 0;
+  }
+
+  if (rxEnd == sizeof(rxBuffer)) {
+    errors.dropped++;
+    return;
+  }
+  if (idle) {
+    idleMark = rxEnd;
+    idleMarked = 1;
+  }
+  if (framingError) {
+    errorMark = rxEnd;
+    errorMarked = 1;
+  }
+  rxBuffer[rxEnd++] = b;
+}
+
+void MultidropDataSim::setIdleGap(uint8_t byteTimes) {
+  idleBytes = byteTimes;
+  idleMarked = 0;
+}
+
+uint8_t MultidropDataSim::bytesBeforeIdle() {
+  if (idleMarked && idleMark >= rxStart && idleMark < rxEnd) {
+    return idleMark - rxStart;
+  }
+  return MD_NO_IDLE_GAP;
+}
+
+uint8_t MultidropDataSim::bytesBeforeError() {
+  if (errorMarked && errorMark >= rxStart && errorMark < rxEnd) {
+    return errorMark - rxStart;
+  }
+  return MD_NO_ERROR_BYTE;
+}
+
+void MultidropDataSim::write(uint8_t b) {
+  if (!writing) {
+    bus->bytesUndriven++;
+    return;
+  }
+  txQueue.push_back(b);
+  startNextByte(bus->time);
+}
+
+void MultidropDataSim::startNextByte(uint64_t time) {
+  if (txActive || txQueue.empty()) return;
+
+  txByte = txQueue.front();
+  txQueue.erase(txQueue.begin());
+
+  txActive = 1;
+  txStart = (time > driverOn) ? time : driverOn;
+  txEnd = txStart + MultidropSimBus::byteTime(baud);
+  txBaud = baud;
+  bus->bytesSent++;
+}
+
+void MultidropDataSim::flush() {
+  bus->runUntilSent(this);
+}
+
+void MultidropDataSim::enable_write() {
+  writing = 1;
+  if (!driving) {
+    driving = 1;
+    driverOn = bus->time + turnaround;
+  }
+}
+
+void MultidropDataSim::enable_read() {
+  writing = 0;
+
+  // The driver is released after the last byte is sent (see MultidropSimBus::finishByte)
+  if (driving && !txActive) {
+    driving = 0;
+    driverOff = bus->time;
+
+    // Never actually turned on
+    if (driverOn > driverOff) {
+      driverOn = driverOff;
+    }
+  }
+}
+
+void MultidropDataSim::getErrors(MultidropDataErrors *_errors) {
+  *_errors = errors;
+}
+
+uint8_t MultidropDataSim::isSending() {
+  return txActive;
+}
+
+uint8_t MultidropDataSim::drivingBetween(uint64_t start, uint64_t end) {
+  if (driving) {
+    return driverOn < end;
+  }
+  return driverOff > start && driverOn < end;
+}
+
+/************************************************************************************
+ *  MultidropSimBus
+ ************************************************************************************/
+
+MultidropSimBus::MultidropSimBus(uint32_t baud) {
+  time = 0;
+  defaultBaud = baud;
+  bytesSent = 0;
+  bytesCorrupted = 0;
+  bytesUndriven = 0;
+  bitsFlipped = 0;
+  bitErrors = 0;
+  randomState = 0x2545F491;
+}
+
+MultidropSimBus::~MultidropSimBus() {
+  for (size_t i = 0; i < transports.size(); i++) {
+    delete transports[i];
+  }
+}
+
+MultidropDataSim* MultidropSimBus::addTransport(uint32_t turnaround) {
+  MultidropDataSim *transport = new MultidropDataSim(this, turnaround);
+  transports.push_back(transport);
+  return transport;
+}
+
+void MultidropSimBus::setBitErrors(uint32_t perMillion) {
+  bitErrors = perMillion;
+}
+
+uint32_t MultidropSimBus::random() {
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 17;
+  randomState ^= randomState << 5;
+  return randomState;
+}
+
+uint64_t MultidropSimBus::byteTime(uint32_t baud) {
+  return 10000000000ULL / baud; // 8N1 = 10 bits
+}
+
+uint64_t MultidropSimBus::now() {
+  return time;
+}
+
+uint32_t MultidropSimBus::micros() {
+  return time / 1000;
+}
+
+uint64_t MultidropSimBus::nextByteEnd() {
+  uint64_t end = ~0ULL;
+  for (size_t i = 0; i < transports.size(); i++) {
+    if (transports[i]->txActive && transports[i]->txEnd < end) {
+      end = transports[i]->txEnd;
+    }
+  }
+  return end;
+}
+
+void MultidropSimBus::finishByte(MultidropDataSim *sender) {
+  size_t i;
+  uint8_t collided = 0;
+
+  // Another driver was on while this byte was being sent
+  for (i = 0; i < transports.size(); i++) {
+    if (transports[i] != sender && transports[i]->drivingBetween(sender->txStart, sender->txEnd)) {
+      collided = 1;
+      bytesCorrupted++;
+      break;
+    }
+  }
+
+  // Deliver to everyone listening
+  for (i = 0; i < transports.size(); i++) {
+    MultidropDataSim *receiver = transports[i];
+    if (receiver == sender || receiver->drivingBetween(sender->txStart, sender->txEnd)) {
+      continue;
+    }
+
+    if (collided || receiver->baud != sender->txBaud) {
+      receiver->errors.framing++;
+      receiver->receive(~sender->txByte, true);
+      continue;
+    }
+
+    uint8_t b = sender->txByte;
+    if (bitErrors) {
+      for (uint8_t bit = 0; bit < 8; bit++) {
+        if (random() % 1000000 < bitErrors) {
+          b ^= (1 << bit);
+          bitsFlipped++;
+        }
+      }
+    }
+    receiver->receive(b);
+  }
+
+  // Next byte, or release the driver
+  sender->txActive = 0;
+  sender->startNextByte(sender->txEnd);
+  if (!sender->txActive && !sender->writing && sender->driving) {
+    sender->driving = 0;
+    sender->driverOff = sender->txEnd;
+  }
+}
+
+void MultidropSimBus::runUntil(uint64_t until) {
+  uint64_t end;
+
+  while ((end = nextByteEnd()) <= until) {
+    time = end;
+    for (size_t i = 0; i < transports.size(); i++) {
+      if (transports[i]->txActive && transports[i]->txEnd == end) {
+        finishByte(transports[i]);
+      }
+    }
+  }
+
+  if (until > time) {
+    time = until;
+  }
+  updateDaisyChain();
+}
+
+void MultidropSimBus::step(uint64_t maxStep) {
+  uint64_t end = nextByteEnd();
+  runUntil((end < time + maxStep) ? end : time + maxStep);
+}
+
+void MultidropSimBus::runUntilSent(MultidropDataSim *transport) {
+  while (transport->txActive) {
+    runUntil(transport->txEnd);
+  }
+}
+
+void MultidropSimBus::updateDaisyChain() {
+  size_t i;
+
+  for (i = 0; i < transports.size(); i++) {
+    transports[i]->pin = 0xFF; // Pull-ups
+  }
+
+  // Bit 1 of each node is wired to bit 0 of the next, and the lines are active low
+  for (i = 0; i + 1 < transports.size(); i++) {
+    MultidropDataSim *a = transports[i],
+                     *b = transports[i + 1];
+
+    if (((a->ddr & 0x02) && !(a->port & 0x02)) || ((b->ddr & 0x01) && !(b->port & 0x01))) {
+      a->pin &= ~0x02;
+      b->pin &= ~0x01;
+    }
+  }
+}
@@ -0,0 +1,198 @@
+#ifndef MultidropSimBus_H
+#define MultidropSimBus_H
+
+#include "../MultidropData.h"
+#include <vector>
+
+// The size of each simulated node's RX buffer (the same as the AVR UART's)
+#ifndef MD_SIM_RX_BUFFER_SIZE
+#define MD_SIM_RX_BUFFER_SIZE 128
+#endif
+
+class MultidropSimBus;
+
+/************************************************************************************
+ *  One node's connection to a MultidropSimBus. This behaves like an RS485 transceiver
+ *  (with RE tied to DE) on a UART:
+ *
+ *    - `enable_write()` turns the driver on after the transport's turnaround delay.
+ *    - `enable_read()` turns it off once everything written has been sent, like
+ *       MultidropData485 with async release. Nothing is received while it's on.
+ *    - Bytes written while the driver is off never reach the bus.
+ *    - `flush()` runs the bus (but not any node) until everything has been sent,
+ *       the way a blocking flush stalls a node's CPU.
+ *
+ *  It also holds a set of simulated port registers for the daisy chain lines
+ *  (bit 0 is the line to the previous node, bit 1 the line to the next), which are
+ *  connected to the neighboring nodes by the bus:
+ *  ```
+ *    slave.addDaisyChain(0, &t->ddr, &t->port, &t->pin,
+ *                        1, &t->ddr, &t->port, &t->pin, true);
+ *  ```
+ ************************************************************************************/
+class MultidropDataSim final : public MultidropData {
+public:
+  MultidropDataSim(MultidropSimBus *bus, uint32_t turnaround);
+
+  void begin(uint32_t baud);
+  uint8_t available();
+  uint8_t read();
+  uint8_t peek();
+  uint8_t readBytes(uint8_t *buf, uint8_t max);
+  uint8_t peekSpan(const uint8_t **span);
+  void consume(uint8_t len);
+  void write(uint8_t byte);
+  void flush();
+  void clear();
+  void enable_write();
+  void enable_read();
+  void getErrors(MultidropDataErrors *errors);
+  uint8_t bytesBeforeIdle();
+  uint8_t bytesBeforeError();
+
+  // Watch for the line going silent for `byteTimes` between received bytes, like
+  // MultidropDataUart::setIdleGap (0 turns it off).
+  void setIdleGap(uint8_t byteTimes);
+
+  // Returns true while there is still data waiting to be, or being, sent
+  uint8_t isSending();
+
+  // Simulated daisy chain registers
+  volatile uint8_t ddr,
+                   port,
+                   pin;
+
+private:
+  friend class MultidropSimBus;
+
+  MultidropSimBus *bus;
+  uint32_t baud,
+           turnaround;  // Nanoseconds from enable_write() until the driver is on
+
+  // Driver
+  uint8_t  writing,     // enable_write() has been called, without enable_read()
+           driving;     // The driver is on (or turning on)
+  uint64_t driverOn,    // When the driver turns on
+           driverOff;   // When the driver was turned off (last time)
+
+  // Transmitter
+  std::vector<uint8_t> txQueue;
+  uint8_t  txActive,    // There's a byte on the wire
+           txByte;
+  uint64_t txStart,
+           txEnd;
+  uint32_t txBaud;
+
+  // Receiver
+  uint8_t rxBuffer[MD_SIM_RX_BUFFER_SIZE];
+  uint16_t rxStart,
+           rxEnd;
+  MultidropDataErrors errors;
+
+  // Idle line detection
+  uint8_t  idleBytes,
+           idleMarked;  // `idleMark` is the first byte after a gap
+  uint16_t idleMark;    // Index in rxBuffer
+  uint64_t lastRx;      // When the last byte was received
+
+  // The last byte received with a framing error
+  uint8_t  errorMarked;
+  uint16_t errorMark;   // Index in rxBuffer
+
+  // Start sending the next byte in the queue, if the wire is free
+  void startNextByte(uint64_t time);
+
+  // Add a received byte to the RX buffer
+  void receive(uint8_t b, uint8_t framingError=false);
+
+  // Is the driver on at any point between `start` and `end`
+  uint8_t drivingBetween(uint64_t start, uint64_t end);
+};
+
+/************************************************************************************
+ *  A simulated RS485 bus, in virtual time, for running MultidropMaster and any number
+ *  of MultidropSlave instances in one process without hardware.
+ *
+ *  Bytes take 10 bit times (8N1) at the sender's baud rate. A byte is corrupted
+ *  (received with a framing error) when another node's driver is on while it's being
+ *  sent, or when the receiver is set to a different baud rate.
+ *
+ *  Line noise can be added with `setBitErrors()`. Each receiver then gets random data
+ *  bits flipped, independently of the others (like on a long, noisy run). These aren't
+ *  seen by the UART, so they're not counted as framing errors.
+ *
+ *  Nothing runs on its own. The program polls each node (i.e. calls `master.check*()`
+ *  and `slave.read()`) and then moves time forward with `step()`:
+ *  ```
+ *    MultidropSimBus bus(250000);
+ *    MultidropDataSim *m = bus.addTransport(0);
+ *    ...
+ *    while (...) {
+ *      master.checkForResponses(bus.micros());
+ *      for (...) slaves[i].read();
+ *      bus.step(10000);
+ *    }
+ *  ```
+ *  Everything is deterministic, so runs can be compared between builds.
+ ************************************************************************************/
+class MultidropSimBus {
+public:
+  MultidropSimBus(uint32_t baud);
+  ~MultidropSimBus();
+
+  // Add a node's transport. Nodes are connected by daisy chain in the order they're added.
+  //   * turnaround: Nanoseconds between `enable_write()` and the driver turning on
+  MultidropDataSim* addTransport(uint32_t turnaround);
+
+  // Current virtual time, in nanoseconds
+  uint64_t now();
+
+  // Current virtual time, in microseconds (for the master's `time` arguments)
+  uint32_t micros();
+
+  // Run the bus to the next byte event, or up to `maxStep` nanoseconds
+  void step(uint64_t maxStep);
+
+  // Run the bus until `time`
+  void runUntil(uint64_t time);
+
+  // Run the bus until this transport has sent everything
+  void runUntilSent(MultidropDataSim *transport);
+
+  // Flip random data bits at this rate, per million bits received (0 turns it off)
+  void setBitErrors(uint32_t perMillion);
+
+  // Bus totals
+  uint32_t bytesSent,        // Bytes put on the wire
+           bytesCorrupted,   // Bytes corrupted by another driver
+           bytesUndriven,    // Bytes written while the driver was off
+           bitsFlipped;      // Data bits flipped by line noise (see setBitErrors)
+
+  // The nanoseconds it takes to send one byte at `baud`
+  static uint64_t byteTime(uint32_t baud);
+
+private:
+  friend class MultidropDataSim;
+
+  uint64_t time;
+  uint32_t defaultBaud;
+  std::vector<MultidropDataSim*> transports;
+
+  // Line noise
+  uint32_t bitErrors,
+           randomState;
+
+  // The next number from a fixed sequence (xorshift), so runs can be repeated
+  uint32_t random();
+
+  // When the next byte finishes sending (or ~0 if none)
+  uint64_t nextByteEnd();
+
+  // Finish the byte being sent by a transport
+  void finishByte(MultidropDataSim *sender);
+
+  // Connect the daisy chain lines between neighboring nodes
+  void updateDaisyChain();
+};
+
+#endif
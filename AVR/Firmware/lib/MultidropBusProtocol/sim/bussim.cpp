@@ -0,0 +1,1066 @@
+/************************************************************************************
+ *  Runs a master and a floor of slaves on a simulated bus (see MultidropSimBus.h)
+ *  and reports how fast frames can be sent.
+ *
+ *  For each node count and baud rate, it:
+ *    1. Resets and addresses all nodes.
+ *    2. Sends batch CMD_SET_COLOR frames back-to-back and checks every node got its color.
+ *       Then again as delta frames, where only some nodes change color each frame, and as
+ *       4-bit palette index frames (alternating full and delta frames), RGB565 frames
+ *       and 12-bit RGB frames.
+ *    3. Sends CMD_SEND_SENSOR_VALUE response frames and checks every node's response.
+ *       Then sends colors and gets sensor values back in one exchange message per frame.
+ *       Then sends color frames in latch mode, and checks nodes only change on CMD_LATCH.
+ *       Then sends one batch CMD_FADE_TO frame, and checks every node's fade target and duration,
+ *       and starts an effect on every node with one CMD_SET_EFFECT broadcast.
+ *       Then syncs every node's clock with CMD_SYNC_TIME, and checks that a color frame sent
+ *       after CMD_SCHEDULE is only shown at its scheduled time.
+ *    4. Collects every node's error counters with CMD_GET_STATS.
+ *    5. Disconnects the middle node and sends sensor response frames again, to check
+ *       that master skips it (response timeouts adapt to each node the whole time).
+ *    6. Puts a burst of noise on the bus in the middle of a frame of full brightness
+ *       colors, and counts the frames that are lost until every node has the right color
+ *       (SIM_NOISE_FRAMES when they never do). With byte stuffed framing, only the frame
+ *       with the noise can be lost. With idle gap detection, the next frame can be lost
+ *       too, but only when a node answers a response message header found in the noise
+ *       (nodes respond before the CRC), and talks over the start of it.
+ *    7. Sends color frames over a noisy line (random bit errors at each node, see
+ *       MultidropSimBus::setBitErrors), first as plain batch frames, then as segment
+ *       frames, where each node's color has its own check byte (see Multidrop::SEGMENT_FLAG),
+ *       and then as segment frames with an error correction byte (see Multidrop::FEC_FLAG).
+ *       Reports the percent of node colors that got through each way, the bit errors the
+ *       nodes corrected, and how many times a node showed a color it wasn't sent (a check
+ *       byte only catches 255 out of 256 segments that are scrambled, i.e. when a bit error
+ *       turns into a lost byte).
+ *    8. Negotiates a faster baud rate (4x, 3x, 2.5x, then 2x the starting rate), with the middle
+ *       node only able to do the slowest one. Checks that every node ends up at 2x once the
+ *       confirm timeout has passed, and still gets color frames there. The middle node misses
+ *       more census responses than it takes to be a dead node, which shouldn't count.
+ *
+ *  The bytes column is the average size of the color frames on the wire, to compare
+ *  the framing overhead. Run with -s for byte stuffed framing (MD_FRAMING_STUFFED).
+ *
+ *  Run with -g to have the nodes drop a message when the line is silent for that many
+ *  byte times in the middle of it (see MultidropDataUart::setIdleGap). Master then waits
+ *  that long between the noise test frames, like the DiscoController does between messages.
+ *
+ *  Set the line noise for step 7 with -e, in bit errors per million bits.
+ *
+ *  Usage: bussim [-n nodes[,nodes...]] [-b baud[,baud...]] [-f frames]
+ *                [-t turnaround_us] [-p poll_us] [-c changed_percent] [-s] [-g idle_bytes]
+ *                [-e bit_errors_ppm]
+ *
+ *  Exits with 1 when any check fails, so it can be used to catch protocol regressions.
+ ************************************************************************************/
+
+#include "MultidropSimBus.h"
+#include "../MultidropMaster.h"
+#include "../MultidropSlave.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#define CMD_SET_COLOR         0xA1
+#define CMD_SEND_SENSOR_VALUE 0xA3
+#define CMD_SET_PALETTE       0xA4
+#define CMD_SET_PALETTE_COLOR 0xA5
+#define CMD_SET_COLOR_565     0xA6
+#define CMD_SET_COLOR_444     0xA7
+#define CMD_SET_COLOR_GET_SENSOR 0xA8
+#define CMD_LATCH             0xA9
+#define CMD_FADE_TO           0xAA
+#define CMD_SET_EFFECT        0xAB
+#define CMD_SYNC_TIME         0xAC
+#define CMD_SCHEDULE          0xAD
+
+#define EFFECT_DATA_LEN 11
+
+#define PALETTE_SIZE 16
+
+// CMD_SCHEDULE states
+#define SCHEDULE_NONE    0
+#define SCHEDULE_WAITING 1
+#define SCHEDULE_HOLDING 2
+
+// Stop waiting for something after this much virtual time
+#define SIM_TIMEOUT_NS 10000000000ULL
+
+// Give up on recovering from the noise after this many frames
+#define SIM_NOISE_FRAMES 100
+
+// Bytes of noise put on the bus. Colliding with master turns them
+// into 0xFF bytes (see MultidropSimBus::finishByte).
+#define SIM_NOISE_LEN 3
+
+// Baud negotiation: rates tried (see simulate), and the timing passed to master (ms)
+#define SIM_BAUD_RATES 4
+#define SIM_BAUD_SWITCH_DELAY 5
+#define SIM_CENSUS_TIMEOUT 2
+
+struct SimNode {
+  MultidropDataSim *serial;
+  MultidropSlave *comm;
+  uint8_t rgb[3];     // Color being shown
+  uint8_t pending[3]; // Color waiting for CMD_LATCH (latch mode)
+  uint8_t latchMode;
+  uint16_t fadeMs;    // Duration of the fade to `pending` (the fade itself isn't simulated)
+  uint8_t effect;     // Effect type that's running (effects aren't simulated either)
+  int64_t clockOffset; // The node's clock is the bus time plus this (ns), set by CMD_SYNC_TIME
+  uint8_t scheduleState;
+  uint32_t scheduleTime;
+  uint8_t scheduled[3]; // Color held for CMD_SCHEDULE (only colors are scheduled here)
+  uint8_t palette[PALETTE_SIZE][3];
+  uint8_t sensorValue;
+  uint32_t colorFrames;
+  uint8_t dead;
+  uint32_t baud,           // Bus baud rate (see CMD_SET_BAUD)
+           maxBaud,        // The fastest rate the node can do
+           pendingBaud,    // Rate to switch to at baudSwitchTime
+           baudSwitchTime,
+           revertBaud,     // Rate to go back to at baudRevertTime, unless master confirms
+           baudRevertTime;
+  uint16_t pendingConfirm;
+};
+
+struct SimResult {
+  uint8_t nodesFound;
+  double addressingMs;
+  double colorFps;
+  double deltaFps;
+  double indexFps;
+  double rgb565Fps;
+  double rgb444Fps;
+  double sensorFps;
+  double sensorLatencyUs;
+  double sensorLatencyMaxUs;
+  double exchangeFps;
+  double latchFps;
+  double deadFps;
+  double colorBytes;
+  uint32_t noiseLost;
+  double noiseRecoveryMs;
+  double segmentFps;
+  double batchOk;
+  double segmentOk;
+  double fecFps;
+  double fecOk;
+  uint32_t corrected;
+  uint32_t noisyWrong;
+  uint32_t colorErrors;
+  uint32_t sensorErrors;
+  uint32_t nodeErrors;
+  uint32_t corrupted;
+  uint32_t undriven;
+  uint32_t negotiatedBaud;
+  double negotiationMs;
+  uint32_t baudErrors;
+};
+
+static uint32_t optFrames = 100,
+                optTurnaround = 150,
+                optPoll = 5,
+                optChanged = 10,
+                optBitErrors = 20;
+static uint8_t optFraming = MD_FRAMING_SOM,
+               optIdleGap = 0;
+
+// The node that's being polled, for the response handler
+static SimNode *currentNode = 0;
+
+// The bus being simulated, for the node clocks
+static MultidropSimBus *simBus = 0;
+
+// A node's clock, in milliseconds
+static uint32_t nodeMillis(SimNode *node) {
+  return (simBus->now() + node->clockOffset) / 1000000;
+}
+
+// The color a node should have in a frame
+static uint8_t frameColor(uint32_t frame, uint8_t node, uint8_t channel) {
+  return (frame * 7 + node * 3 + channel) & 0xFF;
+}
+
+// Does a node change color in a delta frame
+static uint8_t frameChanged(uint32_t frame, uint8_t node) {
+  return ((node * 7 + frame * 13) % 100) < optChanged;
+}
+
+// The sensor value a node reports in a frame
+static uint8_t frameSensor(uint32_t frame, uint8_t node) {
+  return (frame + node * 11) % 0xFE;
+}
+
+static void handleResponse(uint8_t command, uint8_t *buff, uint8_t len) {
+  if ((command == CMD_SEND_SENSOR_VALUE || command == CMD_SET_COLOR_GET_SENSOR) && len >= 1) {
+    buff[0] = currentNode->sensorValue;
+  }
+}
+
+// Handle a message, like the node firmware does
+static void handleMessage(SimNode *node) {
+  MultidropSlave *comm = node->comm;
+  uint8_t *data = comm->getData(),
+          len = comm->getDataLen(),
+          index;
+
+  if (node->scheduleState == SCHEDULE_WAITING && comm->getCommand() == CMD_SET_COLOR && len == 3) {
+    memcpy(node->scheduled, data, 3);
+    node->scheduleState = SCHEDULE_HOLDING;
+    return;
+  }
+
+  switch (comm->getCommand()) {
+    case CMD_SYNC_TIME:
+      if (len == 4) {
+        uint32_t time = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | (data[2] << 8) | data[3];
+        node->clockOffset = (int64_t)time * 1000000 - simBus->now();
+      }
+    return;
+    case CMD_SCHEDULE:
+      if (len == 4) {
+        node->scheduleTime = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | (data[2] << 8) | data[3];
+        node->scheduleState = SCHEDULE_WAITING;
+      }
+    return;
+    case CMD_SET_COLOR:
+      if (len == 3) {
+        memcpy(node->pending, data, 3);
+        node->colorFrames++;
+      }
+    break;
+    case CMD_SET_COLOR_GET_SENSOR:
+      if (len == 3 && comm->inExchangeMode()) {
+        memcpy(node->pending, data, 3);
+      }
+    break;
+    case CMD_SET_COLOR_565:
+      if (len == 2) {
+        uint16_t value = (data[0] << 8) | data[1];
+        uint8_t r = (value >> 11) & 0x1F,
+                g = (value >> 5) & 0x3F,
+                b = value & 0x1F;
+        node->pending[0] = (r << 3) | (r >> 2);
+        node->pending[1] = (g << 2) | (g >> 4);
+        node->pending[2] = (b << 3) | (b >> 2);
+      }
+    break;
+    case CMD_SET_COLOR_444:
+      if (len == 2 && comm->inNibbleMode()) {
+        node->pending[0] = (data[0] >> 4) * 0x11;
+        node->pending[1] = (data[0] & 0x0F) * 0x11;
+        node->pending[2] = (data[1] >> 4) * 0x11;
+      }
+    break;
+    case CMD_SET_PALETTE:
+      index = data[0];
+      for (uint8_t i = 1; i + 2 < len && index < PALETTE_SIZE; i += 3, index++) {
+        memcpy(node->palette[index], &data[i], 3);
+      }
+    break;
+    case CMD_SET_PALETTE_COLOR:
+      if (len == 1) {
+        index = (comm->inNibbleMode()) ? data[0] >> 4 : data[0];
+        if (index < PALETTE_SIZE) {
+          memcpy(node->pending, node->palette[index], 3);
+        }
+      }
+    break;
+    case CMD_FADE_TO:
+      if (len == 5) {
+        memcpy(node->pending, data, 3);
+        node->fadeMs = (data[3] << 8) | data[4];
+      }
+    break;
+    case CMD_SET_EFFECT:
+      if (len == EFFECT_DATA_LEN) {
+        node->effect = data[0];
+      }
+    return;
+    case CMD_SET_BAUD:
+      if (len == MD_SET_BAUD_LEN) {
+        uint32_t rate = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | (data[2] << 8) | data[3];
+
+        // Confirmed, stay at this rate
+        if (rate == node->baud) {
+          node->pendingBaud = 0;
+          node->revertBaud = 0;
+        }
+        else if (rate <= node->maxBaud) {
+          node->pendingBaud = rate;
+          node->pendingConfirm = (data[6] << 8) | data[7];
+          node->baudSwitchTime = nodeMillis(node) + ((data[4] << 8) | data[5]);
+        }
+      }
+    return;
+    case CMD_LATCH:
+      node->latchMode = (len == 0 || data[0] != 0);
+      memcpy(node->rgb, node->pending, 3);
+    break;
+  }
+
+  if (!node->latchMode) {
+    memcpy(node->rgb, node->pending, 3);
+  }
+}
+
+// Switch baud rates once it's time, and go back if master doesn't confirm the new one
+// in time, like check_baud() in the node firmware
+static void checkBaud(SimNode *node) {
+  uint32_t now = nodeMillis(node);
+
+  if (node->pendingBaud && (int32_t)(now - node->baudSwitchTime) >= 0) {
+    node->revertBaud = (node->pendingConfirm) ? node->baud : 0;
+    node->baudRevertTime = now + node->pendingConfirm;
+    node->baud = node->pendingBaud;
+    node->pendingBaud = 0;
+    node->serial->begin(node->baud);
+  }
+  else if (node->revertBaud && (int32_t)(now - node->baudRevertTime) >= 0) {
+    node->baud = node->revertBaud;
+    node->revertBaud = 0;
+    node->serial->begin(node->baud);
+  }
+}
+
+// Run every node's main loop once, then move the bus forward
+static void pollNodes(MultidropSimBus &bus, std::vector<SimNode> &nodes) {
+  for (size_t i = 0; i < nodes.size(); i++) {
+    SimNode *node = &nodes[i];
+    currentNode = node;
+    if (node->dead) continue;
+
+    if (node->scheduleState == SCHEDULE_HOLDING && (int32_t)(nodeMillis(node) - node->scheduleTime) >= 0) {
+      memcpy(node->pending, node->scheduled, 3);
+      memcpy(node->rgb, node->scheduled, 3);
+      node->scheduleState = SCHEDULE_NONE;
+    }
+    checkBaud(node);
+
+    node->comm->read();
+    if (node->comm->hasNewMessage() && node->comm->isAddressedToMe()) {
+      handleMessage(node);
+    }
+  }
+  bus.step(optPoll * 1000ULL);
+}
+
+// Keep the nodes running until master has sent everything, and they've read it
+static void waitForSent(MultidropSimBus &bus, MultidropDataSim *masterSerial, std::vector<SimNode> &nodes) {
+  while (masterSerial->isSending()) {
+    pollNodes(bus, nodes);
+  }
+  pollNodes(bus, nodes);
+}
+
+// Send color frames over a noisy line (as segment messages, with or without error correction,
+// or plain batch messages) and return the percent of node colors that made it. Colors that
+// nodes show, but weren't sent, are added to `wrong`.
+static double noisyColorFrames(MultidropSimBus &bus, MultidropMaster &master, MultidropDataSim *masterSerial,
+                               std::vector<SimNode> &nodes, uint8_t segments, uint8_t errorCorrection,
+                               uint32_t *wrong) {
+  uint8_t numNodes = nodes.size(), i;
+  std::vector<uint8_t> colors(numNodes * 3);
+  std::vector<uint32_t> received(numNodes);
+  uint32_t frame, delivered = 0;
+
+  bus.setBitErrors(optBitErrors);
+  for (frame = 0; frame < optFrames; frame++) {
+    for (i = 0; i < numNodes; i++) {
+      colors[i * 3]     = frameColor(frame, i, 0);
+      colors[i * 3 + 1] = frameColor(frame, i, 1);
+      colors[i * 3 + 2] = frameColor(frame, i, 2);
+      received[i] = nodes[i].colorFrames;
+    }
+
+    if (segments) {
+      master.startSegmentMessage(CMD_SET_COLOR, 3, errorCorrection);
+    } else {
+      master.startMessage(CMD_SET_COLOR, MultidropMaster::BROADCAST_ADDRESS, 3, true);
+    }
+    master.sendData(&colors[0], colors.size());
+    master.finishMessage();
+    waitForSent(bus, masterSerial, nodes);
+
+    for (i = 0; i < numNodes; i++) {
+      if (memcmp(nodes[i].rgb, &colors[i * 3], 3) == 0) {
+        delivered++;
+      } else if (nodes[i].colorFrames != received[i]) {
+        (*wrong)++;
+      }
+    }
+  }
+  bus.setBitErrors(0);
+
+  return delivered * 100.0 / (optFrames * numNodes);
+}
+
+// Get every node's CMD_GET_STATS counters, and return the total of `num` of them,
+// starting at `first`
+static uint32_t statsTotal(MultidropSimBus &bus, MultidropMaster &master, std::vector<SimNode> &nodes,
+                           uint8_t first, uint8_t num) {
+  uint8_t numNodes = nodes.size();
+  std::vector<uint8_t> stats(numNodes * MD_STATS_LEN),
+                       defaultStats(MD_STATS_LEN, 0xFF);
+  uint32_t total = 0;
+
+  master.startMessage(CMD_GET_STATS, MultidropMaster::BROADCAST_ADDRESS, MD_STATS_LEN, true, true);
+  master.setResponseSettings(&stats[0], bus.micros(), 2000, &defaultStats[0]);
+  while (!master.checkForResponses(bus.micros())) {
+    pollNodes(bus, nodes);
+  }
+
+  for (uint8_t i = 0; i < numNodes; i++) {
+    uint8_t *s = &stats[i * MD_STATS_LEN];
+    if (memcmp(s, &defaultStats[0], MD_STATS_LEN) == 0) continue; // No response
+
+    for (uint8_t c = first; c < first + num; c++) {
+      total += (s[c * 2] << 8) | s[c * 2 + 1];
+    }
+  }
+  return total;
+}
+
+// Count the nodes that don't have the expected colors
+static uint32_t colorErrors(std::vector<SimNode> &nodes, std::vector<uint8_t> &colors) {
+  uint32_t errors = 0;
+  for (size_t i = 0; i < nodes.size(); i++) {
+    if (memcmp(nodes[i].rgb, &colors[i * 3], 3) != 0) {
+      errors++;
+    }
+  }
+  return errors;
+}
+
+static SimResult simulate(uint8_t numNodes, uint32_t baud) {
+  SimResult result;
+  memset(&result, 0, sizeof(result));
+
+  MultidropSimBus bus(baud);
+  simBus = &bus;
+  MultidropDataSim *masterSerial = bus.addTransport(0);
+  MultidropMaster master(masterSerial);
+  master.addNextDaisyChain(1, &masterSerial->ddr, &masterSerial->port, &masterSerial->pin);
+  master.setFraming(optFraming);
+
+  std::vector<SimNode> nodes(numNodes);
+  for (uint8_t i = 0; i < numNodes; i++) {
+    SimNode *node = &nodes[i];
+    memset(node, 0, sizeof(*node));
+
+    node->serial = bus.addTransport(optTurnaround * 1000);
+    node->comm = new MultidropSlave(node->serial);
+    node->comm->addDaisyChain(0, &node->serial->ddr, &node->serial->port, &node->serial->pin,
+                              1, &node->serial->ddr, &node->serial->port, &node->serial->pin);
+    node->comm->setResponseHandler(&handleResponse);
+    node->comm->setFraming(optFraming);
+    node->serial->setIdleGap(optIdleGap);
+    node->baud = baud;
+  }
+
+  // Something that puts noise on the bus
+  MultidropDataSim *noiseSerial = bus.addTransport(0);
+
+  uint64_t start, timeout;
+  uint32_t frame;
+  uint8_t i;
+
+  // Reset & address nodes
+  master.resetAllNodes();
+  masterSerial->flush();
+  for (i = 0; i < 10; i++) {
+    pollNodes(bus, nodes);
+  }
+
+  start = bus.now();
+  timeout = start + SIM_TIMEOUT_NS;
+  master.startAddressing(bus.micros(), 2000);
+  while (master.checkForAddresses(bus.micros()) == MultidropMaster::ADR_WAITING && bus.now() < timeout) {
+    pollNodes(bus, nodes);
+  }
+  result.addressingMs = (bus.now() - start) / 1e6;
+  result.nodesFound = master.nodeNum;
+
+  std::vector<MultidropNodeStatus> nodeStatus(numNodes);
+  master.setNodeTracking(&nodeStatus[0], 500);
+
+  // Let the last node see the end of the message
+  for (i = 0; i < 10; i++) {
+    pollNodes(bus, nodes);
+  }
+
+  // Color frames
+  std::vector<uint8_t> colors(numNodes * 3);
+  uint32_t startBytes = bus.bytesSent;
+  start = bus.now();
+  for (frame = 0; frame < optFrames; frame++) {
+    for (i = 0; i < numNodes; i++) {
+      colors[i * 3]     = frameColor(frame, i, 0);
+      colors[i * 3 + 1] = frameColor(frame, i, 1);
+      colors[i * 3 + 2] = frameColor(frame, i, 2);
+    }
+
+    master.startMessage(CMD_SET_COLOR, MultidropMaster::BROADCAST_ADDRESS, 3, true);
+    master.sendData(&colors[0], colors.size());
+    master.finishMessage();
+
+    waitForSent(bus, masterSerial, nodes);
+    result.colorErrors += colorErrors(nodes, colors);
+  }
+  result.colorFps = optFrames / ((bus.now() - start) / 1e9);
+  result.colorBytes = (double)(bus.bytesSent - startBytes) / optFrames;
+
+  for (i = 0; i < numNodes; i++) {
+    if (nodes[i].colorFrames != optFrames) {
+      result.colorErrors++;
+    }
+  }
+
+  // Delta color frames
+  std::vector<uint8_t> changed((numNodes + 7) / 8);
+  start = bus.now();
+  for (frame = 0; frame < optFrames; frame++) {
+    std::fill(changed.begin(), changed.end(), 0);
+    for (i = 0; i < numNodes; i++) {
+      if (frameChanged(frame, i)) {
+        changed[i / 8] |= (1 << (i % 8));
+        colors[i * 3]     = frameColor(frame, i, 0);
+        colors[i * 3 + 1] = frameColor(frame, i, 1);
+        colors[i * 3 + 2] = frameColor(frame, i, 2);
+      }
+    }
+
+    master.startDeltaMessage(CMD_SET_COLOR, 3, &changed[0]);
+    for (i = 0; i < numNodes; i++) {
+      if (frameChanged(frame, i)) {
+        master.sendData(&colors[i * 3], 3);
+      }
+    }
+    master.finishMessage();
+
+    waitForSent(bus, masterSerial, nodes);
+    result.colorErrors += colorErrors(nodes, colors);
+  }
+  result.deltaFps = optFrames / ((bus.now() - start) / 1e9);
+
+  // Palette index frames (the upload isn't timed)
+  uint8_t palette[PALETTE_SIZE][3];
+  for (i = 0; i < PALETTE_SIZE; i++) {
+    palette[i][0] = frameColor(i, 0, 0);
+    palette[i][1] = frameColor(i, 0, 1);
+    palette[i][2] = frameColor(i, 0, 2);
+  }
+  for (i = 0; i < PALETTE_SIZE; i += 3) {
+    uint8_t count = (PALETTE_SIZE - i < 3) ? PALETTE_SIZE - i : 3;
+    master.startMessage(CMD_SET_PALETTE, MultidropMaster::BROADCAST_ADDRESS, 1 + count * 3);
+    master.sendData(i);
+    master.sendData(palette[i], count * 3);
+    master.finishMessage();
+    waitForSent(bus, masterSerial, nodes);
+  }
+
+  std::vector<uint8_t> indexes((numNodes + 1) / 2);
+  uint8_t numIndexes, index;
+  start = bus.now();
+  for (frame = 0; frame < optFrames; frame++) {
+    uint8_t delta = frame & 1;
+
+    std::fill(changed.begin(), changed.end(), 0);
+    std::fill(indexes.begin(), indexes.end(), 0);
+    numIndexes = 0;
+
+    for (i = 0; i < numNodes; i++) {
+      if (delta && !frameChanged(frame, i)) continue;
+
+      index = (frame + i) % PALETTE_SIZE;
+      memcpy(&colors[i * 3], palette[index], 3);
+      changed[i / 8] |= (1 << (i % 8));
+
+      indexes[numIndexes / 2] |= (numIndexes & 1) ? index : index << 4;
+      numIndexes++;
+    }
+
+    if (delta) {
+      master.startDeltaMessage(CMD_SET_PALETTE_COLOR, 1, &changed[0], true);
+    } else {
+      master.startNibbleMessage(CMD_SET_PALETTE_COLOR, 1);
+    }
+    master.sendData(&indexes[0], (numIndexes + 1) / 2);
+    master.finishMessage();
+
+    waitForSent(bus, masterSerial, nodes);
+    result.colorErrors += colorErrors(nodes, colors);
+  }
+  result.indexFps = optFrames / ((bus.now() - start) / 1e9);
+
+  // RGB565 frames (colors are rounded to what the nodes will end up with)
+  std::vector<uint8_t> packed(numNodes * 2);
+  start = bus.now();
+  for (frame = 0; frame < optFrames; frame++) {
+    for (i = 0; i < numNodes; i++) {
+      uint8_t r = frameColor(frame, i, 0) >> 3,
+              g = frameColor(frame, i, 1) >> 2,
+              b = frameColor(frame, i, 2) >> 3;
+      uint16_t value = (r << 11) | (g << 5) | b;
+
+      packed[i * 2]     = value >> 8;
+      packed[i * 2 + 1] = value & 0xFF;
+      colors[i * 3]     = (r << 3) | (r >> 2);
+      colors[i * 3 + 1] = (g << 2) | (g >> 4);
+      colors[i * 3 + 2] = (b << 3) | (b >> 2);
+    }
+
+    master.startMessage(CMD_SET_COLOR_565, MultidropMaster::BROADCAST_ADDRESS, 2, true);
+    master.sendData(&packed[0], numNodes * 2);
+    master.finishMessage();
+
+    waitForSent(bus, masterSerial, nodes);
+    result.colorErrors += colorErrors(nodes, colors);
+  }
+  result.rgb565Fps = optFrames / ((bus.now() - start) / 1e9);
+
+  // 12-bit RGB frames, 3 nibbles per node
+  uint16_t packedLen = ((uint16_t)numNodes * 3 + 1) / 2,
+           nibble;
+  start = bus.now();
+  for (frame = 0; frame < optFrames; frame++) {
+    std::fill(packed.begin(), packed.end(), 0);
+
+    for (i = 0, nibble = 0; i < numNodes; i++) {
+      for (uint8_t c = 0; c < 3; c++, nibble++) {
+        uint8_t value = frameColor(frame, i, c) >> 4;
+
+        packed[nibble / 2] |= (nibble & 1) ? value : value << 4;
+        colors[i * 3 + c] = value * 0x11;
+      }
+    }
+
+    master.startNibbleMessage(CMD_SET_COLOR_444, 3);
+    master.sendData(&packed[0], packedLen);
+    master.finishMessage();
+
+    waitForSent(bus, masterSerial, nodes);
+    result.colorErrors += colorErrors(nodes, colors);
+  }
+  result.rgb444Fps = optFrames / ((bus.now() - start) / 1e9);
+
+  // Sensor response frames
+  std::vector<uint8_t> sensors(numNodes);
+  uint8_t defaultSensor = 0xFF;
+  uint64_t latency, totalLatency = 0;
+
+  start = bus.now();
+  for (frame = 0; frame < optFrames; frame++) {
+    for (i = 0; i < numNodes; i++) {
+      nodes[i].sensorValue = frameSensor(frame, i);
+    }
+
+    uint64_t frameStart = bus.now();
+    master.startMessage(CMD_SEND_SENSOR_VALUE, MultidropMaster::BROADCAST_ADDRESS, 1, true, true);
+    master.setResponseSettings(&sensors[0], bus.micros(), 2000, &defaultSensor);
+    while (!master.checkForResponses(bus.micros())) {
+      pollNodes(bus, nodes);
+    }
+    masterSerial->flush();
+
+    latency = bus.now() - frameStart;
+    totalLatency += latency;
+    if (latency / 1e3 > result.sensorLatencyMaxUs) {
+      result.sensorLatencyMaxUs = latency / 1e3;
+    }
+
+    for (i = 0; i < numNodes; i++) {
+      if (sensors[i] != frameSensor(frame, i)) {
+        result.sensorErrors++;
+      }
+    }
+
+    // Let the nodes read the end of the message
+    pollNodes(bus, nodes);
+  }
+  result.sensorFps = optFrames / ((bus.now() - start) / 1e9);
+  result.sensorLatencyUs = (totalLatency / optFrames) / 1e3;
+
+  // Exchange frames: colors out and sensor values back
+  start = bus.now();
+  for (frame = 0; frame < optFrames; frame++) {
+    for (i = 0; i < numNodes; i++) {
+      colors[i * 3]     = frameColor(frame, i, 0);
+      colors[i * 3 + 1] = frameColor(frame, i, 1);
+      colors[i * 3 + 2] = frameColor(frame, i, 2);
+      nodes[i].sensorValue = frameSensor(frame, i);
+    }
+
+    master.startExchangeMessage(CMD_SET_COLOR_GET_SENSOR, 3, 1);
+    master.sendData(&colors[0], numNodes * 3);
+    waitForSent(bus, masterSerial, nodes);
+
+    master.setResponseSettings(&sensors[0], bus.micros(), 2000, &defaultSensor);
+    while (!master.checkForResponses(bus.micros())) {
+      pollNodes(bus, nodes);
+    }
+    waitForSent(bus, masterSerial, nodes);
+
+    for (i = 0; i < numNodes; i++) {
+      if (sensors[i] != frameSensor(frame, i)) {
+        result.sensorErrors++;
+      }
+    }
+    result.colorErrors += colorErrors(nodes, colors);
+  }
+  result.exchangeFps = optFrames / ((bus.now() - start) / 1e9);
+
+  // Latched color frames: nodes keep showing the last frame until the latch
+  std::vector<uint8_t> shown(colors);
+  uint8_t latchOff = 0;
+
+  master.startMessage(CMD_LATCH);
+  master.finishMessage();
+  waitForSent(bus, masterSerial, nodes);
+
+  start = bus.now();
+  for (frame = 0; frame < optFrames; frame++) {
+    for (i = 0; i < numNodes; i++) {
+      colors[i * 3]     = frameColor(frame + 1, i, 0);
+      colors[i * 3 + 1] = frameColor(frame + 1, i, 1);
+      colors[i * 3 + 2] = frameColor(frame + 1, i, 2);
+    }
+
+    master.startMessage(CMD_SET_COLOR, MultidropMaster::BROADCAST_ADDRESS, 3, true);
+    master.sendData(&colors[0], colors.size());
+    master.finishMessage();
+    waitForSent(bus, masterSerial, nodes);
+    result.colorErrors += colorErrors(nodes, shown);
+
+    master.startMessage(CMD_LATCH);
+    master.finishMessage();
+    waitForSent(bus, masterSerial, nodes);
+    result.colorErrors += colorErrors(nodes, colors);
+    shown = colors;
+  }
+  result.latchFps = optFrames / ((bus.now() - start) / 1e9);
+
+  master.startMessage(CMD_LATCH, MultidropMaster::BROADCAST_ADDRESS, 1);
+  master.sendData(&latchOff, 1);
+  master.finishMessage();
+  waitForSent(bus, masterSerial, nodes);
+
+  // Fade the whole floor with one frame: a color and duration for each node
+  std::vector<uint8_t> fades(numNodes * 5);
+  for (i = 0; i < numNodes; i++) {
+    uint16_t duration = 100 + i * 10;
+    colors[i * 3]     = fades[i * 5]     = frameColor(optFrames + 1, i, 0);
+    colors[i * 3 + 1] = fades[i * 5 + 1] = frameColor(optFrames + 1, i, 1);
+    colors[i * 3 + 2] = fades[i * 5 + 2] = frameColor(optFrames + 1, i, 2);
+    fades[i * 5 + 3] = duration >> 8;
+    fades[i * 5 + 4] = duration & 0xFF;
+  }
+
+  master.startMessage(CMD_FADE_TO, MultidropMaster::BROADCAST_ADDRESS, 5, true);
+  master.sendData(&fades[0], fades.size());
+  master.finishMessage();
+  waitForSent(bus, masterSerial, nodes);
+  result.colorErrors += colorErrors(nodes, colors);
+  for (i = 0; i < numNodes; i++) {
+    if (nodes[i].fadeMs != 100 + i * 10) {
+      result.colorErrors++;
+    }
+  }
+
+  // Breathe blue on every node, each a little behind the one before
+  uint8_t effect[EFFECT_DATA_LEN] = { 3, 0, 0, 255, 0, 0, 20, 0x07, 0xD0, 16, 0 };
+  master.startMessage(CMD_SET_EFFECT, MultidropMaster::BROADCAST_ADDRESS, EFFECT_DATA_LEN);
+  master.sendData(effect, EFFECT_DATA_LEN);
+  master.finishMessage();
+  waitForSent(bus, masterSerial, nodes);
+  for (i = 0; i < numNodes; i++) {
+    if (nodes[i].effect != effect[0]) {
+      result.colorErrors++;
+    }
+  }
+
+  // Sync the node clocks, then schedule a color frame for 20ms after it's sent
+  uint32_t masterTime = 100000;
+  uint8_t timeData[4] = { 0, 0x01, 0x86, 0xA0 }; // 100000, MSB first
+
+  master.startMessage(CMD_SYNC_TIME, MultidropMaster::BROADCAST_ADDRESS, 4);
+  master.sendData(timeData, 4);
+  master.finishMessage();
+  masterSerial->flush();
+  uint64_t syncTime = bus.now();
+  waitForSent(bus, masterSerial, nodes);
+
+  // Every clock should be within a millisecond of master's
+  masterTime += (bus.now() - syncTime) / 1000000;
+  for (i = 0; i < numNodes; i++) {
+    int32_t diff = nodeMillis(&nodes[i]) - masterTime;
+    if (diff < -1 || diff > 1) {
+      result.colorErrors++;
+    }
+  }
+
+  uint32_t showTime = masterTime + 20 + (numNodes * 3 * 10 * 1000ULL) / baud;
+  timeData[0] = showTime >> 24;
+  timeData[1] = showTime >> 16;
+  timeData[2] = showTime >> 8;
+  timeData[3] = showTime;
+  master.startMessage(CMD_SCHEDULE, MultidropMaster::BROADCAST_ADDRESS, 4);
+  master.sendData(timeData, 4);
+  master.finishMessage();
+  waitForSent(bus, masterSerial, nodes);
+
+  shown = colors;
+  for (i = 0; i < numNodes; i++) {
+    colors[i * 3]     = frameColor(optFrames + 2, i, 0);
+    colors[i * 3 + 1] = frameColor(optFrames + 2, i, 1);
+    colors[i * 3 + 2] = frameColor(optFrames + 2, i, 2);
+  }
+  master.startMessage(CMD_SET_COLOR, MultidropMaster::BROADCAST_ADDRESS, 3, true);
+  master.sendData(&colors[0], colors.size());
+  master.finishMessage();
+  waitForSent(bus, masterSerial, nodes);
+
+  // Nothing changes until it's time
+  result.colorErrors += colorErrors(nodes, shown);
+  while ((bus.now() - syncTime) / 1000000 + 100000 <= showTime + 1) {
+    pollNodes(bus, nodes);
+  }
+  result.colorErrors += colorErrors(nodes, colors);
+
+  // Ask the nodes for their error counts (framing, overrun, dropped, CRC)
+  result.nodeErrors = statsTotal(bus, master, nodes, 0, 4);
+
+  // Sensor response frames, with a dead node
+  uint8_t deadNode = numNodes / 2;
+  nodes[deadNode].dead = 1;
+
+  start = bus.now();
+  for (frame = 0; frame < optFrames; frame++) {
+    for (i = 0; i < numNodes; i++) {
+      nodes[i].sensorValue = frameSensor(frame, i);
+    }
+
+    master.startMessage(CMD_SEND_SENSOR_VALUE, MultidropMaster::BROADCAST_ADDRESS, 1, true, true);
+    master.setResponseSettings(&sensors[0], bus.micros(), 2000, &defaultSensor);
+    while (!master.checkForResponses(bus.micros())) {
+      pollNodes(bus, nodes);
+    }
+    waitForSent(bus, masterSerial, nodes);
+
+    for (i = 0; i < numNodes; i++) {
+      if (sensors[i] != ((i == deadNode) ? defaultSensor : frameSensor(frame, i))) {
+        result.sensorErrors++;
+      }
+    }
+  }
+  result.deadFps = optFrames / ((bus.now() - start) / 1e9);
+
+  if (!master.isNodeDead(deadNode + 1)) {
+    result.sensorErrors++;
+  }
+  nodes[deadNode].dead = 0;
+  nodes[deadNode].serial->clear(); // It was disconnected, so it missed everything
+  master.setNodeTracking(&nodeStatus[0], 500); // So it isn't skipped anymore
+
+  // Everything after this is expected to collide
+  result.corrupted = bus.bytesCorrupted;
+  result.undriven = bus.bytesUndriven;
+
+  // Noise in the middle of a color frame, then frames until every node is right again
+  uint8_t noise[SIM_NOISE_LEN] = { 0 };
+  uint64_t noiseTime = 0;
+
+  for (frame = 0; frame < SIM_NOISE_FRAMES; frame++) {
+    for (i = 0; i < numNodes; i++) {
+      colors[i * 3]     = 0xFF;
+      colors[i * 3 + 1] = 0xFF;
+      colors[i * 3 + 2] = frameColor(frame, i, 2);
+    }
+
+    uint32_t frameStart = bus.bytesSent;
+    master.startMessage(CMD_SET_COLOR, MultidropMaster::BROADCAST_ADDRESS, 3, true);
+    master.sendData(&colors[0], colors.size());
+    master.finishMessage();
+
+    if (frame == 0) {
+      while (bus.bytesSent - frameStart < numNodes * 3 / 2) {
+        pollNodes(bus, nodes);
+      }
+      noiseTime = bus.now();
+      noiseSerial->enable_write();
+      for (i = 0; i < SIM_NOISE_LEN; i++) {
+        noiseSerial->write(noise[i]);
+      }
+      noiseSerial->enable_read();
+    }
+    waitForSent(bus, masterSerial, nodes);
+
+    // Leave the line idle before the next frame
+    if (optIdleGap) {
+      uint64_t idleEnd = bus.now() + (optIdleGap + 1) * MultidropSimBus::byteTime(baud);
+      while (bus.now() < idleEnd) {
+        pollNodes(bus, nodes);
+      }
+    }
+
+    if (colorErrors(nodes, colors) == 0) break;
+    result.noiseLost++;
+  }
+  result.noiseRecoveryMs = (bus.now() - noiseTime) / 1e6;
+
+  // Color frames on a noisy line, with and without segment checks and error correction
+  result.batchOk = noisyColorFrames(bus, master, masterSerial, nodes, false, false, &result.noisyWrong);
+  start = bus.now();
+  result.segmentOk = noisyColorFrames(bus, master, masterSerial, nodes, true, false, &result.noisyWrong);
+  result.segmentFps = optFrames / ((bus.now() - start) / 1e9);
+
+  start = bus.now();
+  result.fecOk = noisyColorFrames(bus, master, masterSerial, nodes, true, true, &result.noisyWrong);
+  result.fecFps = optFrames / ((bus.now() - start) / 1e9);
+
+  // Nodes can be left in the middle of a message that was scrambled by the noise,
+  // so send clean frames until every node is back in step
+  for (frame = 0; frame < SIM_NOISE_FRAMES; frame++) {
+    for (i = 0; i < numNodes; i++) {
+      colors[i * 3]     = frameColor(optFrames + frame, i, 0);
+      colors[i * 3 + 1] = frameColor(optFrames + frame, i, 1);
+      colors[i * 3 + 2] = frameColor(optFrames + frame, i, 2);
+    }
+    master.startMessage(CMD_SET_COLOR, MultidropMaster::BROADCAST_ADDRESS, 3, true);
+    master.sendData(&colors[0], colors.size());
+    master.finishMessage();
+    waitForSent(bus, masterSerial, nodes);
+
+    if (colorErrors(nodes, colors) == 0) break;
+  }
+
+  // Only error corrected messages are corrected
+  result.corrected = statsTotal(bus, master, nodes, 5, 1);
+
+  // Negotiate a faster baud rate, when one node can't do the fastest one. The nodes that
+  // switched have to come back down, and the one that didn't has to pick up the next try,
+  // after seeing a census at a rate it can't read.
+  uint32_t rates[SIM_BAUD_RATES] = { baud * 4, baud * 3, baud * 5 / 2, baud * 2 };
+  std::vector<uint8_t> census(numNodes);
+  uint8_t slowNode = numNodes / 2;
+
+  for (i = 0; i < numNodes; i++) {
+    nodes[i].maxBaud = (i == slowNode) ? rates[SIM_BAUD_RATES - 1] : rates[0];
+  }
+
+  start = bus.now();
+  timeout = start + SIM_TIMEOUT_NS;
+  master.startBaudNegotiation(rates, SIM_BAUD_RATES, baud, &census[0], bus.now() / 1000000,
+                              SIM_BAUD_SWITCH_DELAY, SIM_CENSUS_TIMEOUT);
+  while (master.checkBaudNegotiation(bus.now() / 1000000) == MultidropMaster::BAUD_WAITING && bus.now() < timeout) {
+    pollNodes(bus, nodes);
+  }
+  result.negotiationMs = (bus.now() - start) / 1e6;
+  result.negotiatedBaud = master.getBaudRate();
+
+  // Every node stays at the new rate, past the time it would go back without the confirm
+  timeout = bus.now() + (SIM_BAUD_SWITCH_DELAY * 2 + MD_BAUD_CENSUS_ROUNDS * numNodes * SIM_CENSUS_TIMEOUT + 10) * 1000000ULL;
+  while (bus.now() < timeout) {
+    pollNodes(bus, nodes);
+  }
+  for (i = 0; i < numNodes; i++) {
+    if (nodes[i].baud != rates[SIM_BAUD_RATES - 1]) {
+      result.baudErrors++;
+    }
+  }
+  if (result.negotiatedBaud != rates[SIM_BAUD_RATES - 1]) {
+    result.baudErrors++;
+  }
+
+  // And gets frames at it
+  for (i = 0; i < numNodes; i++) {
+    colors[i * 3]     = frameColor(optFrames + SIM_NOISE_FRAMES, i, 0);
+    colors[i * 3 + 1] = frameColor(optFrames + SIM_NOISE_FRAMES, i, 1);
+    colors[i * 3 + 2] = frameColor(optFrames + SIM_NOISE_FRAMES, i, 2);
+  }
+  master.startMessage(CMD_SET_COLOR, MultidropMaster::BROADCAST_ADDRESS, 3, true);
+  master.sendData(&colors[0], colors.size());
+  master.finishMessage();
+  waitForSent(bus, masterSerial, nodes);
+  result.baudErrors += colorErrors(nodes, colors);
+
+  for (i = 0; i < numNodes; i++) {
+    delete nodes[i].comm;
+  }
+
+  return result;
+}
+
+// Parse a comma separated list of numbers
+static std::vector<uint32_t> parseList(const char *str) {
+  std::vector<uint32_t> list;
+  char *end;
+
+  while (*str) {
+    list.push_back(strtoul(str, &end, 10));
+    if (*end != ',') break;
+    str = end + 1;
+  }
+  return list;
+}
+
+int main(int argc, char **argv) {
+  std::vector<uint32_t> nodeCounts(1, 50),
+                        bauds(1, 250000);
+  int opt;
+
+  while ((opt = getopt(argc, argv, "n:b:f:t:p:c:g:e:sh")) != -1) {
+    switch (opt) {
+      case 'n': nodeCounts = parseList(optarg); break;
+      case 'b': bauds = parseList(optarg); break;
+      case 'f': optFrames = strtoul(optarg, 0, 10); break;
+      case 't': optTurnaround = strtoul(optarg, 0, 10); break;
+      case 'p': optPoll = strtoul(optarg, 0, 10); break;
+      case 'c': optChanged = strtoul(optarg, 0, 10); break;
+      case 's': optFraming = MD_FRAMING_STUFFED; break;
+      case 'g': optIdleGap = strtoul(optarg, 0, 10); break;
+      case 'e': optBitErrors = strtoul(optarg, 0, 10); break;
+      default:
+        fprintf(stderr, "Usage: %s [-n nodes[,nodes...]] [-b baud[,baud...]] [-f frames] [-t turnaround_us] [-p poll_us] [-c changed_percent] [-s] [-g idle_bytes] [-e bit_errors_ppm]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  size_t n, b;
+  uint8_t failed = false;
+
+  for (n = 0; n < nodeCounts.size(); n++) {
+    if (nodeCounts[n] < 1 || nodeCounts[n] > 254 || optFrames < 1) {
+      fprintf(stderr, "Node counts must be between 1 and 254, and frames at least 1\n");
+      return 2;
+    }
+  }
+
+  printf("%5s %8s %5s %9s %10s %10s %10s %10s %10s %10s %10s %10s %10s %10s %10s %7s %5s %9s %10s %10s %6s %7s %7s %6s %6s %6s %6s %6s %7s %8s %9s %6s\n",
+         "nodes", "baud", "found", "addr(ms)", "color fps", "delta fps", "index fps", "565 fps", "444 fps", "sensor fps", "exch fps", "latch fps", "dead fps", "lat(us)", "max(us)",
+         "bytes", "lost", "recov(ms)", "seg fps", "fec fps", "ok%", "seg ok%", "fec ok%", "fixed", "wrong", "c.err", "s.err", "n.err", "corrupt", "new baud", "nego(ms)", "b.err");
+
+  for (n = 0; n < nodeCounts.size(); n++) {
+    for (b = 0; b < bauds.size(); b++) {
+      SimResult r = simulate(nodeCounts[n], bauds[b]);
+
+      printf("%5u %8u %5u %9.2f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %7.1f %5u %9.2f %10.1f %10.1f %6.1f %7.1f %7.1f %6u %6u %6u %6u %6u %7u %8u %9.1f %6u\n",
+             nodeCounts[n], bauds[b], r.nodesFound, r.addressingMs, r.colorFps, r.deltaFps, r.indexFps, r.rgb565Fps, r.rgb444Fps, r.sensorFps, r.exchangeFps, r.latchFps, r.deadFps,
+             r.sensorLatencyUs, r.sensorLatencyMaxUs,
+             r.colorBytes, r.noiseLost, r.noiseRecoveryMs,
+             r.segmentFps, r.fecFps, r.batchOk, r.segmentOk, r.fecOk, r.corrected, r.noisyWrong,
+             r.colorErrors, r.sensorErrors, r.nodeErrors, r.corrupted,
+             r.negotiatedBaud, r.negotiationMs, r.baudErrors);
+
+      if (r.nodesFound != nodeCounts[n] || r.colorErrors || r.sensorErrors || r.nodeErrors ||
+          r.corrupted || r.undriven || r.baudErrors || (optFraming == MD_FRAMING_STUFFED && r.noiseLost > 1) || (optIdleGap && r.noiseLost > 2)) {
+        failed = true;
+      }
+    }
+  }
+
+  return (failed) ? 1 : 0;
+}
@@ -2,16 +2,20 @@
 * A single disco sqare node.
 * 
 * This program connects to a multi-drop network as a slave node and 
-* waits for the master node to ask it to check the touch sensor and to set the color
-* of the RGB LED.
+* waits for the master node to ask it for the touch sensor value and to set the color
+* of the RGB LED. The touch sensor is measured continuously in the background.
 ******************************************************************************/
 
 #include <avr/io.h>
 #include <avr/wdt.h>
 #include <avr/eeprom.h> 
+#include <util/atomic.h>
+#include <string.h>
 
 #include "pwm.h"
 #include "clock.h"
+#include "fade.h"
+#include "effect.h"
 #include "touch.h"
 #include "touch_control.h"
 #include "touch_api.h"
@@ -25,29 +29,78 @@
 
 void comm_init();
 void comm_run();
-void handle_message();
+void handle_message(uint8_t command, uint8_t *data, uint8_t len, uint8_t nibbles);
+uint8_t schedule_message();
+void check_schedule();
+uint32_t read_uint32(uint8_t *data);
 void handle_response_msg(uint8_t command, uint8_t *buff,uint8_t len);
-void set_color(uint8_t *rgb);
-void read_sensor();
+void set_color(uint8_t *rgb, uint16_t fade=0);
+void show_color(uint8_t *rgb);
+void show_pending();
+void latch_color(uint8_t *data, uint8_t len);
+void set_effect(uint8_t *data);
+void set_color_565(uint8_t *data);
+void set_color_444(uint8_t *data);
+void set_palette(uint8_t *data, uint8_t len);
+void set_palette_color(uint8_t index);
+void check_sensor();
+void set_baud(uint8_t *data);
+void check_baud();
 
 /*----------------------------------------------------------------------------
                                 constants
 ----------------------------------------------------------------------------*/
 
+// Set with BUS_BAUD in the Makefile.
+// The DiscoController BAUD_RATE needs to match.
+#ifndef BUS_BAUD
 #define BUS_BAUD 250000
+#endif
+static_assert(uartBaudValid(F_CPU, BUS_BAUD), "BUS_BAUD cannot be generated accurately at this F_CPU");
+
+// Set with BUS_FRAMING in the Makefile: MD_FRAMING_SOM or MD_FRAMING_STUFFED.
+// The DiscoController FRAMING needs to match.
+#ifndef BUS_FRAMING
+#define BUS_FRAMING MD_FRAMING_SOM
+#endif
+
+// Set with BUS_IDLE_GAP in the Makefile: when the bus is silent for this many byte times
+// in the middle of a message, the message is dropped and the next one is received (0 = off).
+#ifndef BUS_IDLE_GAP
+#define BUS_IDLE_GAP 0
+#endif
+static_assert(BUS_IDLE_GAP == 0 || BUS_IDLE_GAP >= 3, "BUS_IDLE_GAP must be at least 3 byte times");
+static_assert(EFFECT_DATA_LEN <= MD_MAX_DATA_LEN, "MD_MAX_DATA_LEN is too small for CMD_SET_EFFECT");
+
 #define DEFAULT_DETECT_THRES 11u
 
 // Message commands
+#define CMD_SET_BAUD         0xF9
 #define CMD_RESET_NODE       0xFA
 #define CMD_SET_ADDRESS      0xFB
 
 #define CMD_GET_VERSION       0xA0
 #define CMD_SET_COLOR         0xA1
-#define CMD_CHECK_SENSOR      0xA2
+// 0xA2 was CMD_CHECK_SENSOR: the sensor is now measured in the background, so it's retired
 #define CMD_SEND_SENSOR_VALUE 0xA3
+#define CMD_SET_PALETTE       0xA4 // Store palette colors: first index, then up to 3 RGB colors
+#define CMD_SET_PALETTE_COLOR 0xA5 // Set the color to a palette index (a byte, or a nibble in nibble mode)
+#define CMD_SET_COLOR_565     0xA6 // Set the color from RGB565 (2 bytes, MSB first)
+#define CMD_SET_COLOR_444     0xA7 // Set the color from 12-bit RGB (3 nibbles: red, green, blue), in nibble mode
+#define CMD_SET_COLOR_GET_SENSOR 0xA8 // Exchange message: RGB color in, sensor value out
+#define CMD_LATCH             0xA9 // Show the pending color, and hold new colors until the next latch (or pass 0 to stop holding)
+#define CMD_FADE_TO           0xAA // Fade to an RGB color, over a duration in milliseconds (2 bytes, MSB first)
+#define CMD_SET_EFFECT        0xAB // Run a repeating light effect on the node (see effect.h)
+#define CMD_SYNC_TIME         0xAC // Set the clock to master's time (4 bytes, milliseconds, MSB first)
+#define CMD_SCHEDULE          0xAD // Hold the next message until a time on the clock (4 bytes, MSB first)
 
 #define CMD_SET_DETECT_THRESH 0xB0 // Set the QTouch detection threshold
 
+// Number of palette colors (a nibble can index up to 16)
+#ifndef PALETTE_SIZE
+#define PALETTE_SIZE 16
+#endif
+
 // EEPROM byte addresses
 
 // Since node addresses can go up to 0xFF and EEPROM default values are 0xFF, 
@@ -62,11 +115,42 @@ void read_sensor();
 
 // The last touch sensor value
 uint8_t sensor_value = 0;
-uint8_t reading_sensor = 0;
+
+// Colors for CMD_SET_PALETTE_COLOR
+uint8_t palette[PALETTE_SIZE][3];
+
+// Double buffering: once master sends CMD_LATCH, new colors are
+// held here until the next CMD_LATCH, so all nodes change together.
+// A pending fade starts on the latch.
+uint8_t latch_mode = 0;
+uint8_t pending_rgb[3];
+uint16_t pending_fade = 0;
+uint8_t pending_changed = 0;
+
+// CMD_SCHEDULE: the next message is held until schedule_time
+#define SCHEDULE_NONE    0
+#define SCHEDULE_WAITING 1 // Waiting for the message
+#define SCHEDULE_HOLDING 2 // Holding the message until its time
+uint8_t schedule_state = SCHEDULE_NONE;
+uint32_t schedule_time;
+uint8_t scheduled_command,
+        scheduled_len,
+        scheduled_nibbles,
+        scheduled_data[MD_MAX_DATA_LEN];
+
+// Baud rate to switch to, at baud_switch_time
+uint32_t bus_baud = BUS_BAUD;
+uint32_t pending_baud = 0;
+uint32_t baud_switch_time = 0;
+
+// Until master confirms the new baud rate, go back to revert_baud at baud_revert_time
+uint16_t pending_confirm = 0;
+uint32_t revert_baud = 0;
+uint32_t baud_revert_time = 0;
 
 // Bus serial
 MultidropData485 serial(PD2, &DDRD, &PORTD);
-MultidropSlave comm(&serial);
+MultidropSlaveT<MultidropData485> comm(&serial);
 
 /*----------------------------------------------------------------------------
                               program
@@ -95,7 +179,13 @@ int main() {
   // Program loop
   while(1) {
     wdt_reset();
+    clock_run();
     comm_run();
+    check_sensor();
+    check_baud();
+    check_schedule();
+    effect_run(millis(), sensor_value);
+    fade_run();
   }
 }
 
@@ -107,6 +197,11 @@ void comm_init() {
   PORTD |= (1 << PD0);
 
   serial.begin(BUS_BAUD);
+  serial.setAsyncRelease(true); // Don't block while responses are sent
+  serial.setRxHandler(&clock_stamp); // For CMD_SYNC_TIME
+#if BUS_IDLE_GAP > 0
+  serial.setIdleGap(&clock_ticks, CLOCK_TICK_RATE, BUS_IDLE_GAP);
+#endif
   
   // Define daisy chain lines and let polarity (next/previous) be determined at runtime
   comm.addDaisyChain(PC3, &DDRC, &PORTC, &PINC,
@@ -114,6 +209,10 @@ void comm_init() {
 
   // Response message handler
   comm.setResponseHandler(&handle_response_msg);
+  comm.setFraming(BUS_FRAMING);
+
+  // Drop messages for other nodes in the RX interrupt
+  comm.setRxFilter(MD_FILTER_ADDRESSED);
 
   // Check if we have an address in the EEPROM
   uint8_t addr = eeprom_read_byte(EEPROM_ADDR);
@@ -127,16 +226,16 @@ void comm_init() {
  */
 void comm_run() {
   comm.read();
-  if (comm.hasNewMessage() && comm.isAddressedToMe()) {
-    handle_message();
+  if (comm.hasNewMessage() && comm.isAddressedToMe() && !schedule_message()) {
+    handle_message(comm.getCommand(), comm.getData(), comm.getDataLen(), comm.inNibbleMode());
   }
 }
 
 /**
- * Handle a new message received from the bus.
+ * Handle a new message received from the bus (or one that was held until its scheduled time).
  */
-void handle_message() {
-  switch (comm.getCommand()) {
+void handle_message(uint8_t command, uint8_t *data, uint8_t len, uint8_t nibbles) {
+  switch (command) {
     // We've been assigned an address
     case CMD_SET_ADDRESS:
       if (comm.getAddress() > 0) {
@@ -151,22 +250,98 @@ void handle_message() {
       eeprom_update_byte(EEPROM_ADDR, 0);
     break;
 
+    // Set the clock to master's time, as of the end of this message.
+    // The last byte stamped might be from a later message: if so, take off the
+    // time those bytes took to arrive (10 bits each, back to back).
+    case CMD_SYNC_TIME:
+      if (len == 4) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+          clock_latch((uint32_t)serial.available() * 10000000 / bus_baud);
+        }
+        clock_sync(read_uint32(data));
+      }
+    break;
+
+    // Hold the next message until a time
+    case CMD_SCHEDULE:
+      if (len == 4) {
+        schedule_time = read_uint32(data);
+        schedule_state = SCHEDULE_WAITING;
+      }
+    break;
+
+    // Switch bus baud rate
+    case CMD_SET_BAUD:
+      if (len == MD_SET_BAUD_LEN) {
+        set_baud(data);
+      }
+    break;
+
     // Set the LED color
     case CMD_SET_COLOR:
-      if (comm.getDataLen() == 3) {
-        set_color(comm.getData());
+      if (len == 3) {
+        set_color(data);
+      }
+    break;
+
+    // Fade the LED to a color
+    case CMD_FADE_TO:
+      if (len == 5) {
+        set_color(data, (data[3] << 8) | data[4]);
+      }
+    break;
+
+    // Run a light effect
+    case CMD_SET_EFFECT:
+      if (len == EFFECT_DATA_LEN) {
+        set_effect(data);
       }
     break;
 
-    // Check the touch sensor
-    case CMD_CHECK_SENSOR:
-      read_sensor();
+    // Show the pending color
+    case CMD_LATCH:
+      latch_color(data, len);
+    break;
+
+    // Set the LED color from a compact format
+    case CMD_SET_COLOR_565:
+      if (len == 2) {
+        set_color_565(data);
+      }
+    break;
+    case CMD_SET_COLOR_444:
+      if (len == 2 && nibbles) {
+        set_color_444(data);
+      }
+    break;
+
+    // Set the LED color (we've already responded with the sensor value)
+    case CMD_SET_COLOR_GET_SENSOR:
+      if (len == 3 && comm.inExchangeMode()) {
+        set_color(data);
+      }
+    break;
+
+    // Store palette colors
+    case CMD_SET_PALETTE:
+      set_palette(data, len);
+    break;
+
+    // Set the LED to a palette color
+    case CMD_SET_PALETTE_COLOR:
+      if (len == 1) {
+        uint8_t index = data[0];
+        if (nibbles) {
+          index >>= 4;
+        }
+        set_palette_color(index);
+      }
     break;
 
     // Set the touch sensor detect threshold
     case CMD_SET_DETECT_THRESH:
-      if (comm.getDataLen() == 1) {
-        uint8_t dt = comm.getData()[0]; 
+      if (len == 1) {
+        uint8_t dt = data[0]; 
         eeprom_update_byte(EEPROM_DETECT_THRESH, dt);
         touch_init(dt);
       }
@@ -189,6 +364,7 @@ void handle_response_msg(uint8_t command, uint8_t *buff, uint8_t len) {
 
     // Send the last sensor value received
     case CMD_SEND_SENSOR_VALUE:
+    case CMD_SET_COLOR_GET_SENSOR:
       if (len >= 1) {
         buff[0] = sensor_value;
       }
@@ -197,42 +373,218 @@ void handle_response_msg(uint8_t command, uint8_t *buff, uint8_t len) {
 }
 
 /**
- * Update RGB LED values
+ * Set the LED color, or fade to it over `fade` milliseconds.
+ * In latch mode, it's held until the next CMD_LATCH.
  */
-void set_color(uint8_t *rgb) {
+void set_color(uint8_t *rgb, uint16_t fade) {
+  pending_rgb[0] = rgb[0];
+  pending_rgb[1] = rgb[1];
+  pending_rgb[2] = rgb[2];
+  pending_fade = fade;
+  pending_changed = 1;
+
+  if (!latch_mode) {
+    show_pending();
+  }
+}
+
+/**
+ * Show the pending color, or start fading to it.
+ */
+void show_pending() {
+  pending_changed = 0;
+  effect_stop();
+  if (pending_fade) {
+    fade_to(pending_rgb, pending_fade);
+  } else {
+    show_color(pending_rgb);
+  }
+}
+
+/**
+ * Update RGB LED values (and stop any fade)
+ */
+void show_color(uint8_t *rgb) {
+  fade_stop();
   red_pwm(rgb[0]);
   green_pwm(rgb[1]);
   blue_pwm(rgb[2]);
 }
 
 /**
- * Get a new reading from the touch sensor.
+ * Show the pending color, from the CMD_LATCH data: nothing to stay
+ * in latch mode, or a single 0 byte to leave it.
+ * Nodes without a new color keep what they're showing (or fading to).
+ */
+void latch_color(uint8_t *data, uint8_t len) {
+  latch_mode = (len == 0 || data[0] != 0);
+  if (pending_changed) {
+    show_pending();
+  }
+}
+
+/**
+ * Start a light effect, which runs until the next color.
+ * This starts right away, even in latch mode, and replaces any pending color.
+ */
+void set_effect(uint8_t *data) {
+  pending_changed = 0;
+  fade_stop();
+  effect_start(data, comm.getAddress(), millis());
+}
+
+/**
+ * Update RGB LED values from RGB565: 5 bits red, 6 bits green and 5 bits blue (MSB first).
+ * The high bits are repeated in the low bits, so full brightness is still 0xFF.
+ */
+void set_color_565(uint8_t *data) {
+  uint16_t value = (data[0] << 8) | data[1];
+  uint8_t r = (value >> 11) & 0x1F,
+          g = (value >> 5) & 0x3F,
+          b = value & 0x1F;
+  uint8_t rgb[3] = {
+    (uint8_t)((r << 3) | (r >> 2)),
+    (uint8_t)((g << 2) | (g >> 4)),
+    (uint8_t)((b << 3) | (b >> 2))
+  };
+  set_color(rgb);
+}
+
+/**
+ * Update RGB LED values from 12-bit RGB: the red and green nibbles in the first byte,
+ * and blue in the high nibble of the second.
+ */
+void set_color_444(uint8_t *data) {
+  uint8_t rgb[3] = {
+    (uint8_t)((data[0] >> 4) * 0x11),
+    (uint8_t)((data[0] & 0x0F) * 0x11),
+    (uint8_t)((data[1] >> 4) * 0x11)
+  };
+  set_color(rgb);
+}
+
+/**
+ * Store palette colors, from the CMD_SET_PALETTE data:
+ * the index of the first color, followed by RGB values.
+ */
+void set_palette(uint8_t *data, uint8_t len) {
+  uint8_t index = data[0];
+  for (uint8_t i = 1; i + 2 < len && index < PALETTE_SIZE; i += 3, index++) {
+    palette[index][0] = data[i];
+    palette[index][1] = data[i + 1];
+    palette[index][2] = data[i + 2];
+  }
+}
+
+/**
+ * Set the LED to a palette color
  */
-void read_sensor() {
-  if (reading_sensor) return;
-  reading_sensor = 1;
+void set_palette_color(uint8_t index) {
+  if (index < PALETTE_SIZE) {
+    set_color(palette[index]);
+  }
+}
 
-  // Default MCU register value
-  uint8_t mcuRegister = MCUCR;
-  uint16_t status_flag = 0u;
+/**
+ * Schedule a bus baud rate change, from the CMD_SET_BAUD data:
+ * baud rate (4 bytes), delay in milliseconds (2 bytes) and confirm
+ * timeout in milliseconds (2 bytes).
+ * The rate we're already at confirms the last switch.
+ */
+void set_baud(uint8_t *data) {
+  uint32_t baud = read_uint32(data);
+  uint16_t delay = (data[4] << 8) | data[5];
+
+  // Confirmed, stay at this rate
+  if (baud == bus_baud) {
+    pending_baud = 0;
+    revert_baud = 0;
+    return;
+  }
 
-  do {
-    // Disable pull-ups
-    MCUCR |= (1 << PUD);
+  // Can't do this rate, stay where we are
+  if (!uartBaudValid(F_CPU, baud)) return;
 
-    // Measure sensor
-    status_flag = qt_measure_sensors( millis() );
-    
-    // Reset pull-ups
-    MCUCR = mcuRegister;
+  pending_baud = baud;
+  pending_confirm = (data[6] << 8) | data[7];
+  baud_switch_time = millis() + delay;
+}
+
+/**
+ * Switch baud rates, once it's time.
+ * If master doesn't confirm the new rate in time, go back to the old one.
+ */
+void check_baud() {
+  uint32_t now = millis();
+
+  if (pending_baud && (int32_t)(now - baud_switch_time) >= 0) {
+    revert_baud = (pending_confirm) ? bus_baud : 0;
+    baud_revert_time = now + pending_confirm;
+
+    bus_baud = pending_baud;
+    pending_baud = 0;
+    serial.flush();
+    serial.begin(bus_baud);
+  }
+  else if (revert_baud && (int32_t)(now - baud_revert_time) >= 0) {
+    bus_baud = revert_baud;
+    revert_baud = 0;
+    serial.flush();
+    serial.begin(bus_baud);
+  }
+}
+
+/**
+ * If master has scheduled a time, hold this message (the current one in `comm`)
+ * until then. Messages for the bus itself, responses, and other time messages
+ * aren't held. Returns true if it was held.
+ */
+uint8_t schedule_message() {
+  uint8_t command = comm.getCommand(),
+          len = comm.getDataLen();
+
+  if (schedule_state != SCHEDULE_WAITING || command >= CMD_SET_BAUD || command == CMD_SYNC_TIME ||
+      command == CMD_SCHEDULE || comm.isResponseMessage()) {
+    return 0;
+  }
+
+  scheduled_command = command;
+  scheduled_len = len;
+  scheduled_nibbles = comm.inNibbleMode();
+  memcpy(scheduled_data, comm.getData(), len);
+  schedule_state = SCHEDULE_HOLDING;
+  return 1;
+}
+
+/**
+ * Handle the scheduled message, once it's time. If the time passes before
+ * the message arrives, the schedule is dropped.
+ */
+void check_schedule() {
+  if (schedule_state == SCHEDULE_NONE || (int32_t)(millis() - schedule_time) < 0) return;
+
+  if (schedule_state == SCHEDULE_HOLDING) {
+    handle_message(scheduled_command, scheduled_data, scheduled_len, scheduled_nibbles);
+  }
+  schedule_state = SCHEDULE_NONE;
+}
+
+/**
+ * Read a 32-bit value from message data (MSB first)
+ */
+uint32_t read_uint32(uint8_t *data) {
+  return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+}
+
+/**
+ * Continue measuring the touch sensor in the background, and update
+ * the sensor value when a measurement finishes. The QTouch library
+ * debounces the value (see `qt_di` in touch_control.cpp).
+ */
+void check_sensor() {
+  if (!touch_run(millis())) return;
 
-    // Check bus before next measurement
-    comm_run();
-  } while (status_flag & QTLIB_BURST_AGAIN); // check again, if burst flag is set
-  
-  // Get sensor value
   sensor_value = GET_SENSOR_STATE(0);
-  reading_sensor = 0;
 
   // Debug LED
   if (sensor_value) {
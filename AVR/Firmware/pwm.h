@@ -1,12 +1,13 @@
 /**
  * Provides helper methods to setup use the PWM lines for the RGB LEDs.
+ * Everything is inline, since both main.cpp and fade.cpp use it.
  */
 
 #ifndef PWM_H
 #define PWM_H
 
 // Red LED PWM settings.
-void red_pwm_init() {
+inline void red_pwm_init() {
   DDRD   |= (1 << PD6);
   TCCR0A |= (1 << COM0A1); // Compare output mode: PWM
   TCCR0A |= (1 << WGM00);  // Waveform generator: PWM phase correct
@@ -14,7 +15,7 @@ void red_pwm_init() {
 }
 
 // Green LED PWM settings.
-void green_pwm_init() {
+inline void green_pwm_init() {
   DDRD   |= (1 << PD5);
   TCCR0A |= (1 << COM0B1); // Compare output mode: PWM
   TCCR0A |= (1 << WGM00);  // Waveform generator: PWM phase correct
@@ -22,7 +23,7 @@ void green_pwm_init() {
 }
 
 // Blue LED PWM settings.
-void blue_pwm_init() {
+inline void blue_pwm_init() {
   DDRB   |= (1 << PB1); 
   TCCR1A |= (1 << COM1A1); // Compare output mode: PWM
   TCCR1A |= (1 << WGM10);  // PWM, Phase Correct, 8-bit
@@ -30,7 +31,7 @@ void blue_pwm_init() {
 }
 
 // Setup all three LEDs
-void pwm_init() {
+inline void pwm_init() {
   red_pwm_init();
   green_pwm_init();
   blue_pwm_init();
@@ -23,6 +23,16 @@ extern qt_touch_lib_config_data_t qt_config_data;
 /* touch output - measurement data */
 extern qt_touch_lib_measure_data_t qt_measure_data;
 
+/*----------------------------------------------------------------------------
+                                static variables
+----------------------------------------------------------------------------*/
+
+// When the next background measurement starts
+static uint16_t next_measure_time = 0u;
+
+// The library needs another burst to finish the current measurement
+static uint8_t measure_burst_again = 0u;
+
 /*============================================================================
  * Initialize the QTouch library
  *============================================================================*/
@@ -36,6 +46,9 @@ void touch_init( uint8_t detect_threshold ) {
 
   /*  Set the parameters like recalibration threshold, Max_On_Duration etc in this function by the user */
   qt_set_parameters();
+
+  /* drift and max on duration timing are based on how often we measure */
+  qt_measurement_period_msec = TOUCH_MEASURE_PERIOD;
 }
 
 
@@ -73,6 +86,35 @@ uint8_t touch_measure(uint8_t sensor_num, uint16_t current_time) {
   return touch_measure(sensor_num, current_time, 100);
 }
 
+/*============================================================================
+ * Run touch measurements in the background.
+ * A measurement is started every TOUCH_MEASURE_PERIOD milliseconds, and each
+ * call only does a single burst, so the program loop is never held up for long.
+ *   + current_time: The current time, in milliseconds
+ *
+ * Returns 1 when a measurement has finished, and the sensor states are updated.
+ *============================================================================*/
+uint8_t touch_run(uint16_t current_time) {
+  if (!measure_burst_again) {
+    if ((int16_t)(current_time - next_measure_time) < 0) {
+      return 0;
+    }
+    next_measure_time = current_time + TOUCH_MEASURE_PERIOD;
+  }
+
+  // Disable all pull-ups
+  uint8_t mcuRegister = MCUCR;
+  MCUCR |= (1 << PUD);
+
+  uint16_t status_flag = qt_measure_sensors( current_time );
+  measure_burst_again = (status_flag & QTLIB_BURST_AGAIN) ? 1 : 0;
+
+  // Reset pull-ups
+  MCUCR = mcuRegister;
+
+  return !measure_burst_again;
+}
+
 
 /*============================================================================
  * Set the QTouch detection parameters and threshold values.
@@ -2,6 +2,11 @@
 #ifndef TOUCH_CONTROL_H
 #define TOUCH_CONTROL_H
 
+// How often touch measurements are started in the background, in milliseconds
+#ifndef TOUCH_MEASURE_PERIOD
+#define TOUCH_MEASURE_PERIOD 10
+#endif
+
 // Get the state of a single sensor
 #define GET_SENSOR_STATE(SENSOR_NUMBER) qt_measure_data.qt_touch_status.sensor_states[(SENSOR_NUMBER/8)] & (1 << (SENSOR_NUMBER % 8))
 
@@ -12,6 +17,10 @@ void touch_init( uint8_t detect_threshold );
 uint8_t touch_measure(uint8_t sensor_num, uint16_t current_time);
 uint8_t touch_measure(uint8_t sensor_num, uint16_t current_time, uint8_t max_measurements);
 
+// Continue the background touch measurements, one burst at a time.
+// Call this from the program loop. Returns 1 when a measurement has finished.
+uint8_t touch_run(uint16_t current_time);
+
 // Assign the parameters values to global configuration parameter structure
 static void qt_set_parameters( void );
 
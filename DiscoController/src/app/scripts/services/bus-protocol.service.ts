@@ -32,11 +32,40 @@
  *  bus.endMessage();
  * ```
  * 
+ * SENDING DATA TO ONLY SOME NODES
+ * ===============================
+ * A delta batch message starts with a bitmap of the nodes that it has data for,
+ * and then only includes data for those nodes.
+ * ```
+ *  // Only nodes 1 and 3 changed color
+ *  bus.startMessage(CMD_SET_COLOR, 3, {
+ *    batchMode: true,
+ *    changed: [true, false, true]
+ *  });
+ *  bus.sendData([ 0xFF, 0x00, 0x99 ]); // node 1
+ *  bus.sendData([ 0x00, 0x66, 0x20 ]); // node 3
+ *  bus.endMessage();
+ * ```
+ * 
+ * SENDING NIBBLES
+ * ===============
+ * With `nibbles`, the batch data length is per node in nibbles (4 bits),
+ * packed back to back, high nibble first.
+ * ```
+ *  // Palette index for 3 nodes: 1, 5 and 2
+ *  bus.startMessage(CMD_SET_PALETTE_COLOR, 1, {
+ *    batchMode: true,
+ *    nibbles: true
+ *  });
+ *  bus.sendData([ 0x15, 0x20 ]);
+ *  bus.endMessage();
+ * ```
+ * 
  * ASKING FOR A RESPONSE FROM ALL NODES
  * ====================================
  * ```
  *  // Get the sensor value
- *  const CMD_GET_VALUE = 0xA2;
+ *  const CMD_GET_VALUE = 0xA3;
  *  let source = bus.startMessage(CMD_GET_VALUE, 1, {
  *    batchMode: true,
  *    responseDefault: [0]
@@ -50,6 +79,23 @@
  *  )
  * ```
  * 
+ * SENDING DATA AND GETTING RESPONSES IN ONE MESSAGE
+ * ================================================
+ * An exchange message sends data to every node, and then each node responds.
+ * ```
+ *  // Set colors and get the sensor values back
+ *  const CMD_SET_COLOR_GET_SENSOR = 0xA8;
+ *  let source = bus.startMessage(CMD_SET_COLOR_GET_SENSOR, 1, {
+ *    batchMode: true,
+ *    responseMsg: true,
+ *    responseDefault: [0],
+ *    exchangeData: [
+ *      [ 0xFF, 0x00, 0x99 ], // node 1
+ *      [ 0x00, 0x66, 0x20 ]  // node 2
+ *    ]
+ *  });
+ * ```
+ * 
  * NOTE ABOUT SUBSCRIBING
  * ======================
  * The observable that is returned is "hot", meaning it has started by the time
@@ -66,21 +112,59 @@ const BROADCAST_ADDRESS = 0;
 const RESPONSE_TIMEOUT = 20;
 const ADDR_RESPONSE_TIMEOUT = 30;
 const MAX_ADDRESS_CORRECTIONS = 10;
+const MIN_RESPONSE_TIMEOUT = 5;     // The shortest response timeout for a node that's been responding
+const LATENCY_TIMEOUT_FACTOR = 4;   // A node's response timeout is its average response latency times this
+const DEAD_NODE_MISSES = 3;         // Response timeouts in a row before a node is considered dead
+const DEAD_NODE_PROBE = 50;         // How many response messages a dead node is skipped for, before it's tried again
 
 // Commands
 export const CMD = {
-  RESET:            0xFA,
-  ADDRESS:          0xFB,
-  NULL:             0xFF,
+  GET_STATS:            0xF7,
+  RESET:                0xFA,
+  ADDRESS:              0xFB,
+  NULL:                 0xFF,
+
+  SET_COLOR:            0xA1,
+  // 0xA2 (RUN_SENSOR) is retired: nodes measure their sensor in the background
+  GET_SENSOR_VALUE:     0xA3,
+  SET_PALETTE:          0xA4,
+  SET_PALETTE_COLOR:    0xA5,
+  SET_COLOR_565:        0xA6,
+  SET_COLOR_444:        0xA7,
+  SET_COLOR_GET_SENSOR: 0xA8,
+  LATCH:                0xA9,
+  FADE_TO:              0xAA,
+  SET_EFFECT:           0xAB,
+  SYNC_TIME:            0xAC,
+  SCHEDULE:             0xAD
+};
 
-  SET_COLOR:        0xA1,
-  RUN_SENSOR:       0xA2,
-  GET_SENSOR_VALUE: 0xA3
+/**
+ * Message framing (see `framing`). The node firmware BUS_FRAMING needs to match.
+ *  + SOM:     Messages start with two 0xFF bytes.
+ *  + STUFFED: Messages start with FRAME_DELIM, which is never sent anywhere else.
+ *             FRAME_DELIM and FRAME_ESC bytes are sent as FRAME_ESC, followed by the
+ *             byte XOR FRAME_ESC_XOR (by master and the nodes).
+ */
+export const FRAMING = {
+  SOM:     0,
+  STUFFED: 1
 };
+const FRAME_DELIM   = 0x7E;
+const FRAME_ESC     = 0x7D;
+const FRAME_ESC_XOR = 0x20;
 
 // Message flags
 const BATCH_MODE   = 0b00000001;
 const RESPONSE_MSG = 0b00000010;
+const DELTA_MODE   = 0b00000100;
+const NIBBLE_MODE  = 0b00001000;
+const EXCHANGE     = 0b00010000;
+const SEGMENT      = 0b00100000;
+const FEC          = 0b01000000;
+
+// The most data per node in an error corrected segment message (see `errorCorrection`)
+const FEC_MAX_LEN = 14;
 
 /**
  * Bus protocol service class
@@ -91,6 +175,10 @@ export class BusProtocolService {
   private _dataLen:number;
   private _fullDataLen:number;
   private _sentLen:number;
+  private _segmentHeader:number;
+  private _segmentCheck:number;
+  private _segmentFec:boolean;
+  private _segmentData:number[];
   private _responseDefault:number[];
   private _responseTimer:any = null;
   private _responseCount:number;
@@ -102,8 +190,15 @@ export class BusProtocolService {
   private _messageObserver:Observer<any>;
   private _addressCorrections:number = 0;
   private _addressing:boolean = false;
+  private _rxEscaped:boolean = false;
+
+  // Response history for each node, by index (see `_skipDeadNodes()`)
+  private _nodeStatus:{latency:number, misses:number, skipped:number}[] = [];
+  private _checkedNode:number;
+  private _responseWaitStart:number;
 
   nodeNum:number = 0;
+  framing:number = FRAMING.SOM;
   messageSubscription:ConnectableObservable<any>;
   messageResponse:any;
 
@@ -139,7 +234,18 @@ export class BusProtocolService {
    *  + batchMode   {boolean}      - True if we're sending data for each node in this one message. 
    *                                 (only for broadcast messages)
    *  + responseMsg {boolean}      - True if we are asking nodes for a response.
+   *  + changed     {boolean[]}    - Delta batch message: Which nodes we're sending data for (by node index).
+   *                                 Only send data for these nodes. (only for batchMode, without responseMsg)
+   *  + nibbles     {boolean}      - The length is in nibbles, instead of bytes. (only for batchMode, without responseMsg)
    *  + responseDefault {number[]} - If a node doesn't response, this is the default response.
+   *  + exchangeData {number[][]}  - Exchange message: Data to send each node (same length for all nodes),
+   *                                 before they respond. (only for batchMode with responseMsg)
+   *  + segments    {boolean}      - Send a CRC-8 check byte after each node's data, so a node can use its data
+   *                                 even when another part of the message was corrupted.
+   *                                 (only for batchMode, without responseMsg, changed or nibbles)
+   *  + errorCorrection {boolean}  - Segment message: Also send an error correction byte after each check byte,
+   *                                 so a node can correct one flipped bit in its data. (only with segments,
+   *                                 for lengths up to 14)
    * 
    * @return {Observable} An rxjs observable object to track the message through completion.
    */
@@ -150,7 +256,12 @@ export class BusProtocolService {
       destination?:number,
       batchMode?:boolean,
       responseMsg?:boolean,
-      responseDefault?:number[]
+      responseDefault?:number[],
+      changed?:boolean[],
+      nibbles?:boolean,
+      exchangeData?:number[][],
+      segments?:boolean,
+      errorCorrection?:boolean
     }={}): Observable<number> {
     this.messageResponse = [];
 
@@ -162,9 +273,11 @@ export class BusProtocolService {
     this._dataLen = length;
     this._fullDataLen = this._dataLen;
     this._responseCount = 0;
+    this._checkedNode = -1;
     this._sentLen = 0;
     this._crc = 0xFFFF;
     this._promiseResolvers = [];
+    this._rxEscaped = false;
 
     // Fill in default response
     if (options.responseMsg) {
@@ -189,6 +302,27 @@ export class BusProtocolService {
     if (options.responseMsg) {
       flags |= RESPONSE_MSG;
     }
+    let delta = (options.batchMode && !options.responseMsg && options.changed);
+    if (delta) {
+      flags |= DELTA_MODE;
+    }
+    let exchange = (options.batchMode && options.responseMsg && options.exchangeData);
+    if (exchange) {
+      flags |= EXCHANGE;
+    }
+    let nibbles = (options.batchMode && !options.responseMsg && options.nibbles);
+    if (nibbles) {
+      flags |= NIBBLE_MODE;
+    }
+    let segments = (options.batchMode && !options.responseMsg && !delta && !nibbles && options.segments && length > 0);
+    if (segments) {
+      flags |= SEGMENT;
+    }
+    this._segmentFec = (segments && options.errorCorrection && length <= FEC_MAX_LEN);
+    if (this._segmentFec) {
+      flags |= FEC;
+    }
+    this._segmentHeader = null;
 
     if (typeof options.destination === 'undefined') {
       options.destination = BROADCAST_ADDRESS;
@@ -205,15 +339,54 @@ export class BusProtocolService {
     if (options.batchMode) {
       data.push(this.nodeNum);
       this._fullDataLen = length * this.nodeNum;
+      if (nibbles) {
+        this._fullDataLen = Math.ceil(this._fullDataLen / 2);
+      }
+    }
+    if (exchange) {
+      data.push(options.exchangeData.length ? options.exchangeData[0].length : 0);
     }
     data.push(length);
 
+    // Segment check bytes start from the CRC-8 of the header
+    if (segments) {
+      this._segmentHeader = data.reduce( (c, val) => this._generateCRC8(c, val), 0);
+    }
+
+    // Exchange data for each node, before the responses
+    if (exchange) {
+      options.exchangeData.forEach( nodeData => data = data.concat(nodeData) );
+    }
+
+    // Delta bitmap, node 1 is the first bit
+    if (delta) {
+      let bitmap = new Array(Math.ceil(this.nodeNum / 8)).fill(0);
+      let changedNum = 0;
+
+      for (let i = 0; i < this.nodeNum; i++) {
+        if (options.changed[i]) {
+          bitmap[Math.floor(i / 8)] |= (1 << (i % 8));
+          changedNum++;
+        }
+      }
+      data = data.concat(bitmap);
+      this._fullDataLen = length * changedNum;
+      if (nibbles) {
+        this._fullDataLen = Math.ceil(this._fullDataLen / 2);
+      }
+    }
+
     // Send
-    this._sendBytes([0xFF, 0xFF], false)
+    this._sendStart();
     this._sendBytes(data);
 
-    // Start response timer
-    if (options.responseMsg && command !== CMD.ADDRESS) {
+    // Start response timer (once the exchange data has been sent)
+    if (exchange) {
+      this._serial.port.drain(() => {
+        this._startResponseTimer();
+      });
+    }
+    else if (options.responseMsg && command !== CMD.ADDRESS) {
       this._startResponseTimer();
     }
 
@@ -240,6 +413,7 @@ export class BusProtocolService {
     this._fullDataLen = 0;
     this._addressing = true;
     this._addressCorrections = 0;
+    this._nodeStatus = [];
     this._promiseResolvers = [];
 
     this._serial.setDaisy(false);
@@ -277,6 +451,7 @@ export class BusProtocolService {
       data = [data];
     }
 
+    let sentLen = this._sentLen;
     this._sentLen += data.length;
     
     if (this._sentLen > this._fullDataLen) {
@@ -284,9 +459,45 @@ export class BusProtocolService {
       return;
     }
     
+    if (this._segmentHeader !== null) {
+      data = this._addSegmentChecks(data, sentLen);
+    }
     this._sendBytes(data);
   }
 
+  /**
+   * Add the check byte after each node's data in a segment message (and the error correction byte).
+   * The check is the CRC-8 of the header, the node's address and its data.
+   * 
+   * @param {number[]} data The data being sent.
+   * @param {number} sentLen How much data was sent before it.
+   * 
+   * @return {number[]} The data with the check bytes.
+   */
+  private _addSegmentChecks(data:number[], sentLen:number): number[] {
+    let out = [];
+    for (let i = 0; i < data.length; i++) {
+      let pos = (sentLen + i) % this._dataLen;
+      if (pos === 0) {
+        let node = Math.floor((sentLen + i) / this._dataLen) + 1;
+        this._segmentCheck = this._generateCRC8(this._segmentHeader, node);
+        this._segmentData = [];
+      }
+
+      out.push(data[i]);
+      this._segmentCheck = this._generateCRC8(this._segmentCheck, data[i]);
+      this._segmentData.push(data[i]);
+
+      if (pos === this._dataLen - 1) {
+        out.push(this._segmentCheck);
+        if (this._segmentFec) {
+          out.push(this._generateFEC(this._segmentData.concat(this._segmentCheck)));
+        }
+      }
+    }
+    return out;
+  }
+
   /**
    * Finish the message by sending the CRC values.
    * 
@@ -304,6 +515,9 @@ export class BusProtocolService {
       }
 
       // Send null message to wrap things up
+      if (this.framing === FRAMING.STUFFED) {
+        this._sendStart();
+      }
       this._crc = 0xFFFF;
       this._sendBytes([
         0x00,     // flags
@@ -362,6 +576,9 @@ export class BusProtocolService {
 
     this._restartResponseTimer();
 
+    data = this._unescape(data);
+    if (!data.length) return;
+
     // Address responses
     if (this._addressing) {
       let addr = data.readUInt8(data.length - 1); // We only care about the final byte
@@ -416,6 +633,9 @@ export class BusProtocolService {
       let fill = this._msgOptions.responseDefault.slice(nodeMsg.length);
 
       console.error('Response timeout for node', index + 1);
+      if (this._msgOptions.batchMode) {
+        this._getNodeStatus(index).misses++;
+      }
 
       // Fill in missing node message data
       if (fill.length > 0) {
@@ -449,6 +669,16 @@ export class BusProtocolService {
       let byte = data.readUInt8(i);
 
       if (n === -1) return; // Response buffer full)
+
+      // The node has started responding
+      if (this.messageResponse[n].length === 0 && this._msgOptions.batchMode) {
+        let status = this._getNodeStatus(n);
+        let latency = Date.now() - this._responseWaitStart;
+
+        status.latency = (status.latency === null) ? latency : (status.latency * 3 + latency) / 4;
+        status.misses = 0;
+      }
+
       this.messageResponse[n].push(byte);
 
       // Full node message, inform the observable 
@@ -511,8 +741,18 @@ export class BusProtocolService {
     if (this._msgDone) return;
 
     // Start timer once data has sent
-    let timeout = (this._addressing) ? ADDR_RESPONSE_TIMEOUT : RESPONSE_TIMEOUT;
     this._serial.port.drain(() => {
+      if (this._msgDone) return;
+
+      // Everything left was from dead nodes
+      if (this._skipDeadNodes()) {
+        this.endMessage();
+        return;
+      }
+
+      let timeout = (this._addressing) ? ADDR_RESPONSE_TIMEOUT : this._getResponseTimeout();
+      this._stopResponseTimer();
+      this._responseWaitStart = Date.now();
       this._responseTimer = setTimeout(() => {
         this._handleResponseTimeout();
       }, timeout); 
@@ -522,6 +762,66 @@ export class BusProtocolService {
     this._startResponseTimer();
   }
 
+  /**
+   * Get the response history for a node (by index)
+   */
+  private _getNodeStatus(index:number): {latency:number, misses:number, skipped:number} {
+    if (!this._nodeStatus[index]) {
+      this._nodeStatus[index] = { latency: null, misses: 0, skipped: 0 };
+    }
+    return this._nodeStatus[index];
+  }
+
+  /**
+   * The response timeout for the node we're waiting on, based on how fast it has responded before.
+   */
+  private _getResponseTimeout(): number {
+    if (!this._msgOptions.batchMode || !this._dataLen) {
+      return RESPONSE_TIMEOUT;
+    }
+
+    let status = this._getNodeStatus(Math.floor(this._responseCount / this._dataLen));
+    if (status.latency === null) {
+      return RESPONSE_TIMEOUT;
+    }
+    return Math.min(RESPONSE_TIMEOUT, Math.max(MIN_RESPONSE_TIMEOUT, Math.ceil(status.latency * LATENCY_TIMEOUT_FACTOR)));
+  }
+
+  /**
+   * In batch response messages, send the default response for dead nodes right away, instead
+   * of waiting for them to timeout. A node is dead after DEAD_NODE_MISSES timeouts in a row,
+   * and is tried again every DEAD_NODE_PROBE messages.
+   * 
+   * @return {boolean} True if all responses have been received.
+   */
+  private _skipDeadNodes(): boolean {
+    let options = this._msgOptions;
+    if (this._addressing || !options.batchMode || !options.responseMsg || !this._dataLen) {
+      return false;
+    }
+
+    // Only check each node once, before it starts responding
+    while (this._responseCount < this._fullDataLen && this._responseCount % this._dataLen === 0) {
+      let index = this._responseCount / this._dataLen;
+      let status = this._getNodeStatus(index);
+
+      if (index === this._checkedNode) break;
+      this._checkedNode = index;
+
+      if (status.misses < DEAD_NODE_MISSES) break;
+      if (++status.skipped >= DEAD_NODE_PROBE) {
+        status.skipped = 0;
+        break;
+      }
+
+      let fill = options.responseDefault.slice(0, this._dataLen);
+      this._pushDataToResponse(Buffer.from(fill));
+      this._sendBytes(fill);
+    }
+
+    return this._responseCount >= this._fullDataLen;
+  }
+
   /**
    * Stop the response timeout
    */
@@ -543,14 +843,14 @@ export class BusProtocolService {
   }
 
   /**
-   * Send multiple bytes to the serial connection and update the CRC value.
+   * Send multiple bytes to the serial connection (escaped, if needed) and update the CRC value.
    * 
    * @param {number[]} values The bytes to send.
    * @param {boolean} updateCRC Set this to false to not update the CRC with this byte
    */
   private _sendBytes(values:number[], updateCRC:boolean=true): void {
     let buff = Buffer.from(values);
-    this._serial.port.write(buff);
+    this._serial.port.write(this._escape(buff));
     
     if (updateCRC) {
       for (let i = 0; i < buff.length; i++) {
@@ -559,6 +859,70 @@ export class BusProtocolService {
     }
   }
 
+  /**
+   * Send the start of a message: two 0xFF bytes, or the frame delimiter (see FRAMING).
+   * These are not part of the CRC.
+   */
+  private _sendStart(): void {
+    if (this.framing === FRAMING.STUFFED) {
+      this._serial.port.write(Buffer.from([FRAME_DELIM]));
+    } else {
+      this._sendBytes([0xFF, 0xFF], false);
+    }
+  }
+
+  /**
+   * Escape the bytes that can't be sent as they are (FRAMING.STUFFED).
+   * 
+   * @param {Buffer} data The bytes to send.
+   * 
+   * @return {Buffer}
+   */
+  private _escape(data:Buffer): Buffer {
+    if (this.framing !== FRAMING.STUFFED) return data;
+
+    let escaped = [];
+    for (let i = 0; i < data.length; i++) {
+      let byte = data.readUInt8(i);
+      if (byte === FRAME_DELIM || byte === FRAME_ESC) {
+        escaped.push(FRAME_ESC, byte ^ FRAME_ESC_XOR);
+      } else {
+        escaped.push(byte);
+      }
+    }
+    return Buffer.from(escaped);
+  }
+
+  /**
+   * Remove the escapes from received bytes (FRAMING.STUFFED). 
+   * An escape at the end of `data` applies to the first byte of the next data received.
+   * 
+   * @param {Buffer} data The bytes received.
+   * 
+   * @return {Buffer}
+   */
+  private _unescape(data:Buffer): Buffer {
+    if (this.framing !== FRAMING.STUFFED) return data;
+
+    let unescaped = [];
+    for (let i = 0; i < data.length; i++) {
+      let byte = data.readUInt8(i);
+
+      if (byte === FRAME_ESC) {
+        this._rxEscaped = true;
+      }
+      // Not expected from a node, so there's no data in it
+      else if (byte === FRAME_DELIM) {
+        this._rxEscaped = false;
+      }
+      else {
+        unescaped.push(this._rxEscaped ? byte ^ FRAME_ESC_XOR : byte);
+        this._rxEscaped = false;
+      }
+    }
+    return Buffer.from(unescaped);
+  }
+
   /**
    * Generate a 16-bit CRC number.
    * 
@@ -609,6 +973,62 @@ export class BusProtocolService {
     return crc;
   }
 
+  /**
+   * Generate an 8-bit CRC (CCITT, polynomial 0x07), for segment messages.
+   * 
+   * @param {number} crc Existing CRC
+   * @param {number} value The new byte to add to the CRC.
+   * 
+   * @return {number} An 8-bit CRC.
+   */
+  private _generateCRC8(crc:number, value:number): number {
+    crc ^= value;
+    for (let i = 0; i < 8; ++i) {
+      if (crc & 0x80)
+        crc = ((crc << 1) ^ 0x07) & 0xFF;
+      else
+        crc = (crc << 1) & 0xFF;
+    }
+    return crc;
+  }
+
+  /**
+   * Generate the error correction byte for a node's data and check byte (segment messages
+   * with `errorCorrection`): an extended Hamming code, the same as the node firmware's.
+   * Each bit gets a column (the numbers from 3 up, skipping the powers of two) and the low
+   * 7 bits are the columns of the bits that are set, XORed together. The high bit makes
+   * the parity of everything even.
+   * 
+   * @param {number[]} values The bytes to protect.
+   * 
+   * @return {number} The error correction byte.
+   */
+  private _generateFEC(values:number[]): number {
+    let code = 0;
+    let parity = 0;
+    let column = 3;
+
+    values.forEach( value => {
+      parity ^= value;
+      for (let i = 0; i < 8; i++) {
+        if (value & (1 << i)) {
+          code ^= column;
+        }
+        column++;
+        if ((column & (column - 1)) === 0) {
+          column++;
+        }
+      }
+    });
+
+    code &= 0x7F;
+    parity ^= code;
+    parity ^= parity >> 4;
+    parity ^= parity >> 2;
+    parity ^= parity >> 1;
+    return (parity & 1) ? code | 0x80 : code;
+  }
+
   /**
    * Split a 16-bit number into two 8-bit numbers.
    * 
@@ -25,26 +25,92 @@ import { Inject, Injectable } from '@angular/core';
 import { Observable, Observer } from 'rxjs';
 
 import { FloorCell } from '../../../shared/floor-cell';
-import { BusProtocolService, CMD } from './bus-protocol.service';
+import { NodeEffect, encodeEffect } from '../../../shared/node-effect';
+import { BusProtocolService, CMD, FRAMING as BUS_FRAMING } from './bus-protocol.service';
 import { FloorBuilderService } from './floor-builder.service';
 import { StorageService } from '../services/storage.service';
 
-const BAUD_RATE       = 250000;
+const BAUD_RATE       = 250000; // Must match BUS_BAUD in the node firmware
+const FRAMING         = BUS_FRAMING.SOM; // Must match BUS_FRAMING in the node firmware
 const CMD_LOOP_DELAY  = 1;    // Milliseconds between commands
-const SENSOR_DELAY    = 20;   // Delay after the sensor check command (milliseconds)
+const STATS_LEN       = 12;   // Length of each node's GET_STATS response
+const FULL_COLOR_INTERVAL = 30; // Send every node's color at least this often (frames), in case a node missed a change
+const PALETTE_SIZE    = 16;   // Must match PALETTE_SIZE in the node firmware (a nibble can index up to 16)
+const PALETTE_CHUNK   = 3;    // Palette colors per SET_PALETTE message (fits in the node's data buffer)
+const MAX_FADE_DURATION = 0xFFFF; // Longest FADE_TO duration, in milliseconds
+const EFFECT_DATA_LEN = 11;   // Length of the SET_EFFECT data (see encodeEffect)
+const NO_COLOR        = [-1, -1, -1]; // Sent color for cells running an effect, so any color after it is sent
+const TIME_SYNC_INTERVAL = 5000; // How often the node clocks are synced to `floorTime()` (milliseconds)
+
+/**
+ * Batch color encodings (see `colorFormat`)
+ *  + rgb:    8 bits per channel (3 bytes per node)
+ *  + rgb565: 5 bits red, 6 bits green, 5 bits blue (2 bytes per node)
+ *  + rgb444: 4 bits per channel (3 nibbles per node)
+ */
+const COLOR_FORMATS = {
+  rgb: {
+    command: CMD.SET_COLOR,
+    length: 3,
+    nibbles: false,
+    encode: (c:number[]) => c
+  },
+  rgb565: {
+    command: CMD.SET_COLOR_565,
+    length: 2,
+    nibbles: false,
+    encode: (c:number[]) => {
+      let value = ((c[0] >> 3) << 11) | ((c[1] >> 2) << 5) | (c[2] >> 3);
+      return [value >> 8, value & 0xFF];
+    }
+  },
+  rgb444: {
+    command: CMD.SET_COLOR_444,
+    length: 3,
+    nibbles: true,
+    encode: (c:number[]) => [c[0] >> 4, c[1] >> 4, c[2] >> 4]
+  }
+};
+
+/**
+ * Error and message counters reported by a node (see `getNodeStats()`).
+ * Each counter is 16-bit and wraps.
+ */
+export interface NodeStats {
+  framingErrors:number;
+  overrunErrors:number;
+  droppedBytes:number;
+  crcErrors:number;
+  messages:number;
+  correctedBits:number; // Bit errors corrected in error corrected segment messages
+}
 
 @Injectable()
 export class CommunicationService {
 
   port: any;
   sensorsEnabled:boolean = true;
+  sensorExchange:boolean = true; // Send colors and read sensors in one message (see `run()`)
+  latchColors:boolean = true;    // Nodes hold new colors until they're all sent, then show them together
+  colorFormat:string = 'rgb'; // Color encoding to use, when the palette can't be (see COLOR_FORMATS)
+  nodeFades:boolean = true;   // Cell fades are run by the nodes, instead of sending every step
 
   private _fps:number[] = [0, 0, 0, 0];
   private _frames:number = 0;
   private _serialPortLib:any;
   private _running:boolean = false;
   private _runIteration:number = 0;
-  private _sensorSelect:number = 1;
+  private _statsRequests:{resolve:Function, reject:Function}[] = [];
+  private _sentColors:number[][] = [];
+  private _colorFrame:number = 0;
+  private _palette:number[] = []; // Colors uploaded to the node palettes (as 24-bit numbers), by index
+  private _colorsSent:boolean = false; // New colors were sent this frame
+  private _nodesLatched:boolean = false; // Nodes are in latch mode
+  private _sensorsExchanged:boolean = false; // Sensor values were read with the colors this frame
+  private _sentEffects:NodeEffect[] = [];
+  private _clockStart:number = Date.now();
+  private _lastTimeSync:number = 0;
+  private _scheduled:{time:number, command:number, length:number, data:number[], options:any, resolve:Function, reject:Function}[] = [];
   
   bus:BusProtocolService;
 
@@ -52,6 +118,7 @@ export class CommunicationService {
     @Inject(FloorBuilderService) private _floorBuilder:FloorBuilderService,
     @Inject(StorageService) private _storage:StorageService) {
     this.bus = new BusProtocolService(this);
+    this.bus.framing = FRAMING;
 
     this._floorBuilder.setComm(this);
 
@@ -211,11 +278,22 @@ export class CommunicationService {
   /**
    * Run looping communications with the floor.
    *  1. Send floor colors to all nodes.
-   *  2. Request nodes check their touch sensors.
-   *  3. (short delay)
-   *  4. Request sensor data.
+   *  2. Latch the colors, so all nodes show them at once.
+   *  3. Request sensor data (nodes measure their sensors continuously).
+   *  4. Sync the node clocks (every TIME_SYNC_INTERVAL) and send scheduled messages.
    *  5. continue from step 1
    * 
+   * With `sensorExchange`, steps 1 and 3 are a single message: the colors are sent to all nodes,
+   * and each node responds with its sensor value.
+   * 
+   * With `latchColors`, nodes keep showing the last frame while the next one is being sent.
+   * 
+   * With `nodeFades`, cells that are fading are sent a single FADE_TO message and the node
+   * does the fade itself, instead of being sent a new color every frame. Cells running an
+   * effect (see `FloorCell.runEffect()`) are sent a single SET_EFFECT message.
+   * Exchange messages would send over these, so sensors are read on their own while
+   * any node is fading or running an effect.
+   * 
    * @param {boolean} addressing Start the communications by dynamically addressing all floor nodes.
    */
   run(): void {
@@ -223,6 +301,11 @@ export class CommunicationService {
 
     this._running = true;
     this._runIteration = 0;
+    this._sentColors = [];
+    this._palette = [];
+    this._nodesLatched = false;
+    this._sentEffects = [];
+    this._lastTimeSync = 0;
     this._runThread();
 
     // Frame per second counter
@@ -249,6 +332,56 @@ export class CommunicationService {
     return Math.round(sum / this._fps.length);
   }
 
+  /**
+   * The floor's time, in milliseconds. Node clocks are synced to this while the
+   * run loop is running, so their effects stay in step (see `scheduleMessage()`).
+   * This is 32-bit, like the node clocks, and wraps.
+   */
+  floorTime(): number {
+    return (Date.now() - this._clockStart) >>> 0;
+  }
+
+  /**
+   * Send a message that the nodes will hold, and act on at a floor time (see `floorTime()`),
+   * so they all change together (i.e. start an effect on every node at the same time).
+   * If the run loop is running, the message is sent at the end of the current frame.
+   * 
+   * NOTE: the floor cells aren't updated with what the message does.
+   * 
+   * @param {number} time The floor time for the nodes to act on the message
+   * @param {number} command The message command
+   * @param {number} length The data length (per node, for batch messages)
+   * @param {number[]} data The message data
+   * @param {Object} options Message options (see `BusProtocolService.startMessage()`), without responses
+   * 
+   * @return {Promise} A promise that resolves when the message has been sent
+   */
+  scheduleMessage(time:number, command:number, length:number, data:number[], options:any={}): Promise<void> {
+    return new Promise<void> ( (resolve, reject) => {
+      this._scheduled.push({ time, command, length, data, options, resolve, reject });
+
+      if (!this._running) {
+        this._sendTimeMessages().subscribe(null, (err) => console.error(err));
+      }
+    });
+  }
+
+  /**
+   * Collect the error and message counters from all nodes, in a single batch response message.
+   * If the run loop is running, the message is sent at the end of the current frame.
+   * 
+   * @return {Promise} A promise to an array of stats for each node (`null` for nodes that didn't respond)
+   */
+  getNodeStats(): Promise<NodeStats[]> {
+    return new Promise<NodeStats[]> ( (resolve, reject) => {
+      this._statsRequests.push({ resolve, reject });
+
+      if (!this._running) {
+        this._readStats();
+      }
+    });
+  }
+
   /**
    * Dynamically address all floor cells.
    * 
@@ -345,17 +478,35 @@ export class CommunicationService {
 
     switch (this._runIteration) {
       case 0: // Colors
+        this._colorsSent = true;
+        this._sensorsExchanged = (this.sensorsEnabled && this.sensorExchange && !this._nodesAnimating());
+        if (this._sensorsExchanged) {
+          subject = this._exchangeColorsAndSensors();
+          break;
+        }
         subject = this._sendColors();
+        if (!subject) { // Nothing changed
+          this._colorsSent = false;
+          return runNext(0);
+        }
         break;
-      case 1: // Run sensors
-        if (!this.sensorsEnabled) return runNext(10);
-        subject = this._runSensors();
-        nextDelay = SENSOR_DELAY;
+      case 1: // Show the new colors
+        subject = this._latchColors();
+        if (!subject) return runNext(0);
         break;
       case 2: // Get sensor data
         if (!this.sensorsEnabled) return runNext(10);
+        if (this._sensorsExchanged) return runNext(0);
         subject = this._readSensorData();
         break;
+      case 3: // Node stats, if requested
+        if (!this._statsRequests.length) return runNext(0);
+        subject = this._readStats();
+        break;
+      case 4: // Node clocks and scheduled messages
+        subject = this._sendTimeMessages();
+        if (!subject) return runNext(0);
+        break;
       
       // Loop back to the start
       default:
@@ -400,6 +551,7 @@ export class CommunicationService {
 
     switch (this.bus.messageCommand) {
       case CMD.GET_SENSOR_VALUE:
+      case CMD.SET_COLOR_GET_SENSOR:
         let val = data[0];
 
         if (val === 0 || val === 1) { // verify it's a valid value
@@ -410,37 +562,393 @@ export class CommunicationService {
   }
 
   /**
-   * Send RGB colors to all cells
+   * Send colors to all cells.
+   * Only changed colors are sent (as a delta message), with a full frame every FULL_COLOR_INTERVAL frames.
+   * When the floor has PALETTE_SIZE colors or less, they are uploaded to the node palettes
+   * and each cell is sent a 4-bit palette index, instead of RGB (if that's smaller).
+   * With `nodeFades`, fading cells are sent their fade instead (see `_sendFades()`),
+   * and cells running an effect are sent that (see `_sendEffects()`).
+   * Returns null if nothing changed.
    */
   private _sendColors(): Observable<any> {
-    this.bus.startMessage(CMD.SET_COLOR, 3, { batchMode: true });
+    let cellList = this._floorBuilder.cellList;
+    let fullFrame = (this._colorFrame++ % FULL_COLOR_INTERVAL === 0 || this._sentColors.length !== cellList.length);
+
+    // Fading cells count as their target color, so they're only sent again when it changes
+    let effects = cellList.map( cell => cell.effect );
+    let fading = cellList.map( (cell, i) => this.nodeFades && cell.isFading && !effects[i] );
+    let colors = cellList.map( (cell, i) => (effects[i]) ? NO_COLOR : (fading[i]) ? cell.fadeTarget : cell.color );
+
+    // Which colors changed since the last frame
+    let changed = colors.map( (color, i) => {
+      let sent = this._sentColors[i];
+      return fullFrame || color[0] !== sent[0] || color[1] !== sent[1] || color[2] !== sent[2];
+    });
+    this._sentColors = colors;
+
+    // Fades and effects go first, and the nodes running them are left out of the colors
+    let updates = [
+      this._sendEffects(effects, fullFrame),
+      this._sendFades(changed.map( (c, i) => c && fading[i] ))
+    ].filter( message => message !== null );
+
+    let held = cellList.map( (cell, i) => fading[i] || !!effects[i] );
+    let anyHeld = held.some( h => h );
+    changed = changed.map( (c, i) => c && !held[i] );
+    let changedNum = changed.filter( c => c ).length;
+
+    if (changedNum === 0) {
+      return (updates.length) ? Observable.concat(...updates) : null;
+    }
+
+    // Only send the changed colors, unless the bitmap would make it bigger
+    // (held cells have to be left out, or their fade or effect would stop)
+    let format = COLOR_FORMATS[this.colorFormat] || COLOR_FORMATS['rgb'];
+    let byteLen = (num) => (format.nibbles) ? Math.ceil(num * format.length / 2) : num * format.length;
+    let bitmapLen = Math.ceil(colors.length / 8);
+    let delta = anyHeld || (byteLen(changedNum) + bitmapLen < byteLen(colors.length));
+    let colorLen = (delta) ? byteLen(changedNum) + bitmapLen : byteLen(colors.length);
+    let withUpdates = (message:Observable<any>) => Observable.concat(...updates, message);
+
+    // Palette indexes
+    let palette = this._updatePalette(colors.map( (c, i) => (held[i]) ? null : c ), fullFrame);
+    if (palette) {
+      let indexDelta = anyHeld || (Math.ceil(changedNum / 2) + bitmapLen < Math.ceil(colors.length / 2));
+      let indexLen = (indexDelta) ? Math.ceil(changedNum / 2) + bitmapLen : Math.ceil(colors.length / 2);
+
+      if (palette.uploadLen + indexLen < colorLen) {
+        let messages = palette.uploads.map( upload => Observable.defer(() => {
+          this.bus.startMessage(CMD.SET_PALETTE, upload.length);
+          this.bus.sendData(upload);
+          return this.bus.endMessage();
+        }));
+
+        messages.push(Observable.defer(() => {
+          this.bus.startMessage(CMD.SET_PALETTE_COLOR, 1, {
+            batchMode: true,
+            nibbles: true,
+            changed: (indexDelta) ? changed : undefined
+          });
+
+          let indexes = palette.indexes.filter( (index, i) => !indexDelta || changed[i] );
+          this.bus.sendData(this._packNibbles(indexes));
+          return this.bus.endMessage();
+        }));
+
+        return withUpdates(Observable.concat(...messages));
+      }
+    }
+
+    return withUpdates(Observable.defer(() => {
+      this.bus.startMessage(format.command, format.length, {
+        batchMode: true,
+        nibbles: format.nibbles,
+        changed: (delta) ? changed : undefined
+      });
+
+      let data = [];
+      colors.forEach( (color, i) => {
+        if (!delta || changed[i]) {
+          data = data.concat(format.encode(color));
+        }
+      });
+      if (format.nibbles) {
+        data = this._packNibbles(data);
+      }
+      this.bus.sendData(data);
+
+      return this.bus.endMessage();
+    }));
+  }
+
+  /**
+   * Start effects on the nodes whose cell effect changed (or all of them, on full frames).
+   * When every node gets the same effect, it's sent as a single broadcast SET_EFFECT message,
+   * otherwise as a batch message with the effect for each of those nodes.
+   * Returns null if there are no effects to send.
+   *
+   * @param {NodeEffect[]} effects The effect for each cell (by index), or null
+   * @param {boolean} fullFrame Send all effects, even if they haven't changed
+   */
+  private _sendEffects(effects:NodeEffect[], fullFrame:boolean): Observable<any> {
+    let send = effects.map( (effect, i) => !!effect && (fullFrame || effect !== this._sentEffects[i]) );
+    let sendNum = send.filter( s => s ).length;
+    this._sentEffects = effects;
+
+    if (sendNum === 0) {
+      return null;
+    }
+
+    let data = effects.map( effect => (effect) ? encodeEffect(effect) : null );
+    let broadcast = (sendNum === effects.length && data.every( d => d.join() === data[0].join() ));
+
+    return Observable.defer(() => {
+      if (broadcast) {
+        this.bus.startMessage(CMD.SET_EFFECT, EFFECT_DATA_LEN);
+        this.bus.sendData(data[0]);
+        return this.bus.endMessage();
+      }
+
+      this.bus.startMessage(CMD.SET_EFFECT, EFFECT_DATA_LEN, {
+        batchMode: true,
+        changed: (sendNum < effects.length) ? send : undefined
+      });
+      data.forEach( (d, i) => {
+        if (send[i]) {
+          this.bus.sendData(d);
+        }
+      });
+      return this.bus.endMessage();
+    });
+  }
 
+  /**
+   * Are any nodes fading or running effects on their own.
+   */
+  private _nodesAnimating(): boolean {
     for (let cell of this._floorBuilder.cellList) {
-      let color = cell.color;
-      this.bus.sendData(color);
+      if (cell.effect || (this.nodeFades && cell.isFading)) {
+        return true;
+      }
     }
+    return false;
+  }
 
-    return this.bus.endMessage();
+  /**
+   * Start fades on the nodes, with a batch FADE_TO message: the target color
+   * and the time left in the fade (2 bytes, MSB first) for each cell.
+   * Returns null if there are no fades to send.
+   *
+   * @param {boolean[]} send Which cells to send (by index)
+   */
+  private _sendFades(send:boolean[]): Observable<any> {
+    let sendNum = send.filter( s => s ).length;
+    if (sendNum === 0) {
+      return null;
+    }
+
+    return Observable.defer(() => {
+      let cellList = this._floorBuilder.cellList;
+      let delta = (sendNum < cellList.length);
+      let data = [];
+
+      this.bus.startMessage(CMD.FADE_TO, 5, {
+        batchMode: true,
+        changed: (delta) ? send : undefined
+      });
+
+      send.forEach( (s, i) => {
+        if (!s) return;
+        let cell = cellList.atIndex(i);
+        let color = cell.fadeTarget;
+        let duration = Math.min(Math.round(cell.fadeRemaining), MAX_FADE_DURATION);
+        data.push(color[0], color[1], color[2], duration >> 8, duration & 0xFF);
+      });
+      this.bus.sendData(data);
+
+      return this.bus.endMessage();
+    });
   }
 
   /**
-   * Ask all nodes to check their touch sensors.
+   * Pack a list of nibbles into bytes, high nibble first.
    */
-  private _runSensors(): Observable<any> {
-    this.bus.startMessage(CMD.RUN_SENSOR, 1, { batchMode: true });
-
-    // Only ask half the cells checking their sensors at a time
-    // this will hopefully prevent as much parasitic capacitance
-    let even = (this._sensorSelect > 0);
-    for (let i = 0; i < this.bus.nodeNum; i++) {
-      let val = (i % 2 == 0 && even) ? 1 : 0;
-      this.bus.sendData(val);
+  private _packNibbles(nibbles:number[]): number[] {
+    let data = [];
+    nibbles.forEach( (nibble, i) => {
+      if (i % 2 === 0) {
+        data.push((nibble & 0x0F) << 4);
+      } else {
+        data[data.length - 1] |= (nibble & 0x0F);
+      }
+    });
+    return data;
+  }
+
+  /**
+   * Fit the colors into the node palettes, if there are PALETTE_SIZE colors or less.
+   * Colors that are already in the palette keep their index, and new colors take the
+   * place of ones that are no longer used. On full frames, the entire palette is uploaded again.
+   * Null colors are left out (their index is -1).
+   * 
+   * @return {Object} Null, if the colors don't fit, otherwise:
+   *  + indexes   {number[]}   - The palette index for each cell.
+   *  + uploads   {number[][]} - SET_PALETTE message data to send, before the indexes (first index, then RGB colors).
+   *  + uploadLen {number}     - Rough number of bytes it will take to send the uploads.
+   */
+  private _updatePalette(colors:number[][], fullFrame:boolean): { indexes:number[], uploads:number[][], uploadLen:number } {
+    let values = colors.map( c => (c) ? (c[0] << 16) | (c[1] << 8) | c[2] : null );
+    let used = {};
+    let usedNum = 0;
+
+    values.forEach( v => {
+      if (v !== null && !used[v]) {
+        used[v] = true;
+        usedNum++;
+      }
+    });
+    if (usedNum > PALETTE_SIZE) {
+      return null;
     }
-    this._sensorSelect *= -1;
 
+    // Free the palette entries that are no longer used, and fill them with the new colors
+    let palette = this._palette.map( v => (v !== null && used[v]) ? v : null );
+    let changedSlots = [];
+    Object.keys(used).forEach( key => {
+      let v = parseInt(key, 10);
+      if (palette.indexOf(v) === -1) {
+        let slot = palette.indexOf(null);
+        if (slot === -1) {
+          slot = palette.length;
+        }
+        palette[slot] = v;
+        changedSlots.push(slot);
+      }
+    });
+    this._palette = palette;
+
+    if (fullFrame) {
+      changedSlots = palette.map( (v, i) => i ).filter( i => palette[i] !== null );
+    }
+    changedSlots.sort( (a, b) => a - b );
+
+    // Group runs of up to PALETTE_CHUNK neighboring entries into messages
+    let uploads = [];
+    let uploadLen = 0;
+    let upload;
+    changedSlots.forEach( slot => {
+      if (!upload || upload[0] + (upload.length - 1) / 3 !== slot || upload.length >= 1 + PALETTE_CHUNK * 3) {
+        upload = [slot];
+        uploads.push(upload);
+        uploadLen += 10; // Message overhead (start, header and CRC)
+      }
+      let v = palette[slot];
+      upload.push((v >> 16) & 0xFF, (v >> 8) & 0xFF, v & 0xFF);
+      uploadLen += 3;
+    });
+
+    return {
+      indexes: values.map( v => (v !== null) ? palette.indexOf(v) : -1 ),
+      uploads: uploads,
+      uploadLen: uploadLen
+    };
+  }
+
+  /**
+   * Have all nodes show the colors that were just sent, at the same time.
+   * When `latchColors` is turned off, this takes the nodes out of latch mode.
+   * Returns null if there's nothing to do.
+   */
+  private _latchColors(): Observable<any> {
+    if (!this._colorsSent || (!this.latchColors && !this._nodesLatched)) {
+      return null;
+    }
+
+    this._nodesLatched = this.latchColors;
+    if (this.latchColors) {
+      this.bus.startMessage(CMD.LATCH, 0);
+    } else {
+      this.bus.startMessage(CMD.LATCH, 1);
+      this.bus.sendData([0]);
+    }
     return this.bus.endMessage();
   }
 
+  /**
+   * Send RGB colors to all cells and get their sensor values back, in one exchange message.
+   */
+  private _exchangeColorsAndSensors(): Observable<any> {
+    let colors = this._floorBuilder.cellList.map( cell => cell.color );
+    this._sentColors = colors;
+    this._sentEffects = [];
+
+    return this.bus.startMessage(CMD.SET_COLOR_GET_SENSOR, 1, {
+      batchMode: true,
+      responseMsg: true,
+      responseDefault: [0xFF],
+      exchangeData: colors.map( c => [c[0], c[1], c[2]] )
+    });
+  }
+
+  /**
+   * Get the error and message counters from all nodes and resolve
+   * the pending `getNodeStats()` requests.
+   */
+  private _readStats(): Observable<any> {
+    let requests = this._statsRequests;
+    this._statsRequests = [];
+
+    let subject = this.bus.startMessage(CMD.GET_STATS, STATS_LEN, {
+      batchMode: true,
+      responseMsg: true,
+      responseDefault: new Array(STATS_LEN).fill(0xFF)
+    });
+
+    subject.subscribe(
+      null,
+      (err) => requests.forEach( r => r.reject(err) ),
+      () => {
+        let stats = this.bus.messageResponse.map( (data:number[]) => {
+          if (data.every( b => b === 0xFF )) {
+            return null; // no response
+          }
+          let counter = (i) => (data[i * 2] << 8) | data[i * 2 + 1];
+          return {
+            framingErrors: counter(0),
+            overrunErrors: counter(1),
+            droppedBytes:  counter(2),
+            crcErrors:     counter(3),
+            messages:      counter(4),
+            correctedBits: counter(5)
+          };
+        });
+        requests.forEach( r => r.resolve(stats) );
+      }
+    );
+    return subject;
+  }
+
+  /**
+   * Sync the node clocks, if it's been TIME_SYNC_INTERVAL since the last time, and send
+   * the scheduled messages, each after a SCHEDULE message with its time.
+   * The clocks are synced with a broadcast SYNC_TIME message: each node sets its clock
+   * to the time as of the last byte of the message, so they all match to within a byte.
+   * Returns null if there's nothing to send.
+   */
+  private _sendTimeMessages(): Observable<any> {
+    let messages:Observable<any>[] = [];
+    let time32 = (t) => [(t >>> 24) & 0xFF, (t >> 16) & 0xFF, (t >> 8) & 0xFF, t & 0xFF];
+
+    if (Date.now() - this._lastTimeSync >= TIME_SYNC_INTERVAL) {
+      messages.push(Observable.defer(() => {
+        this._lastTimeSync = Date.now();
+        this.bus.startMessage(CMD.SYNC_TIME, 4);
+        this.bus.sendData(time32(this.floorTime()));
+        return this.bus.endMessage();
+      }));
+    }
+
+    let scheduled = this._scheduled;
+    this._scheduled = [];
+    scheduled.forEach( s => {
+      messages.push(Observable.defer(() => {
+        this.bus.startMessage(CMD.SCHEDULE, 4);
+        this.bus.sendData(time32(s.time >>> 0));
+        return this.bus.endMessage();
+      }));
+      messages.push(Observable.defer(() => {
+        this.bus.startMessage(s.command, s.length, s.options);
+        this.bus.sendData(s.data);
+
+        let subject = this.bus.endMessage();
+        subject.subscribe(null, (err) => s.reject(err), () => s.resolve());
+        return subject;
+      }));
+    });
+
+    return (messages.length) ? Observable.concat(...messages) : null;
+  }
+
   /**
    * Get the sensor data from all nodes
    */
@@ -49,6 +49,17 @@ export class FadeController {
     }
   }
 
+  /**
+   * Get the number of milliseconds left in the fade (0 when not fading).
+   */
+  get remaining(): number {
+    if (!this.isFading) {
+      return 0;
+    }
+    let elapsed = (new Date()).getTime() - this._lastFade;
+    return Math.max(0, this._duration - elapsed);
+  }
+
   /**
    * Get the color at the current fade increment.
    *
@@ -37,6 +37,7 @@
  */
 
 import { FloorCell } from './floor-cell';
+import { NodeEffect } from './node-effect';
 
 export class FloorCellList implements Iterable<FloorCell> {
 
@@ -115,6 +116,13 @@ export class FloorCellList implements Iterable<FloorCell> {
     return this._cells.filter( (cell:FloorCell) => cell.sensorValue === true );
   }
 
+  /**
+   * Call a function for every cell, in index order, and return the results.
+   */
+  map<T>(callback: (cell:FloorCell, index:number) => T): T[] {
+    return this._cells.map(callback);
+  }
+
   /**
    * Set a solid, unfading, color for all cells.
    *
@@ -142,6 +150,17 @@ export class FloorCellList implements Iterable<FloorCell> {
     return fadePromise;
   }
 
+  /**
+   * Run the same effect on all cells' nodes (see FloorCell.runEffect).
+   *
+   * @param {NodeEffect} effect The effect to run.
+   */
+  runEffect(effect: NodeEffect): void {
+    for (let cell of this._cells) {
+      cell.runEffect(effect);
+    }
+  }
+
   /**
    * If the fading color for all cells.
    */
@@ -3,6 +3,7 @@ import { Subject } from 'rxjs/Subject';
 import { Observable } from 'rxjs/Observable';
 
 import { FadeController } from './fade-controller';
+import { NodeEffect } from './node-effect';
 
 /**
  * Represents a single square on the floor.
@@ -11,6 +12,7 @@ export class FloorCell {
   private _color: number[] = [0,0,0];
   private _sensorValue: boolean = false;
   private _fadeCtrl: FadeController;
+  private _effect: NodeEffect = null;
   private _changeSubject: Subject<IFloorCellChange> = new Subject<IFloorCellChange>();
 
   /**
@@ -78,6 +80,27 @@ export class FloorCell {
     return this._fadeCtrl.isFading;
   }
 
+  /**
+   * The effect running on this cell's node (null when there isn't one).
+   */
+  get effect(): NodeEffect {
+    return this._effect;
+  }
+
+  /**
+   * The color this cell is fading to (or its color, when it's not fading).
+   */
+  get fadeTarget(): number[] {
+    return this._fadeCtrl.targetColor.slice(0, 3);
+  }
+
+  /**
+   * How many milliseconds are left in the current fade (0 when not fading).
+   */
+  get fadeRemaining(): number {
+    return this._fadeCtrl.remaining;
+  }
+
   /**
    * Set this cell to a specific RGB color.
    * @param {byte[]} color An array of colors.
@@ -88,6 +111,7 @@ export class FloorCell {
   */
   setColor(color: number[], stopFade: boolean = true) {
     color = color.slice(0, 3);
+    this._effect = null;
 
     // Currently fading
     if (this._fadeCtrl.isFading) {
@@ -118,10 +142,29 @@ export class FloorCell {
    * @return {Promise} Promise that resolves when the fade is complete
    */
   fadeToColor(toColor: number[], duration: number): Promise<FloorCell> {
+    this._effect = null;
     let promise = this._fadeCtrl.startFade(this._color.slice(0,3), toColor, duration);
     return promise;
   }
   
+  /**
+   * Run a repeating effect on this cell's node, until the next color or fade.
+   * (the cell color isn't updated while the effect runs)
+   *
+   * @param {NodeEffect} effect The effect to run.
+   */
+  runEffect(effect: NodeEffect): void {
+    if (this._fadeCtrl.isFading) {
+      this._fadeCtrl.stopFade();
+    }
+    this._effect = effect;
+
+    this._changeSubject.next({
+      type: 'effect',
+      value: effect
+    });
+  }
+
   /**
    * If the cell is fading, update the color for the current time.
    */
@@ -152,10 +195,10 @@ export class FloorCell {
  */
 export interface IFloorCellChange {
   /**
-   * What type of change occurred: color or sensor
+   * What type of change occurred: color, sensor or effect
    * @type String
    */
-  type: "color" | "sensor";
+  type: "color" | "sensor" | "effect";
 
   /**
    * What is the new value for this type of change. 
@@ -0,0 +1,79 @@
+/**
+ * Repeating light effects that run on the floor nodes themselves,
+ * so the floor keeps animating without a color being sent every frame.
+ * (see effect.h in the node firmware)
+ *
+ * Example:
+ * ```
+ * import { EFFECT } from '../shared/node-effect';
+ *
+ * // Breathe blue, with a wave running across the floor
+ * floorCellList.runEffect({
+ *   type: EFFECT.BREATHE,
+ *   colorA: [0, 0, 255],
+ *   colorB: [0, 0, 20],
+ *   period: 2000,
+ *   phase: 16
+ * });
+ * ```
+ */
+
+// Effect types
+export const EFFECT = {
+  PULSE:   1, // Jump to colorA, then fade to colorB over the period
+  STROBE:  2, // colorA for param/256 of the period, then colorB
+  BREATHE: 3, // Ease from colorB to colorA and back, over the period
+  CYCLE:   4, // Go around the color wheel over the period, at param brightness
+  FLASH:   5  // Show colorB, and when touched, flash colorA and fade back to colorB over the period
+};
+
+export interface NodeEffect {
+  /**
+   * The effect type (see EFFECT)
+   * @type number
+   */
+  type: number;
+
+  /**
+   * The effect colors
+   * @type number[]
+   */
+  colorA?: number[];
+  colorB?: number[];
+
+  /**
+   * How long each repeat of the effect takes, in milliseconds (up to 65535)
+   * @type number
+   */
+  period: number;
+
+  /**
+   * How far each node is behind the one before it (by address), in 1/256ths of the period
+   * @type number
+   */
+  phase?: number;
+
+  /**
+   * Extra effect setting (see EFFECT)
+   * @type number
+   */
+  param?: number;
+}
+
+/**
+ * Encode an effect as CMD_SET_EFFECT data.
+ */
+export function encodeEffect(effect:NodeEffect): number[] {
+  let a = effect.colorA || [0, 0, 0],
+      b = effect.colorB || [0, 0, 0],
+      period = Math.max(1, Math.min(Math.round(effect.period), 0xFFFF));
+
+  return [
+    effect.type,
+    a[0], a[1], a[2],
+    b[0], b[1], b[2],
+    period >> 8, period & 0xFF,
+    (effect.phase || 0) & 0xFF,
+    (effect.param || 0) & 0xFF
+  ];
+}